@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 
 #include <string.h>         //memset()
@@ -12,19 +13,34 @@
 #include <sys/errno.h>      //errno
 #include <sys/stat.h>       //struct stat
 #include <fcntl.h>          //open()
+#include <poll.h>           //poll()
+#include <signal.h>         //signal()
+
+#include "httpparse.h"      //http_parse_request()
 
 
 #define BUFFER_SIZE 6000
+#define IDLE_TIMEOUT 5      // seconds a kept-alive connection may wait for its next request
+#define MAX_REQUESTS 100    // requests served on one connection before it is closed
 
 // Global string objects for error messages
-static const char suc201[] = " 201 Created\r\n\r\n";
-static const char err400[] = " 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
-static const char err403[] = " 403 Forbidden\r\nContent-Length: 0\r\n\r\n";
-static const char err404[] = " 404 Not Found\r\nContent-Length: 0\r\n\r\n";
-static const char err500[] = " 500 Internal Server Error\r\nContent-Length: 0\r\n\r\n";
-static const char err501[] = " 501 Not Implemented\r\nContent-Length: 0\r\n\r\n";
+// The header block is ended in construct_http_response(), after any Connection header
+static const char suc201[] = " 201 Created\r\nContent-Length: 8\r\n";
+static const char err400[] = " 400 Bad Request\r\nContent-Length: 0\r\n";
+static const char err403[] = " 403 Forbidden\r\nContent-Length: 0\r\n";
+static const char err404[] = " 404 Not Found\r\nContent-Length: 0\r\n";
+static const char err500[] = " 500 Internal Server Error\r\nContent-Length: 0\r\n";
+static const char err501[] = " 501 Not Implemented\r\nContent-Length: 0\r\n";
+static const char cont100[] = "HTTP/1.1 100 Continue\r\n\r\n";
 static const char create[] = "Created\n";
 
+// Connection reuse counters, reported by GET /metrics
+static long stat_connections = 0;
+static long stat_requests = 0;
+static long stat_reused = 0;
+static long stat_idle_closed = 0;
+static long stat_max_closed = 0;
+
 /*
    Converts a string to an 16 bits unsigned integer.
    Returns 0 if the string is malformed or out of the range.
@@ -60,7 +76,13 @@ struct httpObject {
     char httpversion[9];        // HTTP/1.1
     ssize_t content_length;     // example: 13
     ssize_t header_length;      // example: 10
+    ssize_t received_length;    // bytes in buffer, may run into the next request
+    ssize_t body_offset;        // where the body starts in buffer
+    ssize_t request_length;     // header plus body length of this request
     int status_code;            // example: 404
+    int keep_alive;             // 0, 1
+    char body[128];             // generated response bodies, such as /metrics
+    struct http_request request;    // parser state, offsets into buffer
     uint8_t header[BUFFER_SIZE];
     uint8_t buffer[BUFFER_SIZE];
 };
@@ -195,70 +217,121 @@ ssize_t send_full(int fd, uint8_t *buff, ssize_t size, int filedesc) {
 /*
 * read_http_response()
 * Reads request from client and stores information into httpObject message
+* The buffer may already hold the start of the request, left over from the previous one
 */
 void read_http_response(int connfd, struct httpObject* message) {
-    
-    memset(message->buffer, 0, BUFFER_SIZE);
-    int readcheck = recv(connfd, message->buffer, BUFFER_SIZE, 0);
-    char* cont = NULL;
-    cont = strstr((char *) message->buffer, "100-continue\r\n");
-    char* lengthRead = NULL;
-    lengthRead = strstr((char*)message->buffer, "Content-Length: ");
-    int finalLength;
-
-    if (lengthRead) {
-      sscanf(lengthRead, "Content-Length: %d", &finalLength);
-      int total = 0;
-      int offset = readcheck;
-      while (cont && total < finalLength) {
-        readcheck = recv(connfd, message->buffer+offset+total, BUFFER_SIZE, 0);
-        total += readcheck;
-        cont = strstr((char *) message->buffer+readcheck, "100-continue\r\n");
+
+    struct http_request *request = &(message->request);
+    int state = http_parse_request(request, (char *) message->buffer, message->received_length);
+
+    while (state == HTTP_PARSE_AGAIN && message->received_length < BUFFER_SIZE - 1) {
+      int readcheck = recv(connfd, message->buffer + message->received_length, BUFFER_SIZE - 1 - message->received_length, 0);
+      if (readcheck <= 0) {
+        if (readcheck == -1 && message->received_length > 0) {
+          message->status_code = 500;
+        }
+        break;
       }
+      message->received_length += readcheck;
+      message->buffer[message->received_length] = '\0';
+      state = http_parse_request(request, (char *) message->buffer, message->received_length);
     }
-    if (readcheck == -1) {
-      message->status_code = 500;
+    if (message->received_length == 0) {
+      return;
+    }
+
+    if (state != HTTP_PARSE_DONE) {
+      // malformed, or the headers never ended, the rest of this connection can't be trusted
+      message->body_offset = message->received_length;
+      message->request_length = message->received_length;
+      message->keep_alive = 0;
+      if (message->status_code == 0) {
+        message->status_code = 400;
+      }
+      return;
+    }
+    message->body_offset = request->header_length;
+
+    // HTTP/1.1 connections stay open unless the client asks to close
+    message->keep_alive = http_span_equals((char *) message->buffer, request->version, "HTTP/1.1");
+    if (request->connection_close) {
+      message->keep_alive = 0;
+    }
+    else if (request->connection_keep_alive) {
+      message->keep_alive = 1;
+    }
+
+    message->request_length = message->body_offset + (request->content_length > 0 ? request->content_length : 0);
+
+    // the client holds the body back until told to go on
+    if (request->expect_continue && message->received_length < message->request_length) {
+      send_full(connfd, (uint8_t *)cont100, strlen(cont100), -1);
     }
 
     return;
 }
 
+/*
+ * metrics()
+ * Reports the connection reuse counters, one "name value" per line
+ */
+void metrics(struct httpObject* message) {
+    if (strcmp(message->method, "GET") != 0) {
+      message->status_code = 403;
+      return;
+    }
+
+    snprintf(message->body, sizeof message->body,
+             "connections %ld\nrequests %ld\nreused_requests %ld\nidle_closed %ld\nmax_requests_closed %ld\n",
+             stat_connections, stat_requests, stat_reused, stat_idle_closed, stat_max_closed);
+    message->content_length = strlen(message->body);
+    message->status_code = 200;
+}
+
 /*
 * process_request()
 * Validating request, assigns status code, then performs corresponding task
 */
-void process_request(struct httpObject* message) {
+void process_request(int connfd, struct httpObject* message) {
  
-    char methodRead[6];
-    char filenameRead[28];
-    char httpversionRead[9];
+    // the request line and headers were parsed as they arrived, see read_http_response()
+    struct http_request *request = &(message->request);
+    char *buff = (char *) message->buffer;
     struct stat st;
-    char* hostRead = NULL;
-    
-    hostRead = strstr((char *) message->buffer, "Host: ");
-    
-    if (hostRead != NULL) {
-        sscanf( (char *)message->buffer, "Host: %s\n", message->host);
+
+    if (message->status_code == 500) {
+      message->keep_alive = 0;
+      return;
     }
-    
-    sscanf((char *)message->buffer, "%s %s %s", methodRead, filenameRead, httpversionRead);
-    strcpy(message->httpversion, httpversionRead);
+    strcpy(message->httpversion, "HTTP/1.1");
+    if (message->status_code == 400) {
+      return;
+    }
+    http_span_copy(message->httpversion, sizeof message->httpversion, buff, request->version);
 
-    if (strlen(methodRead) > 5 || strlen(filenameRead) > 27 || strlen(httpversionRead) > 8 || hostRead == NULL) {
+    if (request->method.length > 5 || !request->has_host ||
+        http_span_copy(message->filename + 1, sizeof message->filename - 1, buff, request->target) < 0) {
       message->status_code = 400;
     }
-    else if (strcmp(methodRead, "GET") != 0 && strcmp(methodRead, "PUT") != 0 && strcmp(methodRead, "HEAD") != 0) {
+    else if (!http_span_equals(buff, request->method, "GET") && !http_span_equals(buff, request->method, "PUT") &&
+             !http_span_equals(buff, request->method, "HEAD")) {
       message->status_code = 501;
     }
-
-    else if (strcmp(methodRead, "GET") == 0 || strcmp(methodRead, "HEAD") == 0) {
+    else if (http_span_equals(buff, request->method, "GET") || http_span_equals(buff, request->method, "HEAD")) {
       
-      strcpy(message->method, methodRead);
-      strcpy(message->filename, ".");
-      strcat(message->filename, filenameRead);
+      http_span_copy(message->method, sizeof message->method, buff, request->method);
+      message->filename[0] = '.';
+
+      if (strcmp(message->filename, "./metrics") == 0) {
+        metrics(message);
+        return;
+      }
 
       int filedesc = open(message->filename, O_RDONLY);
       int filespec = stat(message->filename, &st);
+      if (filedesc != -1) {
+        close(filedesc);
+      }
       
       if (filedesc == -1 || filespec == -1) {
         if (errno == EACCES) {
@@ -271,24 +344,43 @@ void process_request(struct httpObject* message) {
          message->status_code = 200;
       }
     }
-    else if (strcmp(methodRead, "PUT") == 0) {
-      int length = 0;
-      char* data;
-      char* clp;
+    else if (http_span_equals(buff, request->method, "PUT")) {
+      ssize_t length = message->request_length - message->body_offset;
+      ssize_t stored = 0;
       int filedesc;
 
-      strcpy(message->method, methodRead);
-      strcpy(message->filename, ".");
-      strcat(message->filename, filenameRead);
-      clp = strstr((char *) message->buffer, "Content-Length: ");
-      sscanf(clp, "Content-Length: %d", &length);
+      http_span_copy(message->method, sizeof message->method, buff, request->method);
+      message->filename[0] = '.';
       message->content_length = length;
-      data = strstr((char *) message->buffer, "\r\n\r\n");
-      filedesc = open(message->filename, O_CREAT | O_RDWR, 0600);
-      write(filedesc, data+4, length);
+      filedesc = open(message->filename, O_CREAT | O_TRUNC | O_RDWR, 0600);
+
+      // the head of the body came in with the header, the rest is still on the socket
+      ssize_t buffered = message->received_length - message->body_offset;
+      if (buffered > length) {
+        buffered = length;
+      }
+      write(filedesc, message->buffer + message->body_offset, buffered);
+      stored = buffered;
+      while (stored < length) {
+        ssize_t chunk = length - stored < BUFFER_SIZE ? length - stored : BUFFER_SIZE;
+        ssize_t readcheck = recv(connfd, message->header, chunk, 0);
+        if (readcheck <= 0) {
+          break;
+        }
+        write(filedesc, message->header, readcheck);
+        stored += readcheck;
+      }
       close(filedesc);
+      memset(message->header, 0, BUFFER_SIZE);
 
-      message->status_code = 201;
+      if (stored < length) {
+        // the client went away mid-body, the rest of this connection can't be trusted
+        message->keep_alive = 0;
+        message->status_code = 500;
+      }
+      else {
+        message->status_code = 201;
+      }
     }
     else {
       message->status_code = 500;
@@ -302,12 +394,13 @@ void process_request(struct httpObject* message) {
 */
 void construct_http_response(struct httpObject* message) {
 
+    message->header[0] = '\0';
     strcat((char *)message->header, message->httpversion);
     
     if (message->status_code == 200) {
       strcat((char *)message->header, " 200 OK\r\n");
       char lengthStr[28];
-      sprintf(lengthStr, "Content-Length: %ld\r\n\r\n", message->content_length);
+      sprintf(lengthStr, "Content-Length: %ld\r\n", message->content_length);
       strcat((char *)message->header, lengthStr);
     }
     else {     
@@ -332,6 +425,14 @@ void construct_http_response(struct httpObject* message) {
           break;
       }
     }
+    // a request that went wrong leaves the rest of the connection unreadable
+    if (message->status_code == 400 || message->status_code == 500) {
+      message->keep_alive = 0;
+    }
+    if (message->keep_alive == 0) {
+      strcat((char *)message->header, "Connection: close\r\n");
+    }
+    strcat((char *)message->header, "\r\n");
     message->header_length = strlen((char *)message->header);
 
     return;
@@ -345,46 +446,124 @@ void send_http_response(int connfd, struct httpObject* message) {
 
     send_full(connfd, message->header, message->header_length, -1);
 
-    if (message->content_length > 0 && strcmp("PUT", message->method) != 0) {
-        int filedesc = open(message->filename, O_RDONLY);
-        memset(message->buffer, 0, BUFFER_SIZE);
-        send_full(connfd, message->buffer, message->content_length, filedesc);
+    // HEAD gets the length of the body but never the body itself
+    if (message->status_code == 200 && strcmp("GET", message->method) == 0 && message->content_length > 0) {
+        if (strcmp(message->filename, "./metrics") == 0) {
+            send_full(connfd, (uint8_t *)message->body, message->content_length, -1);
+        }
+        else {
+            // the header is out, its buffer carries the file so the next request in buffer survives
+            int filedesc = open(message->filename, O_RDONLY);
+            send_full(connfd, message->header, message->content_length, filedesc);
+            close(filedesc);
+        }
     }
     if (message->status_code == 201) {
-        send_full(connfd, (uint8_t *)create, sizeof(create), -1);
+        send_full(connfd, (uint8_t *)create, strlen(create), -1);
     }
 }
 
 /*
  * clear_httpObject()
  * reset all data in an httpObject
+ * Bytes received past the end of the current request are moved to the front of the buffer
  */
 void clear_httpObject(struct httpObject* message) {
+    ssize_t pending = message->received_length - message->request_length;
+    if (pending > 0 && message->request_length > 0) {
+      memmove(message->buffer, message->buffer + message->request_length, pending);
+      message->received_length = pending;
+    }
+    else {
+      message->received_length = 0;
+    }
     strcpy(message->method, "");
     strcpy(message->filename, "");
     strcpy(message->httpversion, "");
     message->content_length = 0;
     message->header_length = 0;
+    message->body_offset = 0;
+    message->request_length = 0;
     message->status_code = 0;
+    message->keep_alive = 0;
     strcpy((char *)message->header, "");
-    strcpy((char *)message->buffer, "");
+    strcpy(message->body, "");
+    http_request_init(&(message->request));
+    message->buffer[message->received_length] = '\0';
+}
+
+/*
+* wait_for_request()
+* Waits up to timeout seconds for the next request on a keep-alive connection
+* The server serves one connection at a time, so an idle one also gives way to a new client on listenfd
+* Returns 0 when the connection should be closed instead
+*/
+int wait_for_request(int connfd, int listenfd, int timeout) {
+    struct pollfd pfd[2];
+    pfd[0].fd = connfd;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd = listenfd;
+    pfd[1].events = POLLIN;
+
+    int ret;
+    do {
+      ret = poll(pfd, listenfd == -1 ? 1 : 2, timeout > 0 ? timeout * 1000 : -1);
+    } while (ret < 0 && errno == EINTR);
+    return ret > 0 && (pfd[0].revents & (POLLIN | POLLHUP)) != 0;
 }
 
 /*
 * handle_connection()
-* To perform the full task in series:
+* To perform the full task in series, once per request on the connection:
 * Read Message -> Process Request -> Create Response -> Send Response
 */
-void handle_connection(int connfd) {
+void handle_connection(int connfd, int listenfd, int idle_timeout, int max_requests) {
     struct httpObject message;
-    read_http_response(connfd, &message);
-    
-    process_request(&message);
-    
-    construct_http_response(&message);
+    int requests = 0;
 
-    send_http_response(connfd, &message);
+    message.received_length = 0;
+    message.request_length = 0;
     clear_httpObject(&message);
+    stat_connections += 1;
+
+    do {
+      // a pipelined request may already be in the buffer, the first request is waited for alone
+      if (message.received_length == 0 && idle_timeout > 0 &&
+          !wait_for_request(connfd, requests > 0 ? listenfd : -1, idle_timeout)) {
+        stat_idle_closed += 1;
+        break;
+      }
+
+      read_http_response(connfd, &message);
+      if (message.received_length == 0) {
+        // client closed the connection
+        break;
+      }
+
+      requests += 1;
+      stat_requests += 1;
+      if (requests > 1) {
+        stat_reused += 1;
+      }
+      if (idle_timeout == 0) {
+        message.keep_alive = 0;
+      }
+      else if (requests >= max_requests && message.keep_alive == 1) {
+        stat_max_closed += 1;
+        message.keep_alive = 0;
+      }
+
+      process_request(connfd, &message);
+
+      construct_http_response(&message);
+
+      send_http_response(connfd, &message);
+      if (message.keep_alive == 0) {
+        break;
+      }
+      clear_httpObject(&message);
+    } while (1);
 
     // when done, close socket
     close(connfd);
@@ -399,15 +578,35 @@ void handle_connection(int connfd) {
 int main(int argc, char *argv[]) {
   int listenfd;
   uint16_t port;
-
-  if (argc != 2) {
-    errx(EXIT_FAILURE, "wrong arguments: %s port_num", argv[0]);
+  int idle_timeout = IDLE_TIMEOUT;
+  int max_requests = MAX_REQUESTS;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "k:K:")) != -1) {
+    switch (opt) {
+      case 'k':
+        idle_timeout = atoi(optarg);
+        break;
+      case 'K':
+        max_requests = atoi(optarg);
+        if (max_requests <= 0) {
+          errx(EXIT_FAILURE, "invalid max requests per connection: %s", optarg);
+        }
+        break;
+      default:
+        errx(EXIT_FAILURE, "wrong arguments: %s [-k idle_timeout] [-K max_requests] port_num", argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    errx(EXIT_FAILURE, "wrong arguments: %s [-k idle_timeout] [-K max_requests] port_num", argv[0]);
   }
-  port = strtouint16(argv[1]);
+  port = strtouint16(argv[optind]);
   if (port == 0) {
-    errx(EXIT_FAILURE, "invalid port number: %s", argv[1]);
+    errx(EXIT_FAILURE, "invalid port number: %s", argv[optind]);
   }
   listenfd = create_listen_socket(port);
+  // a client closing its socket early must not kill the server
+  signal(SIGPIPE, SIG_IGN);
 
   while(1) {
     int connfd = accept(listenfd, NULL, NULL);
@@ -415,7 +614,10 @@ int main(int argc, char *argv[]) {
       warn("accept error");
       continue;
     }
-      handle_connection(connfd);
+    // header and body are separate sends, don't let the body wait for the header's ACK
+    int nodelay = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay);
+      handle_connection(connfd, listenfd, idle_timeout, max_requests);
   }
   return EXIT_SUCCESS;
 }
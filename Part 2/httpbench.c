@@ -0,0 +1,1344 @@
+/*
+ * httpbench.c
+ * Benchmarks for httpserver.c
+ *
+ * The server source is compiled into this program, so every benchmark runs
+ * the same functions the server runs instead of a copy of them.
+ *
+ * Usage: ./httpbench mode [options]
+ *     sendfile [-s sizes] [-b bytes]     GET body path: pread/send vs splice vs sendfile
+ *     pipeline [-d depths] [-n requests] [-s size] [-N threads] [-E] [-c]
+ *                                        requests/sec for pipelined small GETs on one connection,
+ *                                        or with -c on a new connection for every batch
+ *     parse [-n requests] [-c chunk]     ns/request for the request parser, whole or arriving in chunks
+ *     hex [-n bodies] [-s sizes]         ns/body for hex encoding the head of a logged body
+ *     log [-n lines] [-N threads] [-F flush_ms]
+ *                                        lines/sec through log_request() from several threads at once
+ *     pool [-n tasks] [-N workers] [-w work]
+ *                                        tasks/sec through the thread pool, queued from outside it or by its workers
+ *     accept [-n connections] [-c clients] [-N threads] [-E] [-P]
+ *                                        connections/sec, each for one small GET, from several clients at once
+ *     latency [-n requests] [-c clients] [-s size] [-N threads] [-E] [-P] [-C cpu_list]
+ *                                        latency percentiles of GETs from several keep-alive clients at once
+ *     mixed [-n requests] [-c clients] [-l large_clients] [-s size] [-S large_size] [-N threads] [-E] [-u] [-J large_bytes]
+ *                                        latency percentiles of small GETs, each on a new connection,
+ *                                        while other clients GET (or with -u PUT) a large object nonstop
+ */
+#define main httpserver_main
+#include "httpserver.c"
+#undef main
+
+#include <time.h>           //clock_gettime()
+
+#define BENCH_MIN_BYTES 268435456   // move at least 256 MB per measurement
+#define DRAIN_SIZE 262144
+#define BENCH_PORT 18080
+
+/*
+ * now_ns()
+ * reads a clock in nanoseconds
+ */
+static long long now_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * parse_size_list()
+ * reads a comma separated list of sizes such as "4096,1048576"
+ */
+static int parse_size_list(char *list, long long *sizes, int max) {
+    int count = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(list, ",", &save); tok != NULL && count < max; tok = strtok_r(NULL, ",", &save)) {
+        sizes[count] = atoll(tok);
+        if (sizes[count] > 0) {
+            count += 1;
+        }
+    }
+    return count;
+}
+
+/*
+ * connect_loopback()
+ * creates a connected pair of TCP sockets over 127.0.0.1
+ */
+static void connect_loopback(int *sender, int *receiver) {
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof addr;
+
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    if (listenfd < 0 || bind(listenfd, (struct sockaddr*)&addr, sizeof addr) < 0 || listen(listenfd, 1) < 0) {
+        err(EXIT_FAILURE, "loopback listen error");
+    }
+    getsockname(listenfd, (struct sockaddr*)&addr, &addrlen);
+
+    *sender = socket(AF_INET, SOCK_STREAM, 0);
+    if (*sender < 0 || connect(*sender, (struct sockaddr*)&addr, sizeof addr) < 0) {
+        err(EXIT_FAILURE, "loopback connect error");
+    }
+    *receiver = accept(listenfd, NULL, NULL);
+    if (*receiver < 0) {
+        err(EXIT_FAILURE, "loopback accept error");
+    }
+    close(listenfd);
+}
+
+/*
+ * drain_thread()
+ * reads and discards everything sent to the receiving socket
+ */
+static void *drain_thread(void *arg) {
+    int fd = *(int *)arg;
+    char *buff = malloc(DRAIN_SIZE);
+    while (recv(fd, buff, DRAIN_SIZE, 0) > 0) {
+    }
+    free(buff);
+    return NULL;
+}
+
+/*
+ * make_object()
+ * writes a file of the given size into the page cache
+ */
+static int make_object(const char *path, long long size) {
+    char chunk[65536];
+    for (int i = 0; i < (int)sizeof chunk; i++) {
+        chunk[i] = 'a' + (i % 26);
+    }
+    int filedesc = open(path, O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if (filedesc < 0) {
+        err(EXIT_FAILURE, "open %s", path);
+    }
+    for (long long done = 0; done < size; ) {
+        ssize_t n = size - done < (long long)sizeof chunk ? size - done : (long long)sizeof chunk;
+        n = write(filedesc, chunk, n);
+        if (n <= 0) {
+            err(EXIT_FAILURE, "write %s", path);
+        }
+        done += n;
+    }
+    return filedesc;
+}
+
+/*
+ * bench_sendfile()
+ * Compares the three GET body paths of send_http_response():
+ * the old pread()/send() copy loop, splice() through a pipe, and sendfile().
+ * CPU is the sending thread's CPU time, the part the server pays per byte.
+ */
+static int bench_sendfile(int argc, char *argv[]) {
+    long long sizes[16] = { 4096, 1048576, 1073741824 };
+    int size_count = 3;
+    long long min_bytes = BENCH_MIN_BYTES;
+    const char *paths[] = { "pread/send", "splice", "sendfile" };
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:b:")) != -1) {
+        switch (opt) {
+            case 's':
+                size_count = parse_size_list(optarg, sizes, 16);
+                break;
+            case 'b':
+                min_bytes = atoll(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s sendfile [-s sizes] [-b min_bytes]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    uint8_t *buff = malloc(BUFFER_SIZE);
+    printf("%-12s %12s %8s %12s %14s\n", "path", "object", "iters", "MB/s", "cpu ns/byte");
+
+    for (int s = 0; s < size_count; s++) {
+        char path[64];
+        snprintf(path, sizeof path, "/tmp/httpbench.%d", (int)getpid());
+        int filedesc = make_object(path, sizes[s]);
+        long long iters = min_bytes / sizes[s] > 0 ? min_bytes / sizes[s] : 1;
+
+        for (int p = 0; p < 3; p++) {
+            int sender, receiver;
+            pthread_t drainer;
+            connect_loopback(&sender, &receiver);
+            pthread_create(&drainer, NULL, drain_thread, &receiver);
+
+            long long wall = now_ns(CLOCK_MONOTONIC);
+            long long cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+            for (long long i = 0; i < iters; i++) {
+                if (p == 0) {
+                    send_full(sender, buff, sizes[s], filedesc);
+                }
+                else if (p == 1) {
+                    splice_full(sender, filedesc, sizes[s]);
+                }
+                else {
+                    send_file_full(sender, filedesc, sizes[s], buff);
+                }
+            }
+            cpu = now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+            shutdown(sender, SHUT_WR);
+            pthread_join(drainer, NULL);
+            wall = now_ns(CLOCK_MONOTONIC) - wall;
+            close(sender);
+            close(receiver);
+
+            double bytes = (double)sizes[s] * iters;
+            printf("%-12s %12lld %8lld %12.1f %14.3f\n", paths[p], sizes[s], iters,
+                   bytes / 1048576.0 / (wall / 1e9), cpu / bytes);
+        }
+        close(filedesc);
+        unlink(path);
+    }
+    free(buff);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * server_thread()
+ * runs the server's main() with the arguments in arg
+ */
+static void *server_thread(void *arg) {
+    char **args = (char **)arg;
+    int count = 0;
+    while (args[count] != NULL) {
+        count += 1;
+    }
+    optind = 1;
+    httpserver_main(count, args);
+    return NULL;
+}
+
+/*
+ * start_server()
+ * starts the server inside this process and waits until it accepts connections
+ */
+static void start_server(char **args, uint16_t port) {
+    pthread_t server;
+    struct sockaddr_in addr;
+
+    pthread_create(&server, NULL, server_thread, args);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    for (int tries = 0; tries < 500; tries++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr*)&addr, sizeof addr) == 0) {
+            close(fd);
+            return;
+        }
+        close(fd);
+        usleep(10000);
+    }
+    errx(EXIT_FAILURE, "server did not start on port %d", port);
+}
+
+/*
+ * connect_server()
+ * opens a connection to the server started by start_server()
+ */
+static int connect_server(void) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(BENCH_PORT);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof addr) < 0) {
+        err(EXIT_FAILURE, "connect");
+    }
+    return fd;
+}
+
+/*
+ * bench_pipeline()
+ * Fetches a small object over one keep-alive connection, sending depth requests
+ * before reading their responses. Depth 1 is plain keep-alive without pipelining.
+ * With -c every batch goes over a new connection that is closed after it,
+ * with -l the server logs every request.
+ */
+static int bench_pipeline(int argc, char *argv[]) {
+    long long depths[16] = { 1, 4, 16, 64 };
+    int depth_count = 4;
+    long long requests = 100000;
+    long long size = 64;
+    char *threads = "4";
+    int event = 0;
+    int reconnect = 0;
+    int logging = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:s:N:Ecl")) != -1) {
+        switch (opt) {
+            case 'd':
+                depth_count = parse_size_list(optarg, depths, 16);
+                break;
+            case 'n':
+                requests = atoll(optarg);
+                break;
+            case 's':
+                size = atoll(optarg);
+                break;
+            case 'N':
+                threads = optarg;
+                break;
+            case 'E':
+                event = 1;
+                break;
+            case 'c':
+                reconnect = 1;
+                break;
+            case 'l':
+                logging = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s pipeline [-d depths] [-n requests] [-s size] [-N threads] [-E] [-c] [-l]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    // the server serves from the working directory
+    char dir[] = "/tmp/httpbench.XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) < 0) {
+        err(EXIT_FAILURE, "mkdtemp");
+    }
+    close(make_object("small.txt", size));
+
+    char port[8];
+    snprintf(port, sizeof port, "%d", BENCH_PORT);
+    char *args[10] = { "httpserver", "-N", threads, "-K", "1000000000" };
+    int arg_count = 5;
+    if (event == 1) {
+        args[arg_count++] = "-E";
+    }
+    if (logging == 1) {
+        args[arg_count++] = "-l";
+        args[arg_count++] = "bench.log";
+    }
+    args[arg_count++] = port;
+    args[arg_count] = NULL;
+    start_server(args, BENCH_PORT);
+
+    char request[] = "GET /small.txt HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    char header[128];
+    snprintf(header, sizeof header, "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\n\r\n", size);
+    long long response_length = strlen(header) + size;
+
+    printf("%-8s %6s %10s %12s %12s\n", "mode", "depth", "requests", "req/s", "us/request");
+    for (int d = 0; d < depth_count; d++) {
+        long long depth = depths[d];
+        char *batch = malloc(depth * (sizeof request - 1));
+        for (long long i = 0; i < depth; i++) {
+            memcpy(batch + i * (sizeof request - 1), request, sizeof request - 1);
+        }
+        char *responses = malloc(depth * response_length);
+
+        long long done = 0;
+        long long wall = now_ns(CLOCK_MONOTONIC);
+        int fd = connect_server();
+        while (done < requests) {
+            if (reconnect == 1 && done > 0) {
+                close(fd);
+                fd = connect_server();
+            }
+            if (send_full(fd, (uint8_t *)batch, depth * (sizeof request - 1), -1) < 0 ||
+                recv_full(fd, (uint8_t *)responses, depth * response_length) != depth * response_length) {
+                errx(EXIT_FAILURE, "connection lost after %lld requests", done);
+            }
+            done += depth;
+        }
+        wall = now_ns(CLOCK_MONOTONIC) - wall;
+        if (strncmp(responses + (depth - 1) * response_length, header, strlen(header)) != 0) {
+            errx(EXIT_FAILURE, "unexpected response");
+        }
+        close(fd);
+
+        printf("%-8s %6lld %10lld %12.0f %12.2f\n", reconnect ? (event ? "event/c" : "threads/c") : (event ? "event" : "threads"), depth, done,
+               done / (wall / 1e9), wall / 1e3 / done);
+        free(batch);
+        free(responses);
+    }
+
+    unlink("small.txt");
+    unlink("bench.log");
+    rmdir(dir);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * bench_parse()
+ * Parses typical requests over and over: the parser alone on a complete request,
+ * the parser fed chunk bytes at a time as if each came from its own recv(),
+ * and parse_http_headers(), which also copies the fields into the httpObject
+ */
+static int bench_parse(int argc, char *argv[]) {
+    long long requests = 1000000;
+    long long chunk = 16;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:")) != -1) {
+        switch (opt) {
+            case 'n':
+                requests = atoll(optarg);
+                break;
+            case 'c':
+                chunk = atoll(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s parse [-n requests] [-c chunk]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (chunk <= 0) {
+        errx(EXIT_FAILURE, "invalid chunk size: %lld", chunk);
+    }
+
+    const char *samples[] = {
+        "GET /small.txt HTTP/1.1\r\nHost: localhost\r\n\r\n",
+        "GET /file1.txt HTTP/1.1\r\nUser-Agent: curl/7.81.0\r\nAccept: */*\r\nHost: localhost:8080\r\n\r\n",
+        "PUT /file2.txt HTTP/1.1\r\nHost: localhost:8080\r\nUser-Agent: curl/7.81.0\r\nAccept: */*\r\n"
+        "Content-Length: 13\r\nExpect: 100-continue\r\nConnection: keep-alive\r\n\r\n",
+    };
+    const char *names[] = { "parser", "parser/chunk", "parse_http_headers" };
+    int sample_count = sizeof samples / sizeof samples[0];
+    struct httpObject *message = request_context_get();
+    struct http_request request;
+    long long checksum = 0;
+
+    printf("%-20s %8s %12s %12s\n", "path", "bytes", "requests", "ns/request");
+    for (int path = 0; path < 3; path++) {
+        for (int s = 0; s < sample_count; s++) {
+            size_t length = strlen(samples[s]);
+            memcpy(message->buffer, samples[s], length + 1);
+
+            long long cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+            for (long long i = 0; i < requests; i++) {
+                if (path == 0) {
+                    http_request_init(&request);
+                    checksum += http_parse_request(&request, (char *) message->buffer, length);
+                    checksum += request.header_length;
+                }
+                else if (path == 1) {
+                    http_request_init(&request);
+                    for (size_t received = (size_t)chunk < length ? (size_t)chunk : length; ; received += chunk) {
+                        if (received > length) {
+                            received = length;
+                        }
+                        if (http_parse_request(&request, (char *) message->buffer, received) != HTTP_PARSE_AGAIN ||
+                            received == length) {
+                            break;
+                        }
+                    }
+                    checksum += request.header_length;
+                }
+                else {
+                    http_request_init(&(message->request));
+                    message->received_length = length;
+                    message->status_code = 0;
+                    parse_http_headers(message);
+                    checksum += message->request_length + message->status_code;
+                }
+            }
+            cpu = now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+            printf("%-20s %8zu %12lld %12.1f\n", names[path], length, requests, (double)cpu / requests);
+        }
+    }
+    request_context_put(message);
+    // keeps the loops from being optimized away
+    return checksum == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * hex_encode_sprintf()
+ * The encoder log_request() used before hex_encode(), one sprintf() per byte
+ */
+static char *hex_encode_sprintf(char *dest, const uint8_t *src, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        sprintf(dest + (i*2), "%02hhx", src[i]);
+    }
+    return dest + length * 2;
+}
+
+/*
+ * bench_hex()
+ * Hex encodes bodies of each size with every encoder the CPU can run,
+ * after checking that they all write what sprintf("%02hhx") writes
+ */
+static int bench_hex(int argc, char *argv[]) {
+    long long sizes[16] = { 16, 64, 1000 };
+    int size_count = 3;
+    long long bodies = 100000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                bodies = atoll(optarg);
+                break;
+            case 's':
+                size_count = parse_size_list(optarg, sizes, 16);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s hex [-n bodies] [-s sizes]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    struct {
+        const char *name;
+        char *(*encode)(char *, const uint8_t *, size_t);
+        int supported;
+    } encoders[] = {
+        { "sprintf", hex_encode_sprintf, 1 },
+        { "scalar", hex_encode_scalar, 1 },
+#if defined(__x86_64__)
+        { "sse2", hex_encode_sse2, 1 },
+        { "avx2", hex_encode_avx2, __builtin_cpu_supports("avx2") },
+#endif
+        { "hex_encode", hex_encode, 1 },
+    };
+    int encoder_count = sizeof encoders / sizeof encoders[0];
+    long long checksum = 0;
+
+    printf("%-12s %8s %12s %12s %12s\n", "encoder", "bytes", "bodies", "ns/body", "MB/s");
+    for (int z = 0; z < size_count; z++) {
+        size_t size = sizes[z];
+        uint8_t *body = malloc(size);
+        char *want = malloc(size * 2 + 1);
+        char *got = malloc(size * 2 + 1);
+        for (size_t i = 0; i < size; i++) {
+            body[i] = (i * 131 + 7) & 0xff;
+        }
+        hex_encode_sprintf(want, body, size);
+
+        for (int e = 0; e < encoder_count; e++) {
+            if (!encoders[e].supported) {
+                continue;
+            }
+            encoders[e].encode(got, body, size);
+            if (memcmp(got, want, size * 2) != 0) {
+                errx(EXIT_FAILURE, "%s differs from sprintf for %zu bytes", encoders[e].name, size);
+            }
+
+            long long cpu = now_ns(CLOCK_THREAD_CPUTIME_ID);
+            for (long long i = 0; i < bodies; i++) {
+                checksum += encoders[e].encode(got, body, size)[-1];
+            }
+            cpu = now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+            printf("%-12s %8zu %12lld %12.1f %12.0f\n", encoders[e].name, size, bodies,
+                   (double)cpu / bodies, (double)size * bodies / (cpu / 1e9) / 1e6);
+        }
+        free(body);
+        free(want);
+        free(got);
+    }
+    // keeps the loops from being optimized away
+    return checksum == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+    Struct log_bench
+    What each logging thread of bench_log() is given
+*/
+struct log_bench {
+    struct parameters *specs;
+    long long lines;
+};
+
+/*
+ * log_bench_thread()
+ * Logs a small GET over and over, as a worker would after answering it
+ */
+static void *log_bench_thread(void *arg) {
+    struct log_bench *bench = (struct log_bench *) arg;
+    struct httpObject *message = request_context_get();
+    char body[65];
+
+    memset(body, 'x', 64);
+    body[64] = '\0';
+    strcpy(message->method, "GET");
+    strcpy(message->filename, "/small.txt");
+    strcpy(message->host, "localhost:8080");
+    for (long long i = 0; i < bench->lines; i++) {
+        message->status_code = 200;
+        message->log_body_buffer = body;
+        message->log_body_length = 64;
+        log_request(message, bench->specs);
+    }
+    message->log_body_buffer = NULL;
+    request_context_put(message);
+    return NULL;
+}
+
+/*
+ * log_check_thread()
+ * Logs a PUT whose body has a NUL byte in it, from a thread that has no log ring yet
+ */
+static void *log_check_thread(void *arg) {
+    struct parameters *specs = (struct parameters *) arg;
+    struct httpObject *message = request_context_get();
+
+    strcpy(message->method, "PUT");
+    strcpy(message->filename, "./nulfile");
+    strcpy(message->host, "localhost:8080");
+    message->status_code = 201;
+    message->content_length = 5;
+    message->stored_length = 5;
+    capture_log_body(message, specs, "ab\0cd", 5, 0);
+    log_request(message, specs);
+    request_context_put(message);
+    return NULL;
+}
+
+/*
+ * log_check()
+ * Checks that an entry keeps the whole head of a body with a NUL byte in it, in the text
+ * log or read back from a binary one, before bench_log() times the logging
+ */
+static void log_check(int binary) {
+    const char expected[] = "PUT\t/nulfile\tlocalhost:8080\t5\t6162006364\n";
+    char name[] = "/tmp/httpbench.log.XXXXXX";
+    char buff[4096], line[4096];
+    struct parameters specs;
+    pthread_t thread;
+
+    memset(&specs, 0, sizeof specs);
+    specs.logfd = mkstemp(name);
+    if (specs.logfd < 0) {
+        err(EXIT_FAILURE, "mkstemp");
+    }
+    if (binary) {
+        write_full(specs.logfd, (uint8_t *) LOG_MAGIC, LOG_MAGIC_SIZE);
+    }
+    strcpy(specs.log_file_name, name);
+    specs.lflag = 1;
+    specs.log_binary = binary;
+    specs.log_body_size = LOG_BODY_SIZE;
+    specs.log_fsync_ms = -1;
+    specs.log_writer = log_writer_create(&specs);
+
+    pthread_create(&thread, NULL, log_check_thread, &specs);
+    pthread_join(thread, NULL);
+    while (atomic_load(&specs.log_writer->written) < 1) {
+        usleep(100);
+    }
+    ssize_t length = pread(specs.logfd, buff, sizeof buff - 1, 0);
+    unlink(name);
+    line[0] = '\0';
+    if (binary) {
+        struct log_record record;
+        if (length > LOG_MAGIC_SIZE && log_record_read(buff + LOG_MAGIC_SIZE, length - LOG_MAGIC_SIZE, &record)) {
+            log_record_text(line, &record, buff + LOG_MAGIC_SIZE);
+        }
+    }
+    else if (length > 0) {
+        memcpy(line, buff, length);
+        line[length] = '\0';
+    }
+    if (strcmp(line, expected) != 0) {
+        errx(EXIT_FAILURE, "%s log entry of a body with a NUL byte: %s", binary ? "binary" : "text", line);
+    }
+}
+
+/*
+ * bench_log()
+ * Runs a log writer on a scratch log and has threads log lines through it at once,
+ * timing until the writer has appended them all
+ */
+static int bench_log(int argc, char *argv[]) {
+    long long thread_counts[16] = { 1, 4, 16 };
+    int thread_count = 3;
+    long long lines = 1000000;
+    int flush_ms = 10;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:N:F:")) != -1) {
+        switch (opt) {
+            case 'n':
+                lines = atoll(optarg);
+                break;
+            case 'N':
+                thread_count = parse_size_list(optarg, thread_counts, 16);
+                break;
+            case 'F':
+                flush_ms = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s log [-n lines] [-N threads] [-F flush_ms]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    log_check(0);
+    log_check(1);
+    printf("%8s %12s %12s %12s\n", "threads", "lines", "lines/s", "dropped");
+    for (int t = 0; t < thread_count; t++) {
+        char name[] = "/tmp/httpbench.log.XXXXXX";
+        struct parameters specs;
+        memset(&specs, 0, sizeof specs);
+        specs.logfd = mkstemp(name);
+        if (specs.logfd < 0) {
+            err(EXIT_FAILURE, "mkstemp");
+        }
+        strcpy(specs.log_file_name, name);
+        specs.log_body_size = LOG_BODY_SIZE;
+        specs.log_flush_ms = flush_ms;
+        specs.log_fsync_ms = -1;
+        specs.log_writer = log_writer_create(&specs);
+
+        int count = thread_counts[t];
+        pthread_t threads[count];
+        struct log_bench bench = { &specs, lines / count };
+        long dropped = atomic_load(&stats.log_dropped);
+        long long start = now_ns(CLOCK_MONOTONIC);
+        for (int i = 0; i < count; i++) {
+            pthread_create(&threads[i], NULL, log_bench_thread, &bench);
+        }
+        for (int i = 0; i < count; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        unsigned long total = bench.lines * count;
+        while (atomic_load(&specs.log_writer->written) < total) {
+            usleep(100);
+        }
+        long long elapsed = now_ns(CLOCK_MONOTONIC) - start;
+        printf("%8d %12lu %12.0f %12ld\n", count, total, total / (elapsed / 1e9),
+               atomic_load(&stats.log_dropped) - dropped);
+        // the writer thread of this run is left idle on a file that is gone
+        unlink(name);
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+    Struct pool_bench
+    The tasks of one bench_pool() run and how many of them are done
+*/
+struct pool_bench {
+    struct threadpool_t *pool;
+    long long work;                     // loop iterations each task spins
+    int fanout;                         // tasks each spawning task queues from its worker
+    atomic_llong done;
+};
+
+/*
+ * pool_bench_task()
+ * A task that only takes a little CPU
+ */
+static void pool_bench_task(void *arg) {
+    struct pool_bench *bench = (struct pool_bench *) arg;
+    for (volatile long long i = 0; i < bench->work; i++) {
+    }
+    atomic_fetch_add(&bench->done, 1);
+}
+
+/*
+ * pool_bench_spawn()
+ * A task that queues fanout more from its worker, as a connection does for its pipelined requests
+ */
+static void pool_bench_spawn(void *arg) {
+    struct pool_bench *bench = (struct pool_bench *) arg;
+    for (int i = 0; i < bench->fanout; i++) {
+        if (threadpool_try_add(bench->pool, pool_bench_task, bench) != 0) {
+            pool_bench_task(bench);
+        }
+    }
+    pool_bench_task(bench);
+}
+
+/*
+ * bench_pool()
+ * Runs tasks through a pool of each size: all queued by a thread outside the pool,
+ * as the acceptor and the reactors do, and mostly queued by the workers themselves
+ */
+static int bench_pool(int argc, char *argv[]) {
+    long long worker_counts[16] = { 1, 4, 16, 64 };
+    int worker_count = 4;
+    long long tasks = 1000000;
+    long long work = 200;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:N:w:")) != -1) {
+        switch (opt) {
+            case 'n':
+                tasks = atoll(optarg);
+                break;
+            case 'N':
+                worker_count = parse_size_list(optarg, worker_counts, 16);
+                break;
+            case 'w':
+                work = atoll(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s pool [-n tasks] [-N workers] [-w work]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    struct parameters specs;
+    memset(&specs, 0, sizeof specs);
+    printf("%-8s %8s %12s %12s\n", "queued", "workers", "tasks", "tasks/s");
+    for (int n = 0; n < worker_count; n++) {
+        struct threadpool_t *pool = threadpool_create(worker_counts[n], worker_counts[n], QUEUE_SIZE, &specs);
+        for (int spawn = 0; spawn <= 1; spawn++) {
+            struct pool_bench bench = { pool, work, spawn ? 15 : 0, 0 };
+            long long roots = spawn ? tasks / 16 : tasks;
+            long long start = now_ns(CLOCK_MONOTONIC);
+            for (long long i = 0; i < roots; i++) {
+                threadpool_add(pool, spawn ? pool_bench_spawn : pool_bench_task, &bench);
+            }
+            while (atomic_load(&bench.done) < roots * (bench.fanout + 1)) {
+                sched_yield();
+            }
+            long long elapsed = now_ns(CLOCK_MONOTONIC) - start;
+            printf("%-8s %8lld %12lld %12.0f\n", spawn ? "workers" : "outside", worker_counts[n],
+                   roots * (bench.fanout + 1), roots * (bench.fanout + 1) / (elapsed / 1e9));
+        }
+        // the workers of this pool are left asleep
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+    Struct accept_bench
+    The connections of one bench_accept() run, shared by its clients
+*/
+struct accept_bench {
+    atomic_llong remaining;             // connections still to be made
+    long long response_length;
+};
+
+/*
+ * accept_bench_client()
+ * Opens connections until none remain, each sends one GET with Connection: close
+ * and reads the response until the server closes it
+ */
+static void *accept_bench_client(void *arg) {
+    struct accept_bench *bench = (struct accept_bench *) arg;
+    char request[] = "GET /small.txt HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    uint8_t response[256];
+
+    while (atomic_fetch_sub(&bench->remaining, 1) > 0) {
+        int fd = connect_server();
+        ssize_t received = 0, length;
+        if (send_full(fd, (uint8_t *) request, sizeof request - 1, -1) < 0) {
+            errx(EXIT_FAILURE, "connection lost");
+        }
+        while ((length = recv(fd, response, sizeof response, 0)) > 0) {
+            received += length;
+        }
+        if (received != bench->response_length) {
+            errx(EXIT_FAILURE, "unexpected response of %zd bytes", received);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * bench_accept()
+ * New connections per second, each for one small GET, from each number of clients at once.
+ * With -P the server accepts on a socket per listener thread (or reactor with -E).
+ */
+static int bench_accept(int argc, char *argv[]) {
+    long long client_counts[16] = { 1, 4, 16 };
+    int client_count = 3;
+    long long connections = 20000;
+    char *threads = "4";
+    int event = 0;
+    int reuseport = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:N:EP")) != -1) {
+        switch (opt) {
+            case 'n':
+                connections = atoll(optarg);
+                break;
+            case 'c':
+                client_count = parse_size_list(optarg, client_counts, 16);
+                break;
+            case 'N':
+                threads = optarg;
+                break;
+            case 'E':
+                event = 1;
+                break;
+            case 'P':
+                reuseport = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s accept [-n connections] [-c clients] [-N threads] [-E] [-P]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    char dir[] = "/tmp/httpbench.XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) < 0) {
+        err(EXIT_FAILURE, "mkdtemp");
+    }
+    close(make_object("small.txt", 64));
+
+    char port[8];
+    snprintf(port, sizeof port, "%d", BENCH_PORT);
+    char *args[8] = { "httpserver", "-N", threads };
+    int arg_count = 3;
+    if (event == 1) {
+        args[arg_count++] = "-E";
+    }
+    if (reuseport == 1) {
+        args[arg_count++] = "-P";
+    }
+    args[arg_count++] = port;
+    args[arg_count] = NULL;
+    start_server(args, BENCH_PORT);
+
+    char header[128];
+    struct accept_bench bench;
+    bench.response_length = snprintf(header, sizeof header, "HTTP/1.1 200 OK\r\nContent-Length: 64\r\nConnection: close\r\n\r\n") + 64;
+
+    const char *mode = event ? (reuseport ? "event/P" : "event") : (reuseport ? "threads/P" : "threads");
+    printf("%-10s %8s %12s %12s\n", "mode", "clients", "connections", "conn/s");
+    for (int c = 0; c < client_count; c++) {
+        pthread_t clients[256];
+        int count = client_counts[c] < 256 ? client_counts[c] : 256;
+        atomic_store(&bench.remaining, connections);
+
+        long long wall = now_ns(CLOCK_MONOTONIC);
+        for (int i = 0; i < count; i++) {
+            pthread_create(&clients[i], NULL, accept_bench_client, &bench);
+        }
+        for (int i = 0; i < count; i++) {
+            pthread_join(clients[i], NULL);
+        }
+        wall = now_ns(CLOCK_MONOTONIC) - wall;
+        printf("%-10s %8d %12lld %12.0f\n", mode, count, connections, connections / (wall / 1e9));
+    }
+
+    unlink("small.txt");
+    rmdir(dir);
+    return EXIT_SUCCESS;
+}
+
+/*
+    Struct latency_client
+    One client of bench_latency() and the latency of each of its requests
+*/
+struct latency_client {
+    pthread_t thread;
+    long long requests;
+    long long response_length;
+    long long *latencies;               // ns, requests of them
+};
+
+/*
+ * latency_bench_client()
+ * Sends one GET at a time over a keep-alive connection, timing each until its whole response is in
+ */
+static void *latency_bench_client(void *arg) {
+    struct latency_client *client = (struct latency_client *) arg;
+    char request[] = "GET /small.txt HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    uint8_t *response = malloc(client->response_length);
+    int fd = connect_server();
+
+    for (long long i = 0; i < client->requests; i++) {
+        long long start = now_ns(CLOCK_MONOTONIC);
+        if (send_full(fd, (uint8_t *) request, sizeof request - 1, -1) < 0 ||
+            recv_full(fd, response, client->response_length) != client->response_length) {
+            errx(EXIT_FAILURE, "connection lost after %lld requests", i);
+        }
+        client->latencies[i] = now_ns(CLOCK_MONOTONIC) - start;
+    }
+    close(fd);
+    free(response);
+    return NULL;
+}
+
+/*
+ * compare_latency()
+ * qsort() order of latencies
+ */
+static int compare_latency(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * bench_latency()
+ * Latency percentiles of small GETs from clients keep-alive connections at once, each
+ * sending its next request when the last response is in. -C pins the server's threads.
+ */
+static int bench_latency(int argc, char *argv[]) {
+    long long requests = 100000;
+    long long clients = 4;              // no more than threads, a kept-alive connection holds its worker
+    long long size = 64;
+    char *threads = "4";
+    char *cpu_list = NULL;
+    int event = 0;
+    int reuseport = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:s:N:EPC:")) != -1) {
+        switch (opt) {
+            case 'n':
+                requests = atoll(optarg);
+                break;
+            case 'c':
+                clients = atoll(optarg);
+                break;
+            case 's':
+                size = atoll(optarg);
+                break;
+            case 'N':
+                threads = optarg;
+                break;
+            case 'E':
+                event = 1;
+                break;
+            case 'P':
+                reuseport = 1;
+                break;
+            case 'C':
+                cpu_list = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s latency [-n requests] [-c clients] [-s size] [-N threads] [-E] [-P] [-C cpu_list]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (clients <= 0 || requests < clients) {
+        errx(EXIT_FAILURE, "invalid number of clients: %lld", clients);
+    }
+
+    char dir[] = "/tmp/httpbench.XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) < 0) {
+        err(EXIT_FAILURE, "mkdtemp");
+    }
+    close(make_object("small.txt", size));
+
+    char port[8];
+    snprintf(port, sizeof port, "%d", BENCH_PORT);
+    char *args[12] = { "httpserver", "-N", threads, "-K", "1000000000" };
+    int arg_count = 5;
+    if (event == 1) {
+        args[arg_count++] = "-E";
+    }
+    if (reuseport == 1) {
+        args[arg_count++] = "-P";
+    }
+    if (cpu_list != NULL) {
+        args[arg_count++] = "-C";
+        args[arg_count++] = cpu_list;
+    }
+    args[arg_count++] = port;
+    args[arg_count] = NULL;
+    start_server(args, BENCH_PORT);
+
+    char header[128];
+    long long response_length = snprintf(header, sizeof header, "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\n\r\n", size) + size;
+    long long per_client = requests / clients;
+    long long *latencies = malloc(sizeof(long long) * per_client * clients);
+    struct latency_client *client = calloc(clients, sizeof(struct latency_client));
+
+    long long wall = now_ns(CLOCK_MONOTONIC);
+    for (long long i = 0; i < clients; i++) {
+        client[i].requests = per_client;
+        client[i].response_length = response_length;
+        client[i].latencies = latencies + i * per_client;
+        pthread_create(&(client[i].thread), NULL, latency_bench_client, &client[i]);
+    }
+    for (long long i = 0; i < clients; i++) {
+        pthread_join(client[i].thread, NULL);
+    }
+    wall = now_ns(CLOCK_MONOTONIC) - wall;
+
+    long long count = per_client * clients;
+    qsort(latencies, count, sizeof(long long), compare_latency);
+    char mode[16];
+    snprintf(mode, sizeof mode, "%s%s%s", event ? "event" : "threads", reuseport ? "/P" : "", cpu_list != NULL ? "/C" : "");
+    printf("%-10s %8s %10s %12s %10s %10s %10s %10s\n", "mode", "clients", "requests", "req/s", "p50 us", "p99 us", "p99.9 us", "max us");
+    printf("%-10s %8lld %10lld %12.0f %10.1f %10.1f %10.1f %10.1f\n", mode, clients, count,
+           count / (wall / 1e9), latencies[count / 2] / 1e3, latencies[count * 99 / 100] / 1e3,
+           latencies[count * 999 / 1000] / 1e3, latencies[count - 1] / 1e3);
+
+    free(client);
+    free(latencies);
+    unlink("small.txt");
+    rmdir(dir);
+    return EXIT_SUCCESS;
+}
+
+/*
+    Struct mixed_bench
+    The clients of one bench_mixed() run: the large ones keep going until the small ones are done
+*/
+struct mixed_bench {
+    atomic_int done;                    // 0, 1 (the small clients have finished)
+    atomic_llong large_requests;        // large GETs or PUTs completed
+    long long large_size;
+    int put;                            // 0, 1 (-u, the large clients PUT)
+    long long small_requests;           // per small client
+    long long small_length;             // bytes of a small response
+};
+
+struct mixed_client {
+    pthread_t thread;
+    struct mixed_bench *bench;
+    int index;
+    long long *latencies;               // ns, small_requests of them for a small client
+};
+
+/*
+ * mixed_large_client()
+ * GETs or PUTs the large object over a new connection again and again, reading each response to its end
+ */
+static void *mixed_large_client(void *arg) {
+    struct mixed_client *client = (struct mixed_client *) arg;
+    struct mixed_bench *bench = client->bench;
+    uint8_t *buff = malloc(DRAIN_SIZE);
+    char request[256];
+    int length;
+
+    memset(buff, 'x', DRAIN_SIZE);
+    if (bench->put == 1) {
+        length = snprintf(request, sizeof request, "PUT /large%d.bin HTTP/1.1\r\nHost: localhost\r\nContent-Length: %lld\r\nConnection: close\r\n\r\n",
+                          client->index, bench->large_size);
+    }
+    else {
+        length = snprintf(request, sizeof request, "GET /large.bin HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    }
+    while (atomic_load(&bench->done) == 0) {
+        int fd = connect_server();
+        if (send_full(fd, (uint8_t *) request, length, -1) < 0) {
+            errx(EXIT_FAILURE, "connection lost");
+        }
+        for (long long sent = 0; bench->put == 1 && sent < bench->large_size; ) {
+            ssize_t n = bench->large_size - sent < DRAIN_SIZE ? bench->large_size - sent : DRAIN_SIZE;
+            if (send_full(fd, buff, n, -1) < 0) {
+                errx(EXIT_FAILURE, "connection lost");
+            }
+            sent += n;
+        }
+        while (recv(fd, buff, DRAIN_SIZE, 0) > 0) {
+        }
+        close(fd);
+        atomic_fetch_add(&bench->large_requests, 1);
+    }
+    free(buff);
+    return NULL;
+}
+
+/*
+ * mixed_small_client()
+ * GETs the small object over a new connection each time, timing each from connect() to the server's close
+ */
+static void *mixed_small_client(void *arg) {
+    struct mixed_client *client = (struct mixed_client *) arg;
+    struct mixed_bench *bench = client->bench;
+    char request[] = "GET /small.txt HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    uint8_t response[4096];
+
+    for (long long i = 0; i < bench->small_requests; i++) {
+        long long start = now_ns(CLOCK_MONOTONIC);
+        int fd = connect_server();
+        ssize_t received = 0, length;
+        if (send_full(fd, (uint8_t *) request, sizeof request - 1, -1) < 0) {
+            errx(EXIT_FAILURE, "connection lost after %lld requests", i);
+        }
+        while ((length = recv(fd, response, sizeof response, 0)) > 0) {
+            received += length;
+        }
+        close(fd);
+        if (received != bench->small_length) {
+            errx(EXIT_FAILURE, "unexpected response of %zd bytes", received);
+        }
+        client->latencies[i] = now_ns(CLOCK_MONOTONIC) - start;
+    }
+    return NULL;
+}
+
+/*
+ * bench_mixed()
+ * Latency percentiles of small GETs while large transfers keep the workers busy, with the
+ * server's plain FIFO pool or with -J its size-aware scheduling. There are more clients than
+ * workers on purpose: which request a free worker takes next is what is being measured.
+ */
+static int bench_mixed(int argc, char *argv[]) {
+    long long requests = 2000;
+    long long clients = 4;
+    long long large_clients = 4;
+    long long size = 64;
+    long long large_size = 16777216;
+    char *threads = "4";
+    char *large_bytes = NULL;
+    int event = 0;
+    int put = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:c:l:s:S:N:EuJ:")) != -1) {
+        switch (opt) {
+            case 'n':
+                requests = atoll(optarg);
+                break;
+            case 'c':
+                clients = atoll(optarg);
+                break;
+            case 'l':
+                large_clients = atoll(optarg);
+                break;
+            case 's':
+                size = atoll(optarg);
+                break;
+            case 'S':
+                large_size = atoll(optarg);
+                break;
+            case 'N':
+                threads = optarg;
+                break;
+            case 'E':
+                event = 1;
+                break;
+            case 'u':
+                put = 1;
+                break;
+            case 'J':
+                large_bytes = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s mixed [-n requests] [-c clients] [-l large_clients] [-s size] [-S large_size] [-N threads] [-E] [-u] [-J large_bytes]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (clients <= 0 || requests < clients || large_clients < 0 || large_size <= 0) {
+        errx(EXIT_FAILURE, "invalid number of clients: %lld", clients);
+    }
+
+    char dir[] = "/tmp/httpbench.XXXXXX";
+    if (mkdtemp(dir) == NULL || chdir(dir) < 0) {
+        err(EXIT_FAILURE, "mkdtemp");
+    }
+    close(make_object("small.txt", size));
+    close(make_object("large.bin", large_size));
+
+    char port[8];
+    snprintf(port, sizeof port, "%d", BENCH_PORT);
+    char *args[12] = { "httpserver", "-N", threads };
+    int arg_count = 3;
+    if (event == 1) {
+        args[arg_count++] = "-E";
+    }
+    if (large_bytes != NULL) {
+        args[arg_count++] = "-J";
+        args[arg_count++] = large_bytes;
+    }
+    args[arg_count++] = port;
+    args[arg_count] = NULL;
+    start_server(args, BENCH_PORT);
+
+    char header[128];
+    struct mixed_bench bench = { 0 };
+    bench.large_size = large_size;
+    bench.put = put;
+    bench.small_requests = requests / clients;
+    bench.small_length = snprintf(header, sizeof header, "HTTP/1.1 200 OK\r\nContent-Length: %lld\r\nConnection: close\r\n\r\n", size) + size;
+
+    // one GET first, so the server's file cache knows the large object's size
+    char warm[] = "GET /large.bin HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    uint8_t *drain = malloc(DRAIN_SIZE);
+    int fd = connect_server();
+    send_full(fd, (uint8_t *) warm, sizeof warm - 1, -1);
+    while (recv(fd, drain, DRAIN_SIZE, 0) > 0) {
+    }
+    close(fd);
+    free(drain);
+
+    long long count = bench.small_requests * clients;
+    long long *latencies = malloc(sizeof(long long) * count);
+    struct mixed_client *client = calloc(clients + large_clients, sizeof(struct mixed_client));
+    for (long long i = 0; i < large_clients; i++) {
+        client[clients + i].bench = &bench;
+        client[clients + i].index = i;
+        pthread_create(&(client[clients + i].thread), NULL, mixed_large_client, &client[clients + i]);
+    }
+    // the large transfers get going before the first small request
+    usleep(100000);
+
+    long long wall = now_ns(CLOCK_MONOTONIC);
+    for (long long i = 0; i < clients; i++) {
+        client[i].bench = &bench;
+        client[i].latencies = latencies + i * bench.small_requests;
+        pthread_create(&(client[i].thread), NULL, mixed_small_client, &client[i]);
+    }
+    for (long long i = 0; i < clients; i++) {
+        pthread_join(client[i].thread, NULL);
+    }
+    wall = now_ns(CLOCK_MONOTONIC) - wall;
+    atomic_store(&bench.done, 1);
+    for (long long i = 0; i < large_clients; i++) {
+        pthread_join(client[clients + i].thread, NULL);
+    }
+
+    qsort(latencies, count, sizeof(long long), compare_latency);
+    char mode[24];
+    snprintf(mode, sizeof mode, "%s/%s%s", event ? "event" : "threads", put ? "PUT" : "GET", large_bytes != NULL ? "/J" : "");
+    printf("%-12s %8s %10s %12s %10s %10s %10s %10s %10s\n", "mode", "clients", "requests", "req/s", "p50 us", "p99 us", "p99.9 us", "max us", "large/s");
+    printf("%-12s %8lld %10lld %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n", mode, clients, count,
+           count / (wall / 1e9), latencies[count / 2] / 1e3, latencies[count * 99 / 100] / 1e3,
+           latencies[count * 999 / 1000] / 1e3, latencies[count - 1] / 1e3,
+           atomic_load(&bench.large_requests) / (wall / 1e9));
+
+    free(client);
+    free(latencies);
+    for (long long i = 0; i < large_clients; i++) {
+        char name[32];
+        snprintf(name, sizeof name, "large%lld.bin", i);
+        unlink(name);
+    }
+    unlink("large.bin");
+    unlink("small.txt");
+    rmdir(dir);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        errx(EXIT_FAILURE, "Usage: %s sendfile|pipeline|parse|hex|log|pool|accept|latency|mixed [options]", argv[0]);
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    char *mode = argv[1];
+    argv[1] = argv[0];
+    if (strcmp(mode, "sendfile") == 0) {
+        return bench_sendfile(argc - 1, argv + 1);
+    }
+    if (strcmp(mode, "pipeline") == 0) {
+        return bench_pipeline(argc - 1, argv + 1);
+    }
+    if (strcmp(mode, "parse") == 0) {
+        return bench_parse(argc - 1, argv + 1);
+    }
+    if (strcmp(mode, "hex") == 0) {
+        return bench_hex(argc - 1, argv + 1);
+    }
+    if (strcmp(mode, "log") == 0) {
+        return bench_log(argc - 1, argv + 1);
+    }
+    if (strcmp(mode, "pool") == 0) {
+        return bench_pool(argc - 1, argv + 1);
+    }
+    if (strcmp(mode, "accept") == 0) {
+        return bench_accept(argc - 1, argv + 1);
+    }
+    if (strcmp(mode, "latency") == 0) {
+        return bench_latency(argc - 1, argv + 1);
+    }
+    if (strcmp(mode, "mixed") == 0) {
+        return bench_mixed(argc - 1, argv + 1);
+    }
+    errx(EXIT_FAILURE, "unknown benchmark: %s", mode);
+}
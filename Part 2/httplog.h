@@ -0,0 +1,211 @@
+/*
+ * httplog.h
+ * Request log formats, shared by httpserver (-l, -b) and logcat.
+ *
+ * The text log has one line per request:
+ *     GET\t/file1.txt\tlocalhost:8080\t13\t68656c6c6f...\n     (200 and 201, hex of the first 1000 body bytes, -L)
+ *     FAIL\tGET /abcd HTTP/1.1\t404\n                          (any other status)
+ *
+ * The binary log (-b) starts with LOG_MAGIC and has one record per request: a struct log_record
+ * followed by the method, the resource, the host and the raw head of the body, none of them NUL
+ * terminated. Records are about half the size of text lines and are counted without reading
+ * their bytes. log_record_text() turns a record back into the text line.
+ */
+#ifndef HTTPLOG_H
+#define HTTPLOG_H
+
+#include <stddef.h>         //size_t
+#include <stdint.h>         //uint16_t
+#include <stdio.h>          //sprintf()
+#include <string.h>         //memcpy()
+#if defined(__x86_64__)
+#include <immintrin.h>      //_mm_unpacklo_epi8()
+#endif
+
+#define LOG_MAGIC "HTTPLOG1"
+#define LOG_MAGIC_SIZE 8
+#define LOG_BODY_SIZE 1000      // body bytes kept in a log entry unless httpserver -L says otherwise
+#define LOG_BODY_MAX 65535      // the most body bytes a log entry can keep, body_length has 16 bits
+
+/*
+    Struct log_record
+    The fixed size head of a binary log record, in host byte order
+*/
+struct log_record {
+    uint32_t length;                    // the whole record, this head included
+    uint16_t status;                    // example: 200
+    uint8_t method_length;              // example: 3
+    uint8_t reserved;
+    uint16_t resource_length;           // example: 10
+    uint16_t host_length;               // example: 14
+    uint16_t body_length;               // raw body bytes at the end, at most LOG_BODY_MAX
+    uint16_t reserved2;
+    int64_t content_length;             // example: 13
+    int64_t timestamp;                  // nanoseconds since the epoch when the request was logged
+};
+
+/*
+ * log_is_error()
+ * Whether a status is logged as a FAIL entry
+ */
+static inline int log_is_error(int status) {
+    return status != 200 && status != 201;
+}
+
+/*
+ * hex_encode_scalar()
+ * Writes the two lower case hex digits of each of length bytes at dest, as "%02hhx" would
+ * Returns the end of what it wrote, not NUL terminated
+ */
+static inline char *hex_encode_scalar(char *dest, const uint8_t *src, size_t length) {
+    static const char digits[16] = "0123456789abcdef";
+    for (size_t i = 0; i < length; i++) {
+        *dest++ = digits[src[i] >> 4];
+        *dest++ = digits[src[i] & 0x0f];
+    }
+    return dest;
+}
+
+#if defined(__x86_64__)
+/*
+ * hex_encode_sse2()
+ * hex_encode_scalar() 16 bytes at a time, every x86-64 has SSE2
+ */
+static inline char *hex_encode_sse2(char *dest, const uint8_t *src, size_t length) {
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i letters = _mm_set1_epi8('a' - '0' - 10);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i high = _mm_and_si128(_mm_srli_epi16(in, 4), mask);
+        __m128i low = _mm_and_si128(in, mask);
+        // '0' + digit, and 'a' - '0' - 10 more for the digits over 9
+        high = _mm_add_epi8(_mm_add_epi8(high, zero), _mm_and_si128(_mm_cmpgt_epi8(high, nine), letters));
+        low = _mm_add_epi8(_mm_add_epi8(low, zero), _mm_and_si128(_mm_cmpgt_epi8(low, nine), letters));
+        _mm_storeu_si128((__m128i *) dest, _mm_unpacklo_epi8(high, low));
+        _mm_storeu_si128((__m128i *)(dest + 16), _mm_unpackhi_epi8(high, low));
+        dest += 32;
+    }
+    return hex_encode_scalar(dest, src + i, length - i);
+}
+
+/*
+ * hex_encode_avx2()
+ * hex_encode_scalar() 32 bytes at a time, only called when the CPU has AVX2
+ */
+__attribute__((target("avx2")))
+static inline char *hex_encode_avx2(char *dest, const uint8_t *src, size_t length) {
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    const __m256i nine = _mm256_set1_epi8(9);
+    const __m256i zero = _mm256_set1_epi8('0');
+    const __m256i letters = _mm256_set1_epi8('a' - '0' - 10);
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i in = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i high = _mm256_and_si256(_mm256_srli_epi16(in, 4), mask);
+        __m256i low = _mm256_and_si256(in, mask);
+        high = _mm256_add_epi8(_mm256_add_epi8(high, zero), _mm256_and_si256(_mm256_cmpgt_epi8(high, nine), letters));
+        low = _mm256_add_epi8(_mm256_add_epi8(low, zero), _mm256_and_si256(_mm256_cmpgt_epi8(low, nine), letters));
+        // unpack works within each 128 bit lane: first has bytes 0-7 and 16-23, second 8-15 and 24-31
+        __m256i first = _mm256_unpacklo_epi8(high, low);
+        __m256i second = _mm256_unpackhi_epi8(high, low);
+        _mm256_storeu_si256((__m256i *) dest, _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256((__m256i *)(dest + 32), _mm256_permute2x128_si256(first, second, 0x31));
+        dest += 64;
+    }
+    return hex_encode_sse2(dest, src + i, length - i);
+}
+#endif
+
+/*
+ * hex_encode()
+ * hex_encode_scalar() with the widest vector instructions the CPU has
+ */
+static inline char *hex_encode(char *dest, const uint8_t *src, size_t length) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        return hex_encode_avx2(dest, src, length);
+    }
+    return hex_encode_sse2(dest, src, length);
+#else
+    return hex_encode_scalar(dest, src, length);
+#endif
+}
+
+/*
+ * log_record_write()
+ * Builds a binary record at dest, body_length is cut to LOG_BODY_MAX
+ * Returns the length of the record
+ */
+static inline size_t log_record_write(char *dest, int status, const char *method, const char *resource,
+                                      const char *host, int64_t content_length, const char *body,
+                                      size_t body_length, int64_t timestamp) {
+    struct log_record record;
+
+    memset(&record, 0, sizeof record);
+    record.status = status;
+    record.method_length = strlen(method);
+    record.resource_length = strlen(resource);
+    record.host_length = strlen(host);
+    record.body_length = body_length < LOG_BODY_MAX ? body_length : LOG_BODY_MAX;
+    record.content_length = content_length;
+    record.timestamp = timestamp;
+    record.length = sizeof record + record.method_length + record.resource_length + record.host_length + record.body_length;
+
+    char *field = dest + sizeof record;
+    memcpy(dest, &record, sizeof record);
+    memcpy(field, method, record.method_length);
+    field += record.method_length;
+    memcpy(field, resource, record.resource_length);
+    field += record.resource_length;
+    memcpy(field, host, record.host_length);
+    field += record.host_length;
+    memcpy(field, body, record.body_length);
+    return record.length;
+}
+
+/*
+ * log_record_read()
+ * Reads the record at the start of the available bytes at src
+ * Returns 0 when they don't hold a whole record
+ */
+static inline int log_record_read(const char *src, size_t available, struct log_record *record) {
+    if (available < sizeof *record) {
+        return 0;
+    }
+    memcpy(record, src, sizeof *record);
+    return record->length >= sizeof *record && record->length <= available &&
+           sizeof *record + record->method_length + record->resource_length + record->host_length +
+           record->body_length == record->length;
+}
+
+/*
+ * log_record_text()
+ * Writes the text log line of a record at dest, NUL terminated
+ * Returns the length of the line
+ */
+static inline size_t log_record_text(char *dest, const struct log_record *record, const char *src) {
+    const char *method = src + sizeof *record;
+    const char *resource = method + record->method_length;
+    const char *host = resource + record->resource_length;
+    const char *body = host + record->host_length;
+    int length;
+
+    if (log_is_error(record->status)) {
+        length = sprintf(dest, "FAIL\t%.*s %.*s HTTP/1.1\t%d\n", record->method_length, method,
+                         record->resource_length, resource, record->status);
+        return length;
+    }
+    length = sprintf(dest, "%.*s\t%.*s\t%.*s\t%lld\t", record->method_length, method, record->resource_length,
+                     resource, record->host_length, host, (long long) record->content_length);
+    char *end = hex_encode(dest + length, (const uint8_t *) body, record->body_length);
+    *end++ = '\n';
+    *end = '\0';
+    return end - dest;
+}
+
+#endif
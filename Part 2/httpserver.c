@@ -1,9 +1,11 @@
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #include <err.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <limits.h>         //INT_MAX
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 
 #include <string.h>         //memset()
@@ -14,22 +16,92 @@
 #include <fcntl.h>          //open()
 #include <pthread.h>        //pthread
 #include <signal.h>         //pthread_kill
+#include <sys/sendfile.h>   //sendfile()
+#include <sys/epoll.h>      //epoll_wait()
+#include <sys/eventfd.h>    //eventfd()
+#include <sys/resource.h>   //setrlimit()
+#include <poll.h>           //poll()
+#include <time.h>           //clock_gettime()
+#include <stdatomic.h>      //atomic_long
+#include <sys/mman.h>       //mmap()
+#include <sys/syscall.h>    //syscall()
+#include <sys/uio.h>        //writev()
+#include <dirent.h>         //readdir()
+#include <libgen.h>         //dirname()
+#include <linux/io_uring.h> //struct io_uring_sqe
+#include <linux/futex.h>    //FUTEX_WAIT_PRIVATE
+#include <linux/mempolicy.h> //MPOL_PREFERRED
+#include <sched.h>          //cpu_set_t
+
+#include "httpparse.h"      //http_parse_request()
+#include "httplog.h"        //log_record_write()
 
 #define BUFFER_SIZE 1024000
 #define HEADER_SIZE 1000
+#define METHOD_SIZE 16
 #define FILENAME_SIZE 260
-#define LOG_SIZE 2600     // 5 + 1 + 256 + 1 + 256 + 1 + 5 + 1 + 2000 + 1
-#define QUEUE_SIZE 100
+#define LOG_SIZE 600      // 5 + 1 + 256 + 1 + 256 + 1 + 20 + 1 + 1 + 1, a log line without the hex of its body
+#define QUEUE_SIZE 100          // tasks the shared pool queue holds unless -Q says otherwise
+#define SHED_RETRY_AFTER 1      // seconds a client turned away with 503 is told to wait
+#define SHED_LINGER 64          // connections turned away that are kept open a little longer
+#define SHED_LINGER_SECONDS 1   // how long a connection turned away is kept open at most, unless the client closes first
+#define CONTROL_PEEK 128        // bytes of a new connection looked at for the request line of a probe
+#define CONTROL_TIMEOUT 1       // seconds a probe has to send its headers, and the control lane waits to send its answer
+#define REACTOR_MAX 4
+#define REQUEST_HEADER_SIZE 8192
+#define IDLE_TIMEOUT 5          // seconds a keep-alive connection may wait for its next request
+#define MAX_REQUESTS 100        // requests served on one connection before it is closed
+#define EPOLL_EVENTS 256
+#define PIPELINE_DEPTH 16       // pipelined requests of one connection processed ahead of their responses
+#define URING_ENTRIES 8         // a request never has more than a few operations in flight
+#define CONTEXT_CACHE 4         // request contexts each thread keeps for reuse
+#define SHARED_CONTEXTS 16      // request contexts kept for any thread, for those given back elsewhere
+#define FILE_CACHE_SIZE 256     // open files kept for GET and HEAD, one per slot of the name's hash
+#define FILE_CACHE_TTL 1        // seconds a cached file is served before its size and mtime are looked at again
+#define LOG_RING_SIZE 256       // log lines each thread may have formatted but not written yet
+#define LOG_RINGS 256           // log rings: the shared one, and one for each of the first threads that log
+#define LOG_BATCH 256           // log lines the log writer appends with one writev()
+#define WORKER_DEQUE_SIZE 256   // tasks a worker can queue for itself before they go to the shared queue
+#define POOL_TICK_MS 10         // how often the pool controller looks at the shared queue
+#define POOL_GROW_DEPTH 4       // queued tasks that start workers at once when none is idle
+#define POOL_IDLE_SECONDS 5     // how long a worker above the minimum may sleep before it exits
+#define CPU_LIST_MAX 1024       // CPUs a -C list may name
+#define NUMA_NODES 64           // NUMA nodes request contexts are kept apart for
+#define POOL_LARGE_SHARE 2      // -J: large tasks may run on at most 1 of every this many workers
+#define POOL_LARGE_WAIT_MS 100  // -J: a large task waiting this long goes before the small ones
+#define STEAL_TRIES 4           // workers picked at random to steal from, the last one starts a sweep of all
 
 #define DEBUG 0
 
 // Global string objects for error messages
-static const char suc201[] = " 201 Created\r\n";
-static const char err400[] = " 400 Bad Request\r\n";
-static const char err403[] = " 403 Forbidden\r\n";
-static const char err404[] = " 404 File Not Found\r\n";
-static const char err500[] = " 500 Internal Server Error\r\n";
-static const char err501[] = " 501 Not Implemented\r\n";
+static const char cont100[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+/*
+    Struct status_line
+    The status line of each response the server sends, and the body of the ones without a file
+*/
+struct status_line {
+    int code;
+    const char *line;           // example: HTTP/1.1 404 File Not Found\r\n
+    size_t line_length;
+    const char *body;           // example: File Not Found\n
+    size_t body_length;
+};
+
+#define STATUS_LINE(code, text) \
+    { code, "HTTP/1.1 " #code " " text "\r\n", sizeof("HTTP/1.1 " #code " " text "\r\n") - 1, text "\n", sizeof(text "\n") - 1 }
+
+// the last one is for any code not in the table
+static const struct status_line status_lines[] = {
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(201, "Created"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(404, "File Not Found"),
+    STATUS_LINE(501, "Not Implemented"),
+    STATUS_LINE(503, "Service Unavailable"),
+    STATUS_LINE(500, "Internal Server Error"),
+};
 
 /*
    Converts a string to an 16 bits unsigned integer.
@@ -58,43 +130,387 @@ uint16_t strtouint16(char number[]) {
     Availability: https://git.ucsc.edu/mdcovarr/cse130-section/-/blob/master/week-4/server.c
     ***End of Citation***
 */
+struct file_entry;
+struct log_writer;
+
 struct httpObject {
     
     char host[FILENAME_SIZE];                     // example: 127.0.0.1:1234
-    char method[6];                     // PUT, HEAD, GET
+    char method[METHOD_SIZE];           // PUT, HEAD, GET
     char filename[FILENAME_SIZE];       // example: file1.txt
     char httpversion[9];                // HTTP/1.1
     ssize_t content_length;             // example: 13
     ssize_t header_length;              // example: 10
+    ssize_t received_length;            // bytes of the request read into buffer so far
+    ssize_t body_offset;                // where the body starts in buffer
+    ssize_t request_length;             // headers + body, anything after it is the next request
     int status_code;                    // example: 404
     uint8_t header[HEADER_SIZE];
-    uint8_t buffer[BUFFER_SIZE];
-    char log_body_buffer[BUFFER_SIZE];  // example: 0a05a6b9
+    uint8_t buffer[BUFFER_SIZE];        // NUL terminated after the bytes in use, never cleared as a whole
+    char *log_body_buffer;              // example: 0a05a6b9, log_body_size + 1, allocated once the context logs a body
+    ssize_t log_body_length;            // body bytes in log_body_buffer so far
+    ssize_t stored_length;              // example: 13, the body a PUT stored, for the log once the response has replaced content_length
+    int node;                           // example: 1, the NUMA node the context's memory is on (0 unless -C)
     int hflag;                          // 0, 1
+    int cflag;                          // 0, 1 (client sent Expect: 100-continue)
+    int filedesc;                       // file opened for the body, -1 if none
+    struct file_entry *file;            // cache entry filedesc belongs to, NULL if the request opened it
+    int keep_alive;                     // 0, 1 (connection stays open after the response)
+    struct http_request request;        // parser state, offsets into buffer
 };
 
 struct parameters {
     
     int listenfd;
-    int threadCount;            // example: 5
+    uint16_t port;              // example: 8080
+    int pflag;                  // 0, 1 (every listener thread or reactor has its own SO_REUSEPORT socket)
+    int cpu_count;              // CPUs in cpus, 0 leaves threads wherever the scheduler puts them
+    int cpus[CPU_LIST_MAX];     // example: 0, 1, 2, 3 (-C 0-3)
+    int queue_size;             // example: 100 (tasks waiting for a worker, more connections get 503)
+    int shed_wait_ms;           // example: 50 (oldest task's wait that sheds new connections, 0 never)
+    long long large_bytes;      // example: 1048576 (bigger bodies are scheduled as large tasks, 0 keeps one FIFO)
+    int threadCount;            // example: 5 (workers started with the server)
+    int min_threads;            // example: 2 (workers the pool shrinks to, threadCount unless -n)
+    int max_threads;            // example: 64 (workers the pool grows to, threadCount unless -x)
     int tflag;                  // 0, 1
     int lflag;                  // 0, 1
+    int eflag;                  // 0, 1 (event loop mode)
+    int idle_timeout;           // example: 5 (seconds, 0 disables keep-alive)
+    int max_requests;           // example: 100
+    int uflag;                  // 0, 1 (io_uring backend)
+    int logfd;                  // log file kept open for the log writer, -1 without -l
+    int log_flush_ms;           // example: 10 (0 wakes the log writer for every line)
+    int log_fsync_ms;           // example: 1000 (-1 never syncs the log, 0 after every batch)
+    int log_drop;               // 0, 1 (a full log ring drops lines instead of waiting)
+    int log_binary;             // 0, 1 (binary log records, see httplog.h)
+    long long log_segment_bytes;        // example: 67108864 (0 never closes a log segment for its size)
+    int log_segment_seconds;    // example: 3600 (0 never closes a log segment for its age)
+    int log_max_segments;       // example: 10 (0 keeps every closed log segment)
+    int log_body_size;          // example: 1000 (body bytes kept in a log entry)
+    struct log_writer *log_writer;      // NULL without -l
     //int hflag;                // 0, 1
     char log_file_name[FILENAME_SIZE];     // example: log_file
     //char log_body_buffer[1000]; // example: 0a05a6b9
 };
 
+/*
+    Struct server_stats
+    Counters reported by /metrics, updated by every worker and reactor
+*/
+struct server_stats {
+    atomic_long connections;            // accepted connections
+    atomic_long requests;               // requests read
+    atomic_long reused;                 // requests that arrived on an already used connection
+    atomic_long idle_closed;            // keep-alive connections closed by the idle timeout
+    atomic_long max_closed;             // connections closed after max_requests
+    atomic_long pipelined;              // requests processed ahead of their turn through a pipeline
+    atomic_long file_hits;              // GET and HEAD served from an already open file
+    atomic_long file_misses;            // GET and HEAD that had to open the file
+    atomic_long log_dropped;            // log lines lost to a full log ring (-D)
+    atomic_long pool_threads;           // workers running now
+    atomic_long pool_started;           // workers started by the pool controller
+    atomic_long pool_retired;           // workers that exited after sleeping POOL_IDLE_SECONDS
+    atomic_long shed;                   // connections answered with 503 because the pool queue was too long
+    atomic_long control;                // /healthcheck and /metrics requests answered outside the pool queue
+    atomic_long large;                  // tasks scheduled as large (-J)
+};
+
+static struct server_stats stats;
+
+struct threadpool_t;
+static struct threadpool_t *server_pool = NULL;        // for /metrics, NULL until main() creates it
+int pool_metrics(struct threadpool_t *pool, char *dest);
+time_t monotonic_seconds(void);
+
+/*
+    Struct uring
+    One worker thread's io_uring for the -U backend, used through the raw syscalls.
+    Operations of a request that don't depend on each other are queued together and
+    go to the kernel in one io_uring_enter().
+*/
+struct uring {
+    int ringfd;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    unsigned queued;                    // operations queued since the last io_uring_enter()
+    int results[URING_ENTRIES];         // completion of each queued operation, by queue position
+};
+
+static __thread struct uring *worker_ring = NULL;
+static __thread int worker_ring_failed = 0;
+
+// what a thread keeps for itself (its io_uring, its request contexts) is let go when it exits
+static pthread_key_t thread_resources_key;
+static pthread_once_t thread_resources_once = PTHREAD_ONCE_INIT;
+static __thread int thread_resources_kept = 0;
+void thread_resources_release(void *arg);
+
+/*
+ * uring_destroy()
+ * Unmaps and closes a ring
+ */
+void uring_destroy(struct uring *ring) {
+    if (ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, URING_ENTRIES * sizeof(struct io_uring_sqe));
+    }
+    if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->ringfd);
+    free(ring);
+}
+
+/*
+ * thread_resources_key_create()
+ * Creates the key whose destructor runs thread_resources_release(), once
+ */
+void thread_resources_key_create(void) {
+    pthread_key_create(&thread_resources_key, thread_resources_release);
+}
+
+/*
+ * thread_resources_keep()
+ * Called when the calling thread first keeps something, so it is let go when the thread exits
+ */
+void thread_resources_keep(void) {
+    if (thread_resources_kept) {
+        return;
+    }
+    pthread_once(&thread_resources_once, thread_resources_key_create);
+    pthread_setspecific(thread_resources_key, (void *) 1);
+    thread_resources_kept = 1;
+}
+
+/*
+ * uring_supported()
+ * Checks that the kernel knows every operation the backend submits (openat, statx, close and
+ * read arrived in 5.6), so older kernels with io_uring fall back to syscalls as well
+ */
+int uring_supported(int ringfd) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    int ops[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_CLOSE, IORING_OP_READ };
+    int supported = syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+    for (int i = 0; supported && i < (int)(sizeof ops / sizeof ops[0]); i++) {
+        supported = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+/*
+ * uring_create()
+ * Sets up a ring
+ * Returns NULL when the kernel has no usable io_uring
+ */
+struct uring *uring_create(void) {
+    struct io_uring_params params;
+    struct uring *ring = calloc(1, sizeof(struct uring));
+
+    memset(&params, 0, sizeof params);
+    ring->ringfd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring->ringfd < 0) {
+        free(ring);
+        return NULL;
+    }
+    ring->sq_ring = ring->cq_ring = ring->sqes = MAP_FAILED;
+    if (!uring_supported(ring->ringfd)) {
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_SQ_RING);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes = mmap(NULL, URING_ENTRIES * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    return ring;
+}
+
+/*
+ * worker_uring()
+ * The calling thread's ring, created on first use. NULL without -U or when it can't be set up.
+ */
+struct uring *worker_uring(struct parameters *specs) {
+    if (specs->uflag == 0 || worker_ring_failed == 1) {
+        return NULL;
+    }
+    if (worker_ring == NULL) {
+        worker_ring = uring_create();
+        worker_ring_failed = worker_ring == NULL;
+        thread_resources_keep();
+    }
+    return worker_ring;
+}
+
+/*
+ * uring_queue()
+ * Takes the next submission entry, its completion lands in ring->results[index]
+ */
+struct io_uring_sqe *uring_queue(struct uring *ring, int *index) {
+    unsigned tail = *(ring->sq_tail);
+    struct io_uring_sqe *sqe = &(ring->sqes[tail & ring->sq_mask]);
+
+    memset(sqe, 0, sizeof *sqe);
+    sqe->user_data = ring->queued;
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if (index != NULL) {
+        *index = ring->queued;
+    }
+    ring->queued += 1;
+    return sqe;
+}
+
+/*
+ * uring_flush()
+ * Submits everything queued in one io_uring_enter() and waits for all of it
+ */
+void uring_flush(struct uring *ring) {
+    unsigned pending = ring->queued;
+
+    if (pending == 0) {
+        return;
+    }
+    while (syscall(__NR_io_uring_enter, ring->ringfd, ring->queued, pending, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno == EINTR) {
+    }
+    ring->queued = 0;
+
+    while (pending > 0) {
+        unsigned head = *(ring->cq_head);
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            syscall(__NR_io_uring_enter, ring->ringfd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            continue;
+        }
+        struct io_uring_cqe *cqe = &(ring->cqes[head & ring->cq_mask]);
+        if (cqe->user_data < URING_ENTRIES) {
+            ring->results[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        pending -= 1;
+    }
+}
+
+/*
+ * uring_open_stat()
+ * open() and stat() of a path in one submission
+ * Returns the descriptor, or -1 with errno set like the syscalls would
+ */
+int uring_open_stat(struct uring *ring, const char *path, int flags, struct stat *st) {
+    struct statx stx;
+    int opened, statted;
+
+    struct io_uring_sqe *sqe = uring_queue(ring, &opened);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long) path;
+    sqe->open_flags = flags;
+
+    sqe = uring_queue(ring, &statted);
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long) path;
+    sqe->len = STATX_SIZE | STATX_MTIME;
+    sqe->off = (unsigned long) &stx;
+
+    uring_flush(ring);
+    if (ring->results[statted] == 0) {
+        st->st_size = stx.stx_size;
+        st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+        st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+    }
+    if (ring->results[opened] < 0 || ring->results[statted] < 0) {
+        errno = ring->results[opened] < 0 ? -ring->results[opened] : -ring->results[statted];
+        if (ring->results[opened] >= 0) {
+            close(ring->results[opened]);
+        }
+        return -1;
+    }
+    return ring->results[opened];
+}
+
+/*
+ * uring_queue_read()
+ * Queues a pread() of filedesc, for uring_flush()
+ * Returns where its result will be in ring->results
+ */
+int uring_queue_read(struct uring *ring, int filedesc, void *buff, unsigned size, off_t offset) {
+    int index;
+    struct io_uring_sqe *sqe = uring_queue(ring, &index);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = filedesc;
+    sqe->addr = (unsigned long) buff;
+    sqe->len = size;
+    sqe->off = offset;
+    // anything queued after the read (such as closing the file) waits for it, even after a short read
+    sqe->flags = IOSQE_IO_HARDLINK;
+    return index;
+}
+
+/*
+ * uring_queue_close()
+ * Queues a close() of filedesc, for uring_flush()
+ */
+void uring_queue_close(struct uring *ring, int filedesc) {
+    struct io_uring_sqe *sqe = uring_queue(ring, NULL);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = filedesc;
+}
+
 /*
    Creates a socket for listening for connections.
+   With reuseport, any number of them can listen on the same port (-P).
    Closes the program and prints an error message on error.
 */
-int create_listen_socket(uint16_t port) {
+int create_listen_socket(uint16_t port, int reuseport) {
     struct sockaddr_in addr;
     
     int listenfd = socket(AF_INET, SOCK_STREAM, 0);
     if (listenfd < 0) {
         err(EXIT_FAILURE, "socket error");
     }
+    // connections of a server that just exited may still be in TIME_WAIT on the port
+    int one = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+    if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) < 0) {
+        err(EXIT_FAILURE, "SO_REUSEPORT");
+    }
 
     memset(&addr, 0, sizeof addr);
     addr.sin_family = AF_INET;
@@ -190,7 +606,6 @@ ssize_t send_full(int fd, uint8_t *buff, ssize_t size, int filedesc) {
     int rb;
     ssize_t offset = 0;
     while (total < size) {
-      memset(buff, 0, BUFFER_SIZE);
       rb = pread(filedesc, buff, BUFFER_SIZE, offset);
       ret = send(fd, buff, rb, 0);
       if (ret < 0) {
@@ -212,811 +627,4488 @@ ssize_t send_full(int fd, uint8_t *buff, ssize_t size, int filedesc) {
 }
 
 /*
- * clear_parameters_strings()
- * reset partial data in parameters object
- */
-
-void clear_parameters_strings(struct parameters* specs) {
-    //memset(message->log_body_buffer, 0, 1000);
-    //specs->hflag = 0;
-    memset(specs->log_file_name, 0, FILENAME_SIZE);
-}
+  splice_full()
+  Moves size bytes of filedesc to the socket through a pipe with splice(),
+  so the file data never enters user space.
+  Returns the number of bytes sent, or -1 if splice() is not supported.
+*/
+ssize_t splice_full(int fd, int filedesc, ssize_t size) {
+  int pipefd[2];
+  loff_t offset = 0;
+  ssize_t total = 0;
+  ssize_t in, out;
 
+  if (pipe(pipefd) < 0) {
+    return -1;
+  }
 
-/*
- * log_request()
- * log request to file when -l is provided
- */
-void log_request(struct httpObject* message, struct parameters* specs) {
-    char * log_entry = (char*)malloc(sizeof(char)*(LOG_SIZE+1));
+  while (total < size) {
+    in = splice(filedesc, &offset, pipefd[1], NULL, size-total, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (in < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      total = (total == 0) ? -1 : total;
+      break;
+    }
+    else if (in == 0) {
+      break;
+    }
 
-    int size = 1000;
+    // Drain everything that went into the pipe before reading more of the file
+    while (in > 0) {
+      out = splice(pipefd[0], NULL, fd, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (out < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+          continue;
+        }
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return (total == 0) ? -1 : total;
+      }
+      in -= out;
+      total += out;
+    }
+  }
 
-    if (message->status_code != 200 && message->status_code != 201) {
-        //Example format of a log line for a FAIL request
-        //FAIL\tGET /abcd HTTP/1.1\t404\n
-        //FAIL\t$(message->method) $(message->filename) HTTP/1.1\t$(message->status_code)\n...
+  close(pipefd[0]);
+  close(pipefd[1]);
+  return total;
+}
 
-        sprintf(log_entry, "FAIL\t%s %s HTTP/1.1\t%d\n", message->method, message->filename+1, message->status_code);
+/*
+  send_file_full()
+  Sends size bytes of filedesc to the socket without copying them through user space.
+  Tries sendfile() first, then splice(), and only falls back to the
+  pread()/send() loop of send_full() when the kernel supports neither.
+*/
+ssize_t send_file_full(int fd, int filedesc, ssize_t size, uint8_t *buff) {
+  off_t offset = 0;
+  ssize_t ret = 0;
 
-#if DEBUG == 1
-        //printf("Printing my error string for a non-200/non-201 FAIL log: %s\n", log_entry);
-#endif
+  while (offset < size) {
+    ret = sendfile(fd, filedesc, &offset, size-offset);
+    if (ret < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      if (offset == 0 && (errno == EINVAL || errno == ENOSYS)) {
+        break;
+      }
+      return ret;
     }
-    else {
-        char hexstr[2000];
-        memset(hexstr, 0, 2000);
-        if (strlen(message->log_body_buffer) < 1000) {
-            size = strlen(message->log_body_buffer);
-        }
-        for (int i=0; i < size; i++) {
-            sprintf((char*)hexstr + (i*2), "%02hhx", message->log_body_buffer[i]);
-        }
-        
-#if DEBUG == 1
-    //printf("message->host = %s\n", message->host);
-#endif
-        if (strcmp(message->method, "HEAD") != 0) {
-            message->content_length = strlen(message->log_body_buffer);
-        }
-    
-        sprintf(log_entry, "%s\t%s\t%s\t%zd\t%s\n", message->method, message->filename + 1, message->host, message->content_length, hexstr);
-
+    else if (ret == 0) {
+      // file was truncated while sending
+      return offset;
     }
+  }
+  if (offset == size) {
+    return offset;
+  }
 
-    int logfiledesc = open(specs->log_file_name, O_CREAT | O_RDWR | O_APPEND , 0600);
-    write(logfiledesc, log_entry, strlen(log_entry));
-    close(logfiledesc);
-
-    free(log_entry);
-    //clear_parameters_strings(specs);
+  ret = splice_full(fd, filedesc, size);
+  if (ret >= 0) {
+    return ret;
+  }
+  return send_full(fd, buff, size, filedesc);
 }
 
-
-
 /*
- * health_check()
- * Reads log_file and returns number of entries and errors
- */
-void health_check(struct httpObject* message, struct parameters* specs) {
-    int entryCount = 0;
-    int errorCount = 0;
-    // tabCount = 0;
-    int OFFSET = 0;
-    struct stat st;
-    //char file_buffer[BUFFER_SIZE];
-    char log_buffer[LOG_SIZE];
-    char charRead[1];
-    char methodRead[5];
-    
-    int logfiledesc = open(specs->log_file_name, O_RDONLY);
-    int logfilespec = stat(specs->log_file_name, &st);
-#if DEBUG == 1
-    //printf("message->method = %s\n", message->method);
-#endif
-    if (logfiledesc == -1 || logfilespec == -1) {
-        if (errno == EACCES) {
-            message->status_code = 403;
-        }
-        else {
-        message->status_code = 404;
-        }
+  writev_full()
+  Runs writev() until every iovec is written, iov is used up along the way
+*/
+ssize_t writev_full(int fd, struct iovec *iov, int count) {
+  ssize_t total = 0;
+  ssize_t ret = 0;
+
+  while (count > 0) {
+    ret = writev(fd, iov, count);
+    if (ret < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return ret;
     }
-    else if (strcmp(message->method, "PUT") == 0 || strcmp(message->method, "HEAD") == 0 ) {
-        message->status_code = 403;
+    total += ret;
+    while (count > 0 && (size_t)ret >= iov->iov_len) {
+      ret -= iov->iov_len;
+      iov++;
+      count--;
     }
-    else {
-        //a successful health check request
-        
-        //int INDEX = 0;
-        
-        //read(logfiledesc, file_buffer, BUFFER_SIZE);
-        //while (file_buffer[INDEX] != 0) {
-        while (read(logfiledesc, charRead, 1)) {
-            if (charRead[0] == '\n') {
-                sscanf(log_buffer, "%s", methodRead);
-
-                if (strcmp("FAIL", methodRead) == 0) {
-                    errorCount += 1;
-                }
-                entryCount += 1;
-                
-                OFFSET = 0;
-                memset(log_buffer, 0, LOG_SIZE);
-                memset(methodRead, 0, 5);
-            }
-            else {
-                strcpy(&log_buffer[OFFSET],&charRead[0]);
-                OFFSET += 1;
-            }
-            
-            //INDEX += 1;
-        }
-#if DEBUG == 1
-    //printf("entry = %d\n", entryCount);
-    //printf("error = %d\n", errorCount);
-#endif
-        memset(message->buffer, 0, BUFFER_SIZE);
-        sprintf((char*)message->buffer, "%d\n%d\n", errorCount, entryCount);
-        message->content_length = strlen((char*)message->buffer);
-        message->status_code = 200;
-        
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + ret;
+      iov->iov_len -= ret;
     }
-    close(logfiledesc);
-    strcpy(message->log_body_buffer, (char*)message->buffer);
-    log_request(message, specs);
+  }
+  return total;
 }
 
 /*
-* is_invalid_resource_name()
-* checks for invalid resource (file) name
+  write_full()
+  Runs write() repetitively until end of buffer
 */
-int is_valid_resource_name (char * name) {
-    int namelen = strlen(name);
-    
-    if (namelen > 19) {
-        //if the name is longer than 19 chars, then it's invalid
-#if DEBUG == 1
-        printf("Name is too long\n");
-#endif
-        return 0;
-    }
-    
-    for (int i = 0; i < namelen; i++) {
-        //if a character is not a-z, A-Z, 0-9, a '.', or '_', then the name is invalid
-        if ( !( (name[i] >= 'a' && name[i] <= 'z') || (name[i] >= 'A' && name[i] <= 'Z') || (name[i] >= '0' && name[i] <= '9') || (name[i] == '.') || (name[i] == '_') )) {
-#if DEBUG == 1
-            printf("Character is bad: %c\n", name[i]);
-#endif
-            return 0;
-        }
+ssize_t write_full(int filedesc, uint8_t *buff, ssize_t size) {
+  ssize_t total = 0;
+  ssize_t ret = 0;
+
+  while (total < size) {
+    ret = write(filedesc, buff+total, size-total);
+    if (ret < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      return ret;
     }
-    return 1;
+    total += ret;
+  }
+  return total;
 }
 
 /*
-* is_invalid_host()
-* checks for an invalid host
+  wait_readable()
+  Waits up to timeout seconds for more of the body on a socket that had none ready
+  Returns 1 once it is readable, 0 when the time ran out
 */
-int is_invalid_host (char * host) {
-    int hostlen = strlen(host);
+int wait_readable(int fd, int timeout) {
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  int ret;
 
-    for (int i = 0; i < hostlen; i++) {
-        //host is invalid when it contains a white space
-        if (host[hostlen] == ' ') {
-            return 1;
-        }
-    }
-    
-    return 0;
+  while ((ret = poll(&pfd, 1, timeout * 1000)) < 0 && errno == EINTR) {
+  }
+  return ret > 0;
 }
 
 /*
-* is_bad_request()
-* checks for a bad request based off the resource(file name), http version, host
+  recv_file_full()
+  Moves size bytes from the socket into filedesc without holding more than
+  one chunk at a time. splice() moves the body through a pipe inside the kernel,
+  the recv()/write() loop over buff is only used when splice() is not supported.
+  A socket with nothing to read is waited on for up to timeout seconds, not spun on.
+  Returns the number of bytes stored, or -1 on error.
 */
+ssize_t recv_file_full(int fd, int filedesc, ssize_t size, uint8_t *buff, int timeout) {
+  int pipefd[2];
+  ssize_t total = 0;
+  ssize_t in, out;
 
-int is_bad_request(char * resource, char * httpversion, char * host) {
-    if (strcmp(httpversion, "HTTP/1.1") != 0) {
-        //http version is invalid
-#if DEBUG == 1
-        printf("setting to a bad request because of invalid http\n");
-#endif
-        return 1;
-    } else if (!is_valid_resource_name(resource)) {
-        //filename is greater than 19 characters or contains invalid characters
-#if DEBUG == 1
-        printf("setting to a bad request because of invalid characters in filename\n");
-#endif
-        return 1;
-    } else if (host == NULL || is_invalid_host(host)) {
-        //host is invalid
-#if DEBUG == 1
-        printf("setting to a bad request because of invalid host\n");
-#endif
+  if (size > 0 && pipe(pipefd) == 0) {
+    while (total < size) {
+      in = splice(fd, NULL, pipefd[1], NULL, size-total, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (in < 0) {
+        if (errno == EINTR || (errno == EAGAIN && wait_readable(fd, timeout))) {
+          continue;
+        }
+        break;
+      }
+      else if (in == 0) {
+        // client closed the connection before sending the full body
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+      }
+
+      while (in > 0) {
+        out = splice(pipefd[0], NULL, filedesc, NULL, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (out < 0) {
+          if (errno == EINTR || errno == EAGAIN) {
+            continue;
+          }
+          close(pipefd[0]);
+          close(pipefd[1]);
+          return -1;
+        }
+        in -= out;
+        total += out;
+      }
+    }
+    close(pipefd[0]);
+    close(pipefd[1]);
+    if (total == size) {
+      return total;
+    }
+    if (total > 0 || (errno != EINVAL && errno != ENOSYS)) {
+      return -1;
+    }
+  }
+
+  while (total < size) {
+    ssize_t chunk = size-total < BUFFER_SIZE ? size-total : BUFFER_SIZE;
+    in = recv(fd, buff, chunk, 0);
+    if (in < 0) {
+      if (errno == EINTR || (errno == EAGAIN && wait_readable(fd, timeout))) {
+        continue;
+      }
+      return -1;
+    }
+    else if (in == 0) {
+      return -1;
+    }
+    if (write_full(filedesc, buff, in) < 0) {
+      return -1;
+    }
+    total += in;
+  }
+  return total;
+}
+
+/*
+ * clear_parameters_strings()
+ * reset partial data in parameters object
+ */
+
+void clear_parameters_strings(struct parameters* specs) {
+    //memset(message->log_body_buffer, 0, 1000);
+    //specs->hflag = 0;
+    memset(specs->log_file_name, 0, FILENAME_SIZE);
+}
+
+
+/*
+ * log_body()
+ * The buffer for the head of a logged body, allocated the first time the context needs it
+ * Returns NULL when it can't be allocated, the entry is then logged without the body
+ */
+char *log_body(struct httpObject* message, struct parameters* specs) {
+    if (message->log_body_buffer == NULL) {
+        message->log_body_buffer = malloc(specs->log_body_size + 1);
+        if (message->log_body_buffer == NULL) {
+            return NULL;
+        }
+        message->log_body_buffer[0] = '\0';
+    }
+    return message->log_body_buffer;
+}
+
+/*
+ * capture_log_body()
+ * Keeps the part of length body bytes at offset that the log needs, as they go through
+ * a buffer on their way to the socket or the file. Bytes after a gap are not kept.
+ */
+void capture_log_body(struct httpObject* message, struct parameters* specs, const void *data, ssize_t length, ssize_t offset) {
+    if (specs->lflag == 0 || offset != message->log_body_length || offset >= specs->log_body_size) {
+        return;
+    }
+    if (length > specs->log_body_size - offset) {
+        length = specs->log_body_size - offset;
+    }
+    char *body = log_body(message, specs);
+    if (body == NULL) {
+        return;
+    }
+    memcpy(body + offset, data, length);
+    message->log_body_length += length;
+    body[message->log_body_length] = '\0';
+}
+
+/*
+ * log_body_missing()
+ * How many bytes of the head of the body the log still needs after those captured
+ */
+ssize_t log_body_missing(struct httpObject* message, struct parameters* specs) {
+    ssize_t want = message->content_length < specs->log_body_size ? message->content_length : specs->log_body_size;
+    return want > message->log_body_length ? want - message->log_body_length : 0;
+}
+
+/*
+    Struct log_slot
+    One log line, sequence is its place in the log
+*/
+struct log_slot {
+    unsigned long sequence;
+    int length;
+    int error;                          // 0, 1 (a FAIL entry)
+    char line[];                        // LOG_SIZE + 2 * log_body_size + 1
+};
+
+/*
+    Struct log_ring
+    The log lines of one thread, waiting for the log writer. Only that thread adds to it
+    and only the writer takes from it, so neither locks, and the two counters they move
+    are on cache lines of their own.
+*/
+struct log_ring {
+    _Alignas(64) atomic_ulong tail;     // lines the thread has put in
+    _Alignas(64) atomic_ulong released; // lines the writer has appended, their slots are free again
+    unsigned long taken;                // lines the writer has picked for a batch, only the writer uses it
+    atomic_int owned;                   // 0, 1 (a thread logs through it)
+    _Alignas(64) char slots[];          // LOG_RING_SIZE slots of slot_size bytes
+};
+
+/*
+    Struct log_writer
+    The per thread log rings and the thread that empties them. A worker formats its line
+    straight into a slot of its own ring, takes the next sequence number when the line is
+    complete and publishes it, no lock and no system call. The writer merges the rings by
+    sequence number, up to LOG_BATCH lines per writev(), into the log file it keeps open,
+    so the log has the order in which requests finished. Once every ring has a thread,
+    the threads that log after them take turns on the shared ring, under shared_lock.
+*/
+struct log_writer {
+    struct log_ring *rings[LOG_RINGS];
+    atomic_int ring_count;
+    atomic_ulong sequence;              // next sequence number a line takes
+    unsigned long head;                 // next sequence number the writer appends, only the writer uses it
+    atomic_ulong written;               // lines appended to the log so far
+    atomic_int sleeping;                // 0, 1 (the writer waits on ready for a line)
+    atomic_int waiting;                 // threads waiting on done
+    atomic_long entries;                // lines in the log, including those still in the rings
+    atomic_long errors;                 // FAIL lines among them
+    pthread_mutex_t lock;
+    pthread_cond_t ready;               // a line is in
+    pthread_cond_t done;                // a batch was appended
+    pthread_key_t ring_key;             // gives a ring back when its thread exits
+    struct log_ring *shared;            // rings[0], never owned by one thread
+    pthread_mutex_t shared_lock;        // held from log_claim() to log_publish() of a line in the shared ring
+    size_t slot_size;                   // a log_slot with room for the longest line, example: 2688
+    int logfd;
+    int flush_ms;                       // example: 10
+    int fsync_ms;                       // example: 1000, -1 never
+    int drop;                           // 0, 1
+    const char *name;                   // the active segment, example: log_file
+    int binary;                         // 0, 1 (segments start with LOG_MAGIC)
+    long long segment_bytes;            // example: 67108864, 0 never closes a segment for its size
+    int segment_seconds;                // example: 3600, 0 never closes a segment for its age
+    int max_segments;                   // example: 10, 0 keeps every closed segment
+    long long active_bytes;             // the rest is only used by the writer
+    long active_entries;
+    long active_errors;
+    time_t active_start;                // when the first entry of the active segment was appended
+    unsigned long first_segment;        // closed segments are name.first_segment ... name.next_segment - 1
+    unsigned long next_segment;
+};
+
+static __thread struct log_ring *thread_log_ring = NULL;
+
+/*
+ * log_ring_release()
+ * Thread exit: the thread's ring is free for the next thread that logs
+ */
+void log_ring_release(void *arg) {
+    struct log_ring *ring = (struct log_ring *) arg;
+    atomic_store(&ring->owned, 0);
+}
+
+/*
+ * log_ring_add()
+ * A new ring in the next entry of rings, owned by the caller
+ * Called with the log lock held, or before the writer starts
+ */
+struct log_ring *log_ring_add(struct log_writer *log) {
+    int count = atomic_load(&log->ring_count);
+    struct log_ring *ring = aligned_alloc(64, sizeof(struct log_ring) + LOG_RING_SIZE * log->slot_size);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->released, 0);
+    ring->taken = 0;
+    atomic_init(&ring->owned, 1);
+    log->rings[count] = ring;
+    atomic_store(&log->ring_count, count + 1);
+    return ring;
+}
+
+/*
+ * log_ring_get()
+ * The calling thread's ring, taken from a thread that exited or added on its first line
+ * Returns NULL when every ring already has a thread
+ */
+struct log_ring *log_ring_get(struct log_writer *log) {
+    if (thread_log_ring != NULL) {
+        return thread_log_ring;
+    }
+    struct log_ring *ring = NULL;
+    int count = atomic_load(&log->ring_count);
+    for (int i = 0; i < count && ring == NULL; i++) {
+        int free_ring = 0;
+        if (atomic_compare_exchange_strong(&(log->rings[i]->owned), &free_ring, 1)) {
+            ring = log->rings[i];
+        }
+    }
+    if (ring == NULL) {
+        pthread_mutex_lock(&log->lock);
+        if (atomic_load(&log->ring_count) < LOG_RINGS) {
+            ring = log_ring_add(log);
+        }
+        pthread_mutex_unlock(&log->lock);
+        if (ring == NULL) {
+            return NULL;
+        }
+    }
+    pthread_setspecific(log->ring_key, ring);
+    thread_log_ring = ring;
+    return ring;
+}
+
+/*
+ * log_ring_slot()
+ * The slot of a ring a line at position goes in
+ */
+struct log_slot *log_ring_slot(struct log_writer *log, struct log_ring *ring, unsigned long position) {
+    return (struct log_slot *) (ring->slots + (position % LOG_RING_SIZE) * log->slot_size);
+}
+
+/*
+ * log_ring_full()
+ * Whether the writer has yet to append the line a lap ahead of the next slot
+ */
+int log_ring_full(struct log_ring *ring) {
+    return atomic_load_explicit(&ring->tail, memory_order_relaxed) - atomic_load(&ring->released) >= LOG_RING_SIZE;
+}
+
+/*
+ * log_claim()
+ * The next slot of the calling thread's ring, or of the shared ring when it has none,
+ * waits for the writer while the ring is full
+ * Returns NULL when the ring is full and lines are dropped (-D)
+ */
+struct log_slot *log_claim(struct log_writer *log, struct log_ring **ring_out) {
+    struct log_ring *ring = log_ring_get(log);
+
+    if (ring == NULL) {
+        // held until log_publish(), so lines go into the shared ring in sequence order
+        ring = log->shared;
+        pthread_mutex_lock(&log->shared_lock);
+    }
+    if (log->drop && log_ring_full(ring)) {
+        if (ring == log->shared) {
+            pthread_mutex_unlock(&log->shared_lock);
+        }
+        atomic_fetch_add(&stats.log_dropped, 1);
+        return NULL;
+    }
+    if (log_ring_full(ring)) {
+        // the writer may be letting lines pile up, this ring can't wait for that
+        pthread_mutex_lock(&log->lock);
+        atomic_fetch_add(&log->waiting, 1);
+        pthread_cond_signal(&log->ready);
+        while (log_ring_full(ring)) {
+            pthread_cond_wait(&log->done, &log->lock);
+        }
+        atomic_fetch_sub(&log->waiting, 1);
+        pthread_mutex_unlock(&log->lock);
+    }
+    *ring_out = ring;
+    return log_ring_slot(log, ring, atomic_load_explicit(&ring->tail, memory_order_relaxed));
+}
+
+/*
+ * log_publish()
+ * Numbers a formatted line and hands it to the writer, waking it only when it sleeps
+ */
+void log_publish(struct log_writer *log, struct log_ring *ring, struct log_slot *slot, int length) {
+    slot->length = length;
+    slot->sequence = atomic_fetch_add(&log->sequence, 1);
+    atomic_store(&ring->tail, atomic_load_explicit(&ring->tail, memory_order_relaxed) + 1);
+    if (ring == log->shared) {
+        pthread_mutex_unlock(&log->shared_lock);
+    }
+    if (atomic_load(&log->sleeping)) {
+        pthread_mutex_lock(&log->lock);
+        pthread_cond_signal(&log->ready);
+        pthread_mutex_unlock(&log->lock);
+    }
+}
+
+/*
+ * log_ring_peek()
+ * The oldest line of a ring the writer hasn't picked, if it is line sequence
+ */
+struct log_slot *log_ring_peek(struct log_writer *log, struct log_ring *ring, unsigned long sequence) {
+    if (ring->taken == atomic_load(&ring->tail)) {
+        return NULL;
+    }
+    struct log_slot *slot = log_ring_slot(log, ring, ring->taken);
+    return slot->sequence == sequence ? slot : NULL;
+}
+
+/*
+ * log_next()
+ * Picks line sequence from whichever ring has it, trying the ring of the line before first
+ */
+struct log_slot *log_next(struct log_writer *log, unsigned long sequence, struct log_ring **last) {
+    struct log_slot *slot = *last != NULL ? log_ring_peek(log, *last, sequence) : NULL;
+    int count = atomic_load(&log->ring_count);
+
+    for (int i = 0; slot == NULL && i < count; i++) {
+        slot = log_ring_peek(log, log->rings[i], sequence);
+        if (slot != NULL) {
+            *last = log->rings[i];
+        }
+    }
+    if (slot != NULL) {
+        (*last)->taken += 1;
+    }
+    return slot;
+}
+
+/*
+ * log_ready()
+ * Whether the next line for the writer is in
+ */
+int log_ready(struct log_writer *log) {
+    int count = atomic_load(&log->ring_count);
+    for (int i = 0; i < count; i++) {
+        if (log_ring_peek(log, log->rings[i], log->head) != NULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * log_writer_sleep()
+ * Waits for the next line: sleeps flush_ms so lines pile up unless a ring fills up,
+ * or until a worker wakes it
+ */
+void log_writer_sleep(struct log_writer *log) {
+    pthread_mutex_lock(&log->lock);
+    if (log->flush_ms > 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += log->flush_ms / 1000;
+        deadline.tv_nsec += (log->flush_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += 1;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (atomic_load(&log->waiting) == 0) {
+            pthread_cond_timedwait(&log->ready, &log->lock, &deadline);
+        }
+        pthread_mutex_unlock(&log->lock);
+        return;
+    }
+    atomic_store(&log->sleeping, 1);
+    while (!log_ready(log)) {
+        pthread_cond_wait(&log->ready, &log->lock);
+    }
+    atomic_store(&log->sleeping, 0);
+    pthread_mutex_unlock(&log->lock);
+}
+
+/*
+ * log_count()
+ * Counts the entries and errors in a log or a segment, a binary one record by record from their heads
+ * Returns its size, or -1 if it can't be read
+ */
+off_t log_count(const char *path, long *entries, long *errors) {
+    struct stat st;
+
+    *entries = 0;
+    *errors = 0;
+    int logfiledesc = open(path, O_RDONLY);
+    if (logfiledesc == -1) {
+        return -1;
+    }
+    if (fstat(logfiledesc, &st) == -1) {
+        int saved = errno;
+        close(logfiledesc);
+        errno = saved;
+        return -1;
+    }
+    if (st.st_size > 0) {
+        char *start = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, logfiledesc, 0);
+        if (start != MAP_FAILED) {
+            const char *line = start, *end = start + st.st_size;
+            if (st.st_size >= LOG_MAGIC_SIZE && memcmp(start, LOG_MAGIC, LOG_MAGIC_SIZE) == 0) {
+                struct log_record record;
+                // a last record cut short isn't an entry yet
+                for (line += LOG_MAGIC_SIZE; log_record_read(line, end - line, &record); line += record.length) {
+                    *entries += 1;
+                    *errors += log_is_error(record.status);
+                }
+            }
+            else {
+                const char *newline;
+                madvise(start, st.st_size, MADV_SEQUENTIAL);
+                // a last line without its newline isn't an entry yet
+                while ((newline = memchr(line, '\n', end - line)) != NULL) {
+                    *entries += 1;
+                    if (newline - line >= 4 && memcmp(line, "FAIL", 4) == 0 &&
+                        (newline - line == 4 || line[4] == '\t' || line[4] == ' ')) {
+                        *errors += 1;
+                    }
+                    line = newline + 1;
+                }
+            }
+            munmap(start, st.st_size);
+        }
+    }
+    close(logfiledesc);
+    return st.st_size;
+}
+
+/*
+ * segment_path()
+ * The name of closed segment number, with the suffix of its summary or ""
+ * example: log_file.3, log_file.3.idx
+ */
+void segment_path(char *dest, const char *name, unsigned long number, const char *suffix) {
+    snprintf(dest, FILENAME_SIZE + 32, "%s.%lu%s", name, number, suffix);
+}
+
+/*
+ * segment_summary_write()
+ * Writes the summary of a closed segment next to it: "entries errors"
+ */
+void segment_summary_write(const char *name, unsigned long number, long entries, long errors) {
+    char path[FILENAME_SIZE + 32];
+    char summary[64];
+
+    segment_path(path, name, number, ".idx");
+    int filedesc = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (filedesc == -1) {
+        warn("%s", path);
+        return;
+    }
+    write_full(filedesc, (uint8_t *) summary, sprintf(summary, "%ld %ld\n", entries, errors));
+    close(filedesc);
+}
+
+/*
+ * segment_summary()
+ * Reads the entries and errors of a closed segment from its summary,
+ * counts the segment and writes the summary when there is none
+ * Returns 0 if the segment doesn't exist
+ */
+int segment_summary(const char *name, unsigned long number, long *entries, long *errors) {
+    char path[FILENAME_SIZE + 32];
+    char summary[64];
+
+    segment_path(path, name, number, ".idx");
+    int filedesc = open(path, O_RDONLY);
+    if (filedesc != -1) {
+        ssize_t length = read(filedesc, summary, sizeof summary - 1);
+        close(filedesc);
+        summary[length > 0 ? length : 0] = '\0';
+        if (sscanf(summary, "%ld %ld", entries, errors) == 2) {
+            return 1;
+        }
+    }
+    // closed while the server stopped, or the summary was lost
+    segment_path(path, name, number, "");
+    if (log_count(path, entries, errors) == -1) {
+        return 0;
+    }
+    segment_summary_write(name, number, *entries, *errors);
+    return 1;
+}
+
+/*
+ * segment_remove()
+ * Deletes a closed segment and its summary
+ */
+void segment_remove(const char *name, unsigned long number) {
+    char path[FILENAME_SIZE + 32];
+
+    segment_path(path, name, number, "");
+    unlink(path);
+    segment_path(path, name, number, ".idx");
+    unlink(path);
+}
+
+/*
+ * segment_compact()
+ * Appends the newest closed segment to the one before it when both fit in segment_bytes,
+ * so segments closed early (for their age) don't pile up as many small files
+ * Returns 1 if it did
+ */
+int segment_compact(struct log_writer *log) {
+    char older[FILENAME_SIZE + 32], newer[FILENAME_SIZE + 32];
+    struct stat older_st, newer_st;
+    long entries, errors, newer_entries, newer_errors;
+    unsigned long number = log->next_segment;
+
+    if (log->segment_bytes == 0 || number == log->first_segment) {
+        return 0;
+    }
+    segment_path(older, log->name, number - 1, "");
+    segment_path(newer, log->name, number, "");
+    if (stat(older, &older_st) == -1 || stat(newer, &newer_st) == -1 ||
+        older_st.st_size + newer_st.st_size > log->segment_bytes ||
+        !segment_summary(log->name, number - 1, &entries, &errors) ||
+        !segment_summary(log->name, number, &newer_entries, &newer_errors)) {
+        return 0;
+    }
+
+    int in = open(newer, O_RDONLY);
+    // copy_file_range() doesn't take O_APPEND, the end of the older one is passed instead
+    int out = open(older, O_WRONLY);
+    int copied = in != -1 && out != -1;
+    // a binary segment has its own magic, the older one already starts with it
+    off_t offset = log->binary ? LOG_MAGIC_SIZE : 0;
+    off_t end = older_st.st_size;
+    while (copied && offset < newer_st.st_size) {
+        ssize_t ret = copy_file_range(in, &offset, out, &end, newer_st.st_size - offset, 0);
+        copied = ret > 0;
+    }
+    // cut what was appended so far, or the entries would be in both segments
+    int restored = copied || out == -1 || ftruncate(out, older_st.st_size) == 0;
+    if (in != -1) {
+        close(in);
+    }
+    if (out != -1) {
+        close(out);
+    }
+    if (!restored) {
+        // the older segment keeps part of the newer one, count it again
+        warn("%s", older);
+        segment_path(older, log->name, number - 1, ".idx");
+        unlink(older);
+    }
+    if (!copied) {
+        return 0;
+    }
+    segment_summary_write(log->name, number - 1, entries + newer_entries, errors + newer_errors);
+    segment_remove(log->name, number);
+    return 1;
+}
+
+/*
+ * log_rotate()
+ * Closes the active segment as name.next_segment with its summary, starts a new one,
+ * then compacts and drops the oldest segments past max_segments
+ */
+void log_rotate(struct log_writer *log) {
+    char path[FILENAME_SIZE + 32];
+
+    segment_path(path, log->name, log->next_segment, "");
+    if (rename(log->name, path) == -1) {
+        warn("%s", path);
+        return;
+    }
+    int filedesc = open(log->name, O_CREAT | O_RDWR | O_APPEND | O_TRUNC, 0644);
+    if (filedesc == -1) {
+        // keep appending to the renamed segment rather than losing entries
+        warn("%s", log->name);
+        rename(path, log->name);
+        return;
+    }
+    if (log->binary) {
+        write_full(filedesc, (uint8_t *) LOG_MAGIC, LOG_MAGIC_SIZE);
+    }
+    // the writer and specs->logfd keep the same descriptor
+    dup2(filedesc, log->logfd);
+    close(filedesc);
+
+    segment_summary_write(log->name, log->next_segment, log->active_entries, log->active_errors);
+    if (!segment_compact(log)) {
+        log->next_segment += 1;
+    }
+    while (log->max_segments > 0 && log->next_segment - log->first_segment > (unsigned long) log->max_segments) {
+        long entries, errors;
+        if (segment_summary(log->name, log->first_segment, &entries, &errors)) {
+            // /healthcheck reads errors first, so errors never exceed entries
+            atomic_fetch_sub(&log->errors, errors);
+            atomic_fetch_sub(&log->entries, entries);
+        }
+        segment_remove(log->name, log->first_segment);
+        log->first_segment += 1;
+    }
+
+    log->active_bytes = log->binary ? LOG_MAGIC_SIZE : 0;
+    log->active_entries = 0;
+    log->active_errors = 0;
+}
+
+/*
+ * log_segments_load()
+ * Finds the closed segments next to the active one and counts the whole log: the
+ * closed segments from their summaries, only the active segment is read
+ */
+void log_segments_load(struct log_writer *log) {
+    char directory[FILENAME_SIZE], base[FILENAME_SIZE];
+    long entries, errors, total_entries = 0, total_errors = 0;
+    int found = 0;
+
+    strcpy(directory, log->name);
+    strcpy(base, log->name);
+    const char *base_name = basename(base);
+    size_t base_length = strlen(base_name);
+    DIR *dir = opendir(dirname(directory));
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL) {
+        // base_name.number, not base_name.number.idx
+        const char *suffix = entry->d_name + base_length;
+        if (strncmp(entry->d_name, base_name, base_length) != 0 || suffix[0] != '.' ||
+            suffix[1] < '0' || suffix[1] > '9' || strspn(suffix + 1, "0123456789") != strlen(suffix + 1)) {
+            continue;
+        }
+        unsigned long number = strtoul(suffix + 1, NULL, 10);
+        if (!found || number < log->first_segment) {
+            log->first_segment = number;
+        }
+        if (!found || number >= log->next_segment) {
+            log->next_segment = number + 1;
+        }
+        found = 1;
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+
+    for (unsigned long number = log->first_segment; number < log->next_segment; number++) {
+        if (segment_summary(log->name, number, &entries, &errors)) {
+            total_entries += entries;
+            total_errors += errors;
+        }
+    }
+    off_t size = log_count(log->name, &log->active_entries, &log->active_errors);
+    log->active_bytes = size > 0 ? size : 0;
+    log->active_start = time(NULL);
+    atomic_store(&log->entries, total_entries + log->active_entries);
+    atomic_store(&log->errors, total_errors + log->active_errors);
+}
+
+/*
+ * log_writer_run()
+ * The log writer thread: appends the lines in the rings in batches, in sequence order
+ */
+void *log_writer_run(void *arg) {
+    struct log_writer *log = (struct log_writer *) arg;
+    struct iovec iov[LOG_BATCH];
+    struct log_slot *picked[LOG_BATCH];
+    struct log_ring *last = NULL;
+    struct timespec synced, now;
+    int unsynced = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &synced);
+    while (1) {
+        int count = 0;
+        while (count < LOG_BATCH && (picked[count] = log_next(log, log->head + count, &last)) != NULL) {
+            iov[count].iov_base = picked[count]->line;
+            iov[count].iov_len = picked[count]->length;
+            count += 1;
+        }
+
+        if (count == 0) {
+            // caught up, whatever was appended goes to disk before waiting
+            if (unsynced) {
+                fdatasync(log->logfd);
+                clock_gettime(CLOCK_MONOTONIC, &synced);
+                unsynced = 0;
+            }
+            log_writer_sleep(log);
+            continue;
+        }
+
+        // a segment closed for its age doesn't take entries from after that
+        if (log->segment_seconds > 0 && log->active_entries > 0 && time(NULL) - log->active_start >= log->segment_seconds) {
+            log_rotate(log);
+        }
+        ssize_t written = writev_full(log->logfd, iov, count);
+        if (log->active_entries == 0) {
+            log->active_start = time(NULL);
+        }
+        for (int i = 0; i < count; i++) {
+            log->active_entries += 1;
+            log->active_errors += picked[i]->error;
+        }
+        int rings = atomic_load(&log->ring_count);
+        for (int i = 0; i < rings; i++) {
+            atomic_store(&(log->rings[i]->released), log->rings[i]->taken);
+        }
+        log->head += count;
+        log->active_bytes += written > 0 ? written : 0;
+        if (log->segment_bytes > 0 && log->active_bytes >= log->segment_bytes) {
+            log_rotate(log);
+        }
+        atomic_store(&log->written, log->head);
+        if (atomic_load(&log->waiting) > 0) {
+            pthread_mutex_lock(&log->lock);
+            pthread_cond_broadcast(&log->done);
+            pthread_mutex_unlock(&log->lock);
+        }
+
+        if (log->fsync_ms >= 0) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long elapsed = (now.tv_sec - synced.tv_sec) * 1000 + (now.tv_nsec - synced.tv_nsec) / 1000000;
+            unsynced = 1;
+            if (elapsed >= log->fsync_ms) {
+                fdatasync(log->logfd);
+                synced = now;
+                unsynced = 0;
+            }
+        }
+        if (count < LOG_BATCH && log->flush_ms > 0) {
+            log_writer_sleep(log);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * log_writer_create()
+ * Starts the log writer on specs->logfd
+ */
+struct log_writer *log_writer_create(struct parameters *specs) {
+    struct log_writer *log = calloc(1, sizeof(struct log_writer));
+    pthread_t thread;
+
+    pthread_key_create(&log->ring_key, log_ring_release);
+    // slots start on a cache line of their own
+    log->slot_size = (sizeof(struct log_slot) + LOG_SIZE + 2 * specs->log_body_size + 1 + 63) & ~(size_t) 63;
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_mutex_init(&log->shared_lock, NULL);
+    log->shared = log_ring_add(log);
+    pthread_cond_init(&log->ready, NULL);
+    pthread_cond_init(&log->done, NULL);
+    log->logfd = specs->logfd;
+    log->flush_ms = specs->log_flush_ms;
+    log->fsync_ms = specs->log_fsync_ms;
+    log->drop = specs->log_drop;
+    log->name = specs->log_file_name;
+    log->binary = specs->log_binary;
+    log->segment_bytes = specs->log_segment_bytes;
+    log->segment_seconds = specs->log_segment_seconds;
+    log->max_segments = specs->log_max_segments;
+    log_segments_load(log);
+
+    if (pthread_create(&thread, NULL, log_writer_run, log) != 0) {
+        err(EXIT_FAILURE, "log writer");
+    }
+    pthread_detach(thread);
+    return log;
+}
+
+/*
+ * log_content_length()
+ * The length of the body a log entry reports: the one stored for a PUT, the one sent otherwise
+ */
+ssize_t log_content_length(struct httpObject* message) {
+    return strcmp(message->method, "PUT") == 0 ? message->stored_length : message->content_length;
+}
+
+/*
+ * log_body_logged()
+ * How many bytes of log_body_buffer the entry keeps, counted rather than found with strlen()
+ * since a body may hold NUL bytes
+ */
+ssize_t log_body_logged(struct httpObject* message, struct parameters* specs) {
+    if (message->log_body_buffer == NULL) {
+        return 0;
+    }
+    return message->log_body_length < specs->log_body_size ? message->log_body_length : specs->log_body_size;
+}
+
+/*
+ * log_request()
+ * log request to file when -l is provided, through the log writer
+ */
+void log_request(struct httpObject* message, struct parameters* specs) {
+    struct log_ring *ring;
+    if (specs->log_writer == NULL) {
+        return;
+    }
+    struct log_slot *slot = log_claim(specs->log_writer, &ring);
+    if (slot == NULL) {
+        return;
+    }
+    char * log_entry = slot->line;
+    int length;
+
+    if (specs->log_binary == 1) {
+        // the same entry as a record, the body kept raw
+        char *body = message->log_body_buffer != NULL ? message->log_body_buffer : "";
+        size_t body_length = 0;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (!log_is_error(message->status_code)) {
+            body_length = log_body_logged(message, specs);
+        }
+        length = log_record_write(log_entry, message->status_code, message->method, message->filename + 1, message->host,
+                                  log_content_length(message), body, body_length, now.tv_sec * 1000000000LL + now.tv_nsec);
+    }
+    else if (log_is_error(message->status_code)) {
+        //Example format of a log line for a FAIL request
+        //FAIL\tGET /abcd HTTP/1.1\t404\n
+        //FAIL\t$(message->method) $(message->filename) HTTP/1.1\t$(message->status_code)\n...
+
+        length = sprintf(log_entry, "FAIL\t%s %s HTTP/1.1\t%d\n", message->method, message->filename+1, message->status_code);
+
+#if DEBUG == 1
+        //printf("Printing my error string for a non-200/non-201 FAIL log: %s\n", log_entry);
+#endif
+    }
+    else {
+        // nothing was captured for a context that never had a body to log
+        char *body = message->log_body_buffer != NULL ? message->log_body_buffer : "";
+        ssize_t size = log_body_logged(message, specs);
+
+#if DEBUG == 1
+    //printf("message->host = %s\n", message->host);
+#endif
+        length = sprintf(log_entry, "%s\t%s\t%s\t%zd\t", message->method, message->filename + 1, message->host, log_content_length(message));
+        // the hex of the head of the body goes straight into the line
+        char *end = hex_encode(log_entry + length, (const uint8_t *) body, size);
+        *end++ = '\n';
+        *end = '\0';
+        length = end - log_entry;
+    }
+
+    slot->error = log_is_error(message->status_code);
+    log_publish(specs->log_writer, ring, slot, length);
+    // /healthcheck reads errors before entries, so it never sees more errors than entries
+    atomic_fetch_add(&specs->log_writer->entries, 1);
+    if (log_is_error(message->status_code)) {
+        atomic_fetch_add(&specs->log_writer->errors, 1);
+    }
+}
+
+
+
+/*
+ * health_check()
+ * Returns the number of errors and entries in the log, counted as lines are logged
+ */
+void health_check(struct httpObject* message, struct parameters* specs) {
+    struct log_writer *log = specs->log_writer;
+
+    if (log == NULL) {
+        // no log without -l
+        message->status_code = 404;
+    }
+    else if (strcmp(message->method, "PUT") == 0 || strcmp(message->method, "HEAD") == 0 ) {
+        message->status_code = 403;
+    }
+    else {
+        //a successful health check request
+        long errorCount = atomic_load(&log->errors);
+        long entryCount = atomic_load(&log->entries);
+#if DEBUG == 1
+    //printf("entry = %ld\n", entryCount);
+    //printf("error = %ld\n", errorCount);
+#endif
+        sprintf((char*)message->buffer, "%ld\n%ld\n", errorCount, entryCount);
+        message->content_length = strlen((char*)message->buffer);
+        message->status_code = 200;
+        
+    }
+    capture_log_body(message, specs, message->buffer, message->content_length, 0);
+    log_request(message, specs);
+}
+
+/*
+* is_invalid_resource_name()
+* checks for invalid resource (file) name
+*/
+int is_valid_resource_name (char * name) {
+    int namelen = strlen(name);
+    
+    if (namelen > 19) {
+        //if the name is longer than 19 chars, then it's invalid
+#if DEBUG == 1
+        printf("Name is too long\n");
+#endif
+        return 0;
+    }
+    
+    for (int i = 0; i < namelen; i++) {
+        //if a character is not a-z, A-Z, 0-9, a '.', or '_', then the name is invalid
+        if ( !( (name[i] >= 'a' && name[i] <= 'z') || (name[i] >= 'A' && name[i] <= 'Z') || (name[i] >= '0' && name[i] <= '9') || (name[i] == '.') || (name[i] == '_') )) {
+#if DEBUG == 1
+            printf("Character is bad: %c\n", name[i]);
+#endif
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+* is_invalid_host()
+* checks for an invalid host
+*/
+int is_invalid_host (char * host) {
+    int hostlen = strlen(host);
+
+    for (int i = 0; i < hostlen; i++) {
+        //host is invalid when it contains a white space
+        if (host[hostlen] == ' ') {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+/*
+* is_bad_request()
+* checks for a bad request based off the resource(file name), http version, host
+*/
+
+int is_bad_request(char * resource, char * httpversion, char * host) {
+    if (strcmp(httpversion, "HTTP/1.1") != 0) {
+        //http version is invalid
+#if DEBUG == 1
+        printf("setting to a bad request because of invalid http\n");
+#endif
+        return 1;
+    } else if (!is_valid_resource_name(resource)) {
+        //filename is greater than 19 characters or contains invalid characters
+#if DEBUG == 1
+        printf("setting to a bad request because of invalid characters in filename\n");
+#endif
+        return 1;
+    } else if (host == NULL || is_invalid_host(host)) {
+        //host is invalid
+#if DEBUG == 1
+        printf("setting to a bad request because of invalid host\n");
+#endif
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+ 
+/*
+* parse_http_headers()
+* Takes what the parser found once the headers are all in message->buffer
+*/
+void parse_http_headers(struct httpObject* message) {
+    struct http_request *request = &(message->request);
+    char *buff = (char *) message->buffer;
+
+    if (http_parse_request(request, buff, message->received_length) != HTTP_PARSE_DONE) {
+        // malformed, or the headers never ended, nothing after this can be trusted
+        strcpy(message->httpversion, "HTTP/1.1");
+        message->body_offset = message->received_length;
+        message->request_length = message->received_length;
+        message->keep_alive = 0;
+        message->status_code = 400;
+        return;
+    }
+
+    message->body_offset = request->header_length;
+    message->request_length = request->header_length + (request->content_length > 0 ? request->content_length : 0);
+    message->content_length = request->content_length > 0 ? request->content_length : 0;
+    message->cflag = request->expect_continue;
+    // HTTP/1.1 connections stay open unless the client asks to close
+    message->keep_alive = !request->connection_close;
+
+    if (http_span_copy(message->method, METHOD_SIZE, buff, request->method) < 0 ||
+        http_span_copy(message->httpversion, sizeof message->httpversion, buff, request->version) < 0 ||
+        http_span_copy(message->host, FILENAME_SIZE, buff, request->host) < 0 ||
+        http_span_copy(message->filename + 1, FILENAME_SIZE - 1, buff, request->target) < 0) {
+        strcpy(message->httpversion, "HTTP/1.1");
+        message->status_code = 400;
+        return;
+    }
+    message->filename[0] = '.';
+}
+
+/*
+* read_http_response()
+* Reads request from client and stores information into httpObject message
+*/
+void read_http_response(int connfd, struct httpObject* message) {
+    ssize_t readcheck = 0;
+    // the buffer may already hold this request, read along with the previous one
+    int state = http_parse_request(&(message->request), (char *) message->buffer, message->received_length);
+
+    // Reads only until the end of the headers, a PUT body is streamed to disk by process_request()
+    while (state == HTTP_PARSE_AGAIN && message->received_length < BUFFER_SIZE - 1) {
+        readcheck = recv(connfd, message->buffer + message->received_length, BUFFER_SIZE - 1 - message->received_length, 0);
+        if (readcheck <= 0) {
+            break;
+        }
+        message->received_length += readcheck;
+        message->buffer[message->received_length] = '\0';
+        state = http_parse_request(&(message->request), (char *) message->buffer, message->received_length);
+    }
+    if (message->received_length == 0) {
+        return;
+    }
+
+    parse_http_headers(message);
+
+    if (readcheck == -1) {
+      message->status_code = 500;
+    }
+
+    return;
+}
+
+/*
+* check_keep_alive()
+* Closes the connection after this response when the next request can't be found reliably:
+* after a malformed request, or when part of the request body was never read
+*/
+void check_keep_alive(struct httpObject* message) {
+    int body_read = message->received_length >= message->request_length ||
+                    (strcmp(message->method, "PUT") == 0 && message->status_code == 201);
+
+    if (message->status_code == 400 || message->status_code == 500 || !body_read) {
+        message->keep_alive = 0;
+    }
+}
+
+/*
+* take_pending_bytes()
+* Moves the bytes received after the end of this request (the start of the next one) into pending
+* Returns their length
+*/
+ssize_t take_pending_bytes(struct httpObject* message, uint8_t *pending) {
+    ssize_t length = message->received_length - message->request_length;
+    if (length <= 0) {
+        return 0;
+    }
+    memcpy(pending, message->buffer + message->request_length, length);
+    return length;
+}
+
+/*
+* set_nodelay()
+* Header and body are separate sends, on a kept-alive connection the body
+* must not wait for the client to acknowledge the header
+*/
+void set_nodelay(int connfd) {
+    int nodelay = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay);
+}
+
+/*
+* wait_for_request()
+* Waits up to timeout seconds for the next request on a keep-alive connection
+* A -P listener passes its listenfd, a new client there doesn't wait for an idle connection
+* Returns 0 when the connection has been idle for too long, -1 when a client is waiting on listenfd
+*/
+int wait_for_request(int connfd, int listenfd, int timeout) {
+    struct pollfd pfd[2];
+    pfd[0].fd = connfd;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd = listenfd;
+    pfd[1].events = POLLIN;
+    pfd[1].revents = 0;
+
+    int ret;
+    do {
+        ret = poll(pfd, listenfd == -1 ? 1 : 2, timeout > 0 ? timeout * 1000 : -1);
+    } while (ret < 0 && errno == EINTR);
+    if (ret > 0 && pfd[0].revents != 0) {
+        return 1;
+    }
+    return ret > 0 && (pfd[1].revents & POLLIN) ? -1 : 0;
+}
+
+/*
+    Struct file_entry
+    A file GET and HEAD requests share without opening it again. The cache holds one reference
+    and every request using filedesc another, the last one to let go closes it. Once checked is
+    FILE_CACHE_TTL old, the next GET stats the name again and drops the entry if the file was
+    replaced or changed by anything other than a PUT.
+*/
+struct file_entry {
+    char name[FILENAME_SIZE];           // example: ./file1.txt
+    int filedesc;
+    off_t size;
+    struct timespec mtime;
+    time_t checked;                     // monotonic_seconds() when size and mtime were last known to be right
+    int refs;
+};
+
+/*
+    Struct file_cache
+    A direct mapped table: a name only ever goes into the slot of its hash, a new file evicts
+    whatever was there. A PUT empties the slot of its name and bumps the slot's generation,
+    so a GET that opened the file before the PUT finished doesn't put it back.
+*/
+struct file_cache {
+    pthread_mutex_t lock;
+    struct file_entry *slots[FILE_CACHE_SIZE];
+    unsigned long generation[FILE_CACHE_SIZE];
+};
+
+static struct file_cache file_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * file_cache_slot()
+ * The slot a name goes in
+ */
+int file_cache_slot(const char *name) {
+    unsigned long hash = 5381;
+    for (; *name != '\0'; name++) {
+        hash = hash * 33 + (unsigned char) *name;
+    }
+    return hash % FILE_CACHE_SIZE;
+}
+
+/*
+ * file_entry_release()
+ * Drops one reference, the last one closes the file
+ * Called with the cache lock held
+ */
+void file_entry_release(struct file_entry *file) {
+    file->refs -= 1;
+    if (file->refs == 0) {
+        close(file->filedesc);
+        free(file);
+    }
+}
+
+/*
+ * file_entry_current()
+ * Whether name is still the file the entry holds open, with the same size and mtime
+ */
+int file_entry_current(struct file_entry *file, const char *name) {
+    struct stat st, held;
+    if (stat(name, &st) == -1 || fstat(file->filedesc, &held) == -1) {
+        return 0;
+    }
+    return st.st_dev == held.st_dev && st.st_ino == held.st_ino && st.st_size == file->size &&
+        st.st_mtim.tv_sec == file->mtime.tv_sec && st.st_mtim.tv_nsec == file->mtime.tv_nsec;
+}
+
+/*
+ * file_cache_get()
+ * Returns the open file for a GET or HEAD with a reference for the caller, opening it on a miss
+ * Returns NULL with errno set when the file can't be opened
+ */
+struct file_entry *file_cache_get(const char *name, struct parameters* specs) {
+    int slot = file_cache_slot(name);
+    struct file_entry *file;
+    struct stat st;
+    time_t now = monotonic_seconds();
+
+    pthread_mutex_lock(&file_cache.lock);
+    file = file_cache.slots[slot];
+    if (file != NULL && strcmp(file->name, name) == 0) {
+        file->refs += 1;
+        if (now - file->checked < FILE_CACHE_TTL) {
+            pthread_mutex_unlock(&file_cache.lock);
+            atomic_fetch_add(&stats.file_hits, 1);
+            return file;
+        }
+        pthread_mutex_unlock(&file_cache.lock);
+
+        if (file_entry_current(file, name)) {
+            pthread_mutex_lock(&file_cache.lock);
+            file->checked = now;
+            pthread_mutex_unlock(&file_cache.lock);
+            atomic_fetch_add(&stats.file_hits, 1);
+            return file;
+        }
+        pthread_mutex_lock(&file_cache.lock);
+        if (file_cache.slots[slot] == file) {
+            file_cache.slots[slot] = NULL;
+            file_cache.generation[slot] += 1;
+            file->refs -= 1;        // the cache's reference, ours is still held
+        }
+        file_entry_release(file);
+    }
+    unsigned long generation = file_cache.generation[slot];
+    pthread_mutex_unlock(&file_cache.lock);
+    atomic_fetch_add(&stats.file_misses, 1);
+
+    int filedesc, filespec = 0;
+    struct uring *ring = worker_uring(specs);
+    if (ring != NULL) {
+        filedesc = uring_open_stat(ring, name, O_RDONLY, &st);
+    }
+    else {
+        filedesc = open(name, O_RDONLY);
+        filespec = stat(name, &st);
+    }
+    if (filedesc == -1 || filespec == -1) {
+        if (filedesc != -1) {
+            int saved = errno;
+            close(filedesc);
+            errno = saved;
+        }
+        return NULL;
+    }
+
+    file = malloc(sizeof *file);
+    strcpy(file->name, name);
+    file->filedesc = filedesc;
+    file->size = st.st_size;
+    file->mtime = st.st_mtim;
+    file->checked = now;
+    file->refs = 1;
+
+    pthread_mutex_lock(&file_cache.lock);
+    if (file_cache.generation[slot] == generation) {
+        if (file_cache.slots[slot] != NULL) {
+            file_entry_release(file_cache.slots[slot]);
+        }
+        file_cache.slots[slot] = file;
+        file->refs += 1;
+    }
+    pthread_mutex_unlock(&file_cache.lock);
+    return file;
+}
+
+/*
+ * file_cache_put()
+ * Gives back the reference file_cache_get() returned
+ */
+void file_cache_put(struct file_entry *file) {
+    pthread_mutex_lock(&file_cache.lock);
+    file_entry_release(file);
+    pthread_mutex_unlock(&file_cache.lock);
+}
+
+/*
+ * file_cache_size()
+ * Size of a file the cache holds, without opening it
+ * Returns -1 when it isn't in the cache
+ */
+off_t file_cache_size(const char *name) {
+    int slot = file_cache_slot(name);
+    off_t size = -1;
+
+    pthread_mutex_lock(&file_cache.lock);
+    struct file_entry *file = file_cache.slots[slot];
+    if (file != NULL && strcmp(file->name, name) == 0) {
+        size = file->size;
+    }
+    pthread_mutex_unlock(&file_cache.lock);
+    return size;
+}
+
+/*
+ * file_cache_invalidate()
+ * Forgets a file that a PUT is changing, requests already sending it keep their reference
+ */
+void file_cache_invalidate(const char *name) {
+    int slot = file_cache_slot(name);
+
+    pthread_mutex_lock(&file_cache.lock);
+    struct file_entry *file = file_cache.slots[slot];
+    if (file != NULL && strcmp(file->name, name) == 0) {
+        file_cache.slots[slot] = NULL;
+        file_entry_release(file);
+    }
+    file_cache.generation[slot] += 1;
+    pthread_mutex_unlock(&file_cache.lock);
+}
+
+/*
+ * close_request_file()
+ * Closes the file of a request, or gives it back to the cache it came from
+ */
+void close_request_file(struct httpObject* message) {
+    if (message->file != NULL) {
+        file_cache_put(message->file);
+        message->file = NULL;
+    }
+    else if (message->filedesc != -1) {
+        close(message->filedesc);
+    }
+    message->filedesc = -1;
+}
+
+/*
+ * metrics()
+ * Reports the server counters, one "name value" per line
+ */
+void metrics(struct httpObject* message) {
+    if (strcmp(message->method, "GET") != 0) {
+        message->status_code = 403;
+        return;
+    }
+
+    sprintf((char*)message->buffer,
+            "connections %ld\nrequests %ld\nreused_requests %ld\nidle_closed %ld\nmax_requests_closed %ld\n"
+            "pipelined_requests %ld\nfile_cache_hits %ld\nfile_cache_misses %ld\nlog_dropped %ld\n"
+            "pool_threads %ld\npool_started %ld\npool_retired %ld\ncontrol_requests %ld\n",
+            atomic_load(&stats.connections), atomic_load(&stats.requests), atomic_load(&stats.reused),
+            atomic_load(&stats.idle_closed), atomic_load(&stats.max_closed), atomic_load(&stats.pipelined),
+            atomic_load(&stats.file_hits), atomic_load(&stats.file_misses), atomic_load(&stats.log_dropped),
+            atomic_load(&stats.pool_threads), atomic_load(&stats.pool_started), atomic_load(&stats.pool_retired),
+            atomic_load(&stats.control));
+    if (server_pool != NULL) {
+        pool_metrics(server_pool, (char*)message->buffer + strlen((char*)message->buffer));
+    }
+    message->content_length = strlen((char*)message->buffer);
+    message->status_code = 200;
+}
+
+/*
+* read_log_body()
+* Reads the part of the head of the body the log still needs from filedesc, for bodies
+* that went between the socket and the file without passing through a buffer
+*/
+void read_log_body(struct httpObject* message, int filedesc, struct parameters* specs) {
+    ssize_t missing = log_body_missing(message, specs);
+    if (missing == 0) {
+        return;
+    }
+    char *body = log_body(message, specs);
+    if (body == NULL) {
+        return;
+    }
+    ssize_t length = pread(filedesc, body + message->log_body_length, missing, message->log_body_length);
+    message->log_body_length += length > 0 ? length : 0;
+    body[message->log_body_length] = '\0';
+}
+
+/*
+* open_put_file()
+* Truncates or creates the target of a PUT, sets the status code when it can't be opened
+*/
+int open_put_file(struct httpObject* message) {
+    file_cache_invalidate(message->filename);
+    // if file already exists, truncate it
+    int filedesc = open(message->filename, O_TRUNC | O_RDWR, 0600);
+#if DEBUG == 1
+    //printf("Truncated an existing file\n");
+#endif
+    if (filedesc == -1) {
+        // otherwise if it doesn't exist, then create it
+        filedesc = open(message->filename, O_CREAT | O_RDWR , 0600);
+#if DEBUG == 1
+        //printf("created new file\n");
+#endif
+    }
+    if (filedesc == -1) {
+        message->status_code = (errno == EACCES) ? 403 : 500;
+    }
+    return filedesc;
+}
+
+/*
+* store_received_body()
+* Writes the part of a PUT body that arrived together with the headers
+* Returns how many body bytes are still on the socket, or -1 on error
+*/
+ssize_t store_received_body(struct httpObject* message, int filedesc, struct parameters* specs) {
+    ssize_t received = message->received_length - message->body_offset;
+    if (received > message->content_length) {
+        received = message->content_length;
+    }
+    capture_log_body(message, specs, message->buffer + message->body_offset, received, 0);
+    if (write_full(filedesc, message->buffer + message->body_offset, received) < 0) {
+        return -1;
+    }
+    return message->content_length - received;
+}
+
+/*
+* finish_put()
+* Sets the status of a PUT once its body is stored, keeps the head of the body for the log
+*/
+void finish_put(struct httpObject* message, int filedesc, int stored, struct parameters* specs) {
+    message->status_code = stored ? 201 : 500;
+    message->stored_length = message->content_length;
+    // a GET while the body was written may have cached the size it had then
+    file_cache_invalidate(message->filename);
+
+    struct uring *ring = worker_uring(specs);
+    if (ring != NULL) {
+        ssize_t missing = log_body_missing(message, specs);
+        char *body = missing > 0 ? log_body(message, specs) : NULL;
+        if (body != NULL) {
+            int read = uring_queue_read(ring, filedesc, body + message->log_body_length, missing, message->log_body_length);
+            uring_queue_close(ring, filedesc);
+            uring_flush(ring);
+            message->log_body_length += ring->results[read] > 0 ? ring->results[read] : 0;
+            body[message->log_body_length] = '\0';
+        }
+        else {
+            uring_queue_close(ring, filedesc);
+            uring_flush(ring);
+        }
+        return;
+    }
+
+    //log
+    read_log_body(message, filedesc, specs);
+
+    close(filedesc);
+}
+
+/*
+* process_request()
+* Validating request, assigns status code, then performs corresponding task
+* With connfd == -1 a PUT body is left for the caller to stream into message->filedesc
+*/
+void process_request(int connfd, struct httpObject* message, struct parameters* specs) {
+ 
+    // the request line and headers were parsed as they arrived, see parse_http_headers()
+    const char *methodRead = message->method;
+    const char *filenameRead = message->filename + 1;
+
+#if DEBUG == 1
+    //printf("message->host = %s\n", message->host);
+    //printf("message->filename = %s\n", message->filename);
+#endif
+ 
+
+    //if (strlen(methodRead) > 6 || strlen(filenameRead) > FILENAME_SIZE || strlen(httpversionRead) > 9 || strcmp(httpversionRead, "HTTP/1.1") != 0) {
+     if (message->status_code == 400 || message->status_code == 500) {
+         // the parser rejected the request, or reading it failed
+         return;
+     }
+     else if (is_bad_request(message->filename+2, message->httpversion, message->host)) {
+         //pass in message->filename+2 to ignore the first 2 chars "./"
+         message->status_code = 400;
+     }
+     else if (strcmp(methodRead, "GET") != 0 && strcmp(methodRead, "PUT") != 0 && strcmp(methodRead, "HEAD") != 0) {
+         message->status_code = 501;
+     }
+     else if (strcmp("/healthcheck", filenameRead) == 0 && message->status_code != 400 && message->status_code != 501) {
+#if DEBUG == 1
+        //printf("healthcheck() ran\n");
+#endif
+        //strcpy(message->filename, ".");
+        //strcat(message->filename, filenameRead);
+     
+        health_check(message, specs);
+        message->hflag = 1;
+    }
+    else if (strcmp("/metrics", filenameRead) == 0) {
+        // answered from message->buffer and not logged, like /healthcheck
+        metrics(message);
+        message->hflag = 1;
+    }
+    else if (strcmp(methodRead, "GET") == 0 || strcmp(methodRead, "HEAD") == 0) {
+      
+        
+        struct file_entry *file = file_cache_get(message->filename, specs);
+        
+        if (file == NULL) {
+            if (errno == EACCES) {
+                message->status_code = 403;
+            }
+            else {
+            message->status_code = 404;
+            }
+        }
+        else {
+            // kept open for send_http_response(), finish_request() gives it back
+            message->file = file;
+            message->filedesc = file->filedesc;
+            message->content_length = file->size;
+            message->status_code = 200;
+        }
+    }
+    else if (strcmp(methodRead, "PUT") == 0) {
+
+        int filedesc = open_put_file(message);
+        if (filedesc == -1) {
+            return;
+        }
+        if (connfd == -1) {
+            message->filedesc = filedesc;
+            return;
+        }
+
+        // The body is streamed: the part that arrived with the headers is written first,
+        // the rest moves from the socket to the file one chunk at a time
+        ssize_t remaining = store_received_body(message, filedesc, specs);
+        if (message->cflag == 1 && remaining > 0) {
+            send_full(connfd, (uint8_t *)cont100, sizeof(cont100) - 1, -1);
+        }
+        int timeout = specs->idle_timeout > 0 ? specs->idle_timeout : IDLE_TIMEOUT;
+        finish_put(message, filedesc, remaining >= 0 && recv_file_full(connfd, filedesc, remaining, message->buffer, timeout) >= 0, specs);
+    }
+    else {
+      message->status_code = 500;
+    }
+    return;
+}
+
+/*
+* format_decimal()
+* Writes value in decimal to dest, without a terminator
+* Returns the number of digits
+*/
+size_t format_decimal(char *dest, ssize_t value) {
+    char digits[24];
+    size_t count = 0;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    for (size_t i = 0; i < count; i++) {
+        dest[i] = digits[count - 1 - i];
+    }
+    return count;
+}
+
+/*
+* construct_http_response()
+* Creates message regarding task status
+* The header is copied together from the status table, a response without a file gets its body in message->buffer
+*/
+void construct_http_response(struct httpObject* message) {
+    const struct status_line *status = NULL;
+    int count = sizeof status_lines / sizeof status_lines[0];
+    for (int i = 0; i < count; i++) {
+        status = &status_lines[i];
+        if (status->code == message->status_code) {
+            break;
+        }
+    }
+
+    char *header = (char *) message->header;
+    size_t length = status->line_length;
+    memcpy(header, status->line, length);
+
+    if (message->status_code != 200) {
+        // the status text is the body
+        memcpy(message->buffer, status->body, status->body_length + 1);
+        message->content_length = status->body_length;
+    }
+
+    memcpy(header + length, "Content-Length: ", 16);
+    length += 16;
+    length += format_decimal(header + length, message->content_length);
+    if (message->keep_alive) {
+        memcpy(header + length, "\r\n\r\n", 4);
+        length += 4;
+    }
+    else {
+        memcpy(header + length, "\r\nConnection: close\r\n\r\n", 23);
+        length += 23;
+    }
+    header[length] = '\0';
+    message->header_length = length;
+}
+
+/*
+    Struct shed_linger
+    Connections turned away with 503, kept open a little longer: closing one right after the 503
+    would reset it when the request arrives after it, and the client could lose the 503. One is
+    closed once the client closes its end, SHED_LINGER_SECONDS after it was turned away, or when
+    SHED_LINGER newer ones need its slot. The control lane and the reactors look at it on every tick.
+*/
+struct shed_linger {
+    pthread_mutex_t lock;
+    int connfd[SHED_LINGER];            // descriptor + 1, 0 for none
+    time_t since[SHED_LINGER];          // monotonic_seconds() when it was turned away
+    unsigned int next;
+    atomic_int count;                   // slots in use, so a tick with none costs no lock
+};
+
+static struct shed_linger shed_linger = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * shed_linger_close()
+ * Closes the connection of a slot and frees the slot
+ * Called with the shed_linger lock held
+ */
+void shed_linger_close(int slot) {
+    close(shed_linger.connfd[slot] - 1);
+    shed_linger.connfd[slot] = 0;
+    atomic_fetch_sub(&shed_linger.count, 1);
+}
+
+/*
+ * shed_linger_expire()
+ * Closes the connections turned away whose client closed its end or that lingered long enough,
+ * throwing away whatever else the clients sent
+ */
+void shed_linger_expire(void) {
+    char request[REQUEST_HEADER_SIZE];
+
+    if (atomic_load(&shed_linger.count) == 0) {
+        return;
+    }
+    time_t now = monotonic_seconds();
+    pthread_mutex_lock(&shed_linger.lock);
+    for (int slot = 0; slot < SHED_LINGER; slot++) {
+        if (shed_linger.connfd[slot] == 0) {
+            continue;
+        }
+        ssize_t ret;
+        while ((ret = recv(shed_linger.connfd[slot] - 1, request, sizeof request, MSG_DONTWAIT)) > 0) {
+        }
+        int closed = ret == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+        if (closed || now - shed_linger.since[slot] >= SHED_LINGER_SECONDS) {
+            shed_linger_close(slot);
+        }
+    }
+    pthread_mutex_unlock(&shed_linger.lock);
+}
+
+/*
+* shed_connection()
+* Turns away a connection the server has no room for with 503 and Retry-After, from the thread
+* that accepted it: nothing is parsed or logged and no worker is involved
+*/
+void shed_connection(int connfd) {
+    const struct status_line *status = NULL;
+    int count = sizeof status_lines / sizeof status_lines[0];
+    for (int i = 0; i < count; i++) {
+        status = &status_lines[i];
+        if (status->code == 503) {
+            break;
+        }
+    }
+
+    char header[HEADER_SIZE];
+    size_t length = status->line_length;
+    memcpy(header, status->line, length);
+    length += sprintf(header + length, "Retry-After: %d\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                      SHED_RETRY_AFTER, status->body_length);
+
+    char request[REQUEST_HEADER_SIZE];
+    while (recv(connfd, request, sizeof request, MSG_DONTWAIT) > 0) {
+    }
+    struct iovec iov[2] = { { header, length }, { (void *) status->body, status->body_length } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    sendmsg(connfd, &msg, MSG_DONTWAIT);
+    shutdown(connfd, SHUT_WR);
+    atomic_fetch_add(&stats.shed, 1);
+
+    // closing now would reset the connection when the request arrives after the 503
+    pthread_mutex_lock(&shed_linger.lock);
+    unsigned int slot = shed_linger.next++ % SHED_LINGER;
+    if (shed_linger.connfd[slot] > 0) {
+        shed_linger_close(slot);
+    }
+    shed_linger.connfd[slot] = connfd + 1;
+    shed_linger.since[slot] = monotonic_seconds();
+    atomic_fetch_add(&shed_linger.count, 1);
+    pthread_mutex_unlock(&shed_linger.lock);
+}
+
+/*
+* response_iov()
+* Points iov at what is left of the header and of a body kept in message->buffer after sent bytes
+* Returns how many of the 2 iovecs are used
+*/
+int response_iov(struct httpObject* message, ssize_t sent, struct iovec *iov) {
+    // error text, /healthcheck and /metrics come from the buffer, a GET body from the file
+    ssize_t body_length = (message->status_code != 200 || message->hflag == 1) ? message->content_length : 0;
+    int count = 0;
+
+    if (sent < message->header_length) {
+        iov[count].iov_base = message->header + sent;
+        iov[count].iov_len = message->header_length - sent;
+        count += 1;
+        sent = 0;
+    }
+    else {
+        sent -= message->header_length;
+    }
+    if (sent < body_length) {
+        iov[count].iov_base = message->buffer + sent;
+        iov[count].iov_len = body_length - sent;
+        count += 1;
+    }
+    return count;
+}
+
+/*
+* sends_file()
+* Checks whether the body of the response comes from message->filedesc
+*/
+int sends_file(struct httpObject* message) {
+    return message->status_code == 200 && message->hflag != 1 && message->content_length > 0 &&
+           message->filedesc != -1 && strcmp("GET", message->method) == 0;
+}
+
+/*
+* send_http_response()
+* Delivers status message to client, follow up with content if available
+*/
+void send_http_response(int connfd, struct httpObject* message, struct parameters* specs) {
+    struct iovec iov[2];
+
+    if (sends_file(message)) {
+        // the header waits for the start of the file, the body goes from the file to the socket in the kernel
+        ssize_t sent = send(connfd, message->header, message->header_length, MSG_MORE);
+        if (sent >= 0 && sent < message->header_length) {
+            send_full(connfd, message->header + sent, message->header_length - sent, -1);
+        }
+        int filedesc = message->filedesc;
+        send_file_full(connfd, filedesc, message->content_length, message->buffer);
+
+        // sendfile() never brings the body into user space, the log gets its head from the page cache
+        if (specs->lflag == 1) {
+            read_log_body(message, filedesc, specs);
+        }
+        return;
+    }
+
+    // everything else is in memory and goes out in one system call
+    writev_full(connfd, iov, response_iov(message, 0, iov));
+}
+
+/*
+ * clear_httpObject()
+ * reset all data in an httpObject
+ */
+void clear_httpObject(struct httpObject* message) {
+    memset(message->host, 0, FILENAME_SIZE);
+    memset(message->method, 0, METHOD_SIZE);
+    memset(message->filename, 0, FILENAME_SIZE);
+    memset(message->httpversion, 0, 9);
+    message->content_length = 0;
+    message->header_length = 0;
+    message->received_length = 0;
+    message->body_offset = 0;
+    message->status_code = 0;
+    // the buffers are only ever read up to their terminator, so emptying them is enough
+    message->header[0] = '\0';
+    message->buffer[0] = '\0';
+    if (message->log_body_buffer != NULL) {
+        message->log_body_buffer[0] = '\0';
+    }
+    message->log_body_length = 0;
+    message->stored_length = 0;
+    message->hflag = 0;
+    message->cflag = 0;
+    message->filedesc = -1;
+    message->file = NULL;
+    message->keep_alive = 0;
+    message->request_length = 0;
+    http_request_init(&(message->request));
+}
+
+/*
+ * parse_cpu_list()
+ * Reads a list of CPUs such as "0-3,8,10-11" into cpus
+ * Returns how many, or -1 when the list is malformed
+ */
+int parse_cpu_list(const char *list, int *cpus, int max) {
+    int count = 0;
+    while (*list != '\0') {
+        char *end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first) {
+                return -1;
+            }
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (count == max || cpu >= CPU_SETSIZE) {
+                return -1;
+            }
+            cpus[count++] = cpu;
+        }
+        if (*end == ',') {
+            end += 1;
+        }
+        else if (*end != '\0') {
+            return -1;
+        }
+        list = end;
+    }
+    return count;
+}
+
+static __thread int thread_node = -1;   // NUMA node of a pinned thread, -1 when it isn't pinned
+
+/*
+ * pin_thread()
+ * -C: keeps the calling thread on the index-th CPU of the list, counting around it,
+ * and notes the CPU's NUMA node so the thread's request contexts are allocated there
+ * Returns the CPU, or -1 without -C
+ */
+int pin_thread(struct parameters *specs, int index) {
+    if (specs->cpu_count == 0) {
+        return -1;
+    }
+    int cpu = specs->cpus[index % specs->cpu_count];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof set, &set) != 0) {
+        warnx("cannot run a thread on CPU %d", cpu);
+        return -1;
+    }
+    unsigned int current, node;
+    if (syscall(__NR_getcpu, &current, &node, NULL) == 0) {
+        thread_node = node % NUMA_NODES;
+    }
+    return cpu;
+}
+
+/*
+    Request contexts
+    An httpObject is a request context that outlives its request. Each thread keeps a few
+    finished ones and reuses them, so a request costs neither a malloc() of 2 MB nor the
+    page faults of fresh memory, and clear_httpObject() only resets what a request used.
+    In -E mode a context is taken by a worker and given back by a reactor, so what doesn't
+    fit a thread's cache goes to a small shared one. With -C a context is mapped on the
+    NUMA node of the thread that allocates it, and only threads of that node reuse it.
+*/
+static __thread struct httpObject *context_cache[CONTEXT_CACHE];
+static __thread int context_cache_count = 0;
+static struct httpObject *shared_contexts[NUMA_NODES][SHARED_CONTEXTS];
+static int shared_context_count[NUMA_NODES];
+static pthread_mutex_t shared_context_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * request_context_alloc()
+ * A new httpObject, its pages on the calling thread's NUMA node when the thread is pinned
+ */
+struct httpObject *request_context_alloc(void) {
+    struct httpObject *message = mmap(NULL, sizeof *message, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (message == MAP_FAILED) {
+        err(EXIT_FAILURE, "mmap");
+    }
+    if (thread_node >= 0) {
+        // before any page is touched, so none of them lands elsewhere
+        unsigned long nodes = 1UL << thread_node;
+        syscall(__NR_mbind, message, sizeof *message, MPOL_PREFERRED, &nodes, sizeof nodes * 8 + 1, 0);
+    }
+    message->node = thread_node < 0 ? 0 : thread_node;
+    message->log_body_buffer = NULL;
+    return message;
+}
+
+/*
+ * request_context_get()
+ * Returns a cleared httpObject, reusing one this thread gave back if it can
+ */
+struct httpObject *request_context_get(void) {
+    struct httpObject *message = NULL;
+    int node = thread_node < 0 ? 0 : thread_node;
+    if (context_cache_count > 0) {
+        message = context_cache[--context_cache_count];
+    }
+    else {
+        pthread_mutex_lock(&shared_context_lock);
+        if (shared_context_count[node] > 0) {
+            message = shared_contexts[node][--shared_context_count[node]];
+        }
+        pthread_mutex_unlock(&shared_context_lock);
+    }
+    if (message == NULL) {
+        message = request_context_alloc();
+    }
+    clear_httpObject(message);
+    return message;
+}
+
+/*
+ * request_context_share()
+ * Puts an httpObject in the shared cache of its NUMA node, or frees it when that is full
+ */
+void request_context_share(struct httpObject *message) {
+    int node = message->node;
+    pthread_mutex_lock(&shared_context_lock);
+    if (shared_context_count[node] < SHARED_CONTEXTS) {
+        shared_contexts[node][shared_context_count[node]++] = message;
+        message = NULL;
+    }
+    pthread_mutex_unlock(&shared_context_lock);
+    if (message == NULL) {
+        return;
+    }
+    free(message->log_body_buffer);
+    munmap(message, sizeof *message);
+}
+
+/*
+ * request_context_put()
+ * Gives back an httpObject for reuse by the calling thread, or shares it when the cache is full.
+ * A context of another NUMA node goes to that node's shared cache.
+ */
+void request_context_put(struct httpObject *message) {
+    if (message == NULL) {
+        return;
+    }
+    if (context_cache_count < CONTEXT_CACHE && message->node == (thread_node < 0 ? 0 : thread_node)) {
+        thread_resources_keep();
+        context_cache[context_cache_count++] = message;
+        return;
+    }
+    request_context_share(message);
+}
+
+/*
+ * thread_resources_release()
+ * Thread exit: the contexts the thread kept go to the shared cache (or are freed),
+ * and its io_uring is closed
+ */
+void thread_resources_release(void *arg) {
+    (void) arg;
+    while (context_cache_count > 0) {
+        request_context_share(context_cache[--context_cache_count]);
+    }
+    if (worker_ring != NULL) {
+        uring_destroy(worker_ring);
+        worker_ring = NULL;
+    }
+    thread_resources_kept = 0;
+}
+
+typedef struct {
+    void (*function) (void *);
+    void *args;
+} threadpool_task_t;
+
+/*
+    Struct pool_cell
+    A task in the shared queue, sequence says whether it is full for the cell's next turn
+*/
+struct pool_cell {
+    atomic_ulong sequence;
+    atomic_llong queued;                // CLOCK_MONOTONIC ns when the task went in, for shedding
+    threadpool_task_t task;
+};
+
+/*
+    Struct pool_slot
+    A task in a worker's deque. A thief may read it while the owner reuses the slot,
+    its CAS on top fails then, so the fields are atomic rather than the whole read locked.
+*/
+struct pool_slot {
+    void (* _Atomic function)(void *);
+    void * _Atomic args;
+};
+
+/*
+    Struct pool_worker
+    A worker and its deque (Chase-Lev): the worker pushes and pops tasks it queues itself
+    at the bottom without a lock, idle workers steal the oldest from the top with a CAS.
+*/
+struct pool_worker {
+    _Alignas(64) atomic_long top;
+    _Alignas(64) atomic_long bottom;
+    struct pool_slot tasks[WORKER_DEQUE_SIZE];
+    struct threadpool_t *pool;
+    unsigned int seed;                  // picks the workers to steal from
+    int active;                         // 0, 1 (a thread runs this worker), under thread_lock
+    int large;                          // 0, 1 (the task it runs is a large one, -J)
+};
+
+/*
+    Struct threadpool_t
+    Work stealing: tasks from threads outside the pool (the acceptor, the reactors) go
+    through one bounded lock-free queue, tasks a worker queues go on its own deque.
+    A worker runs its own tasks newest first, then the shared queue, then steals from
+    random workers, and only sleeps on the not_empty futex when all of it is empty.
+    With -J, tasks known to be large (a big PUT body or GET file) wait in a FIFO of their
+    own: workers take them only when no small task is waiting, and no more than one of
+    every POOL_LARGE_SHARE workers running at once, unless the oldest has waited POOL_LARGE_WAIT_MS.
+    The pool is elastic between thread_min_size and thread_max_size workers: its
+    controller starts more when tasks wait with no worker idle, and a worker above the
+    minimum exits after sleeping POOL_IDLE_SECONDS.
+*/
+struct threadpool_t {
+    pthread_mutex_t thread_lock;        // starting and retiring workers
+    struct parameters *specs;           // for the connections queued by their socket alone
+    
+    pthread_t dispatcher;               // the controller, only when the pool may grow
+    pthread_t *workers;
+    struct pool_worker *deques;         // one per worker
+    struct pool_cell *queue;            // the shared queue, queue_size cells
+    
+    int thread_count;                   // workers running, under thread_lock
+    int thread_min_size;
+    int thread_max_size;                // also the number of deques
+    
+    int queue_size;
+    int shed_wait_ms;                   // new connections are shed once the oldest task waited this long, 0 never
+    _Alignas(64) atomic_ulong tail;     // next cell a task goes in
+    _Alignas(64) atomic_ulong head;     // next cell a worker takes
+    atomic_int sleeping;                // workers waiting on not_empty
+    atomic_int searching;               // workers looking for a task outside their own deque
+    atomic_int waiting;                 // threads waiting on not_full
+    atomic_uint not_empty;              // futex, its low bit is set to wake a sleeping worker
+    atomic_uint not_full;               // futex, moved on to wake a thread waiting for room
+    
+    int large_share;                    // 0, 1 (-J: large tasks wait apart, see pool_large_limit())
+    pthread_mutex_t large_lock;
+    struct pool_cell *large;            // large tasks waiting, queue_size cells in a ring, oldest at large_head
+    unsigned long large_head;           // under large_lock
+    atomic_long large_waiting;
+    atomic_int large_running;
+    
+    int poolflag;
+};
+
+static __thread struct pool_worker *current_worker = NULL;
+
+struct dispatcher_args {
+    struct threadpool_t *pool;
+    struct parameters *specs;
+};
+
+int threadpool_push(struct threadpool_t *pool, void (*function)(void *), void *args, int wait);
+int threadpool_try_add(struct threadpool_t *pool, void (*function)(void *), void *args);
+int threadpool_add_large(struct threadpool_t *pool, void (*function)(void *), void *args);
+int pool_overloaded(struct threadpool_t *pool);
+int pool_has_idle(struct threadpool_t *pool);
+void control_hold(int connfd, int requests);
+int reclassify_connection(struct parameters *specs, struct threadpool_t *pool, int connfd, int requests);
+
+struct connection;
+void connection_complete(struct connection *conn);
+
+/*
+    Struct pipeline
+    Reorder queue of one connection. The GET and HEAD requests a client pipelines behind
+    the current one are queued as slots and processed by any idle worker, while the
+    responses still go out in the order the requests came in.
+*/
+enum slot_state {
+    SLOT_QUEUED,        // waiting for a worker, or for the connection to run it itself
+    SLOT_RUNNING,
+    SLOT_DONE           // message holds the response, ready to send
+};
+
+struct pipeline_slot {
+    uint8_t *request;                   // raw request, until it is parsed into message
+    ssize_t request_length;
+    int keep_alive;                     // 0, 1 (decided when queued, 0 only on the last slot)
+    enum slot_state state;
+    struct httpObject *message;
+};
+
+struct pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t slot_done;
+    struct pipeline_slot slots[PIPELINE_DEPTH];
+    int head;                           // oldest slot, the next response to send
+    int count;
+    int refs;                           // the connection, plus one per task in the pool queue
+    struct httpObject *spare[PIPELINE_DEPTH];   // sent responses, reused for the next slots
+    int spare_count;
+    int waiting;                        // 0, 1 (event mode: the reactor waits for the head slot)
+    struct connection *conn;            // event mode: handed back to its reactor when the head is done
+    struct parameters *specs;
+    struct threadpool_t *pool;
+};
+
+/*
+ * pipeline_create()
+ * Creates the reorder queue of a connection, conn is NULL in blocking mode
+ */
+struct pipeline *pipeline_create(struct parameters *specs, struct threadpool_t *pool, struct connection *conn) {
+    struct pipeline *p = calloc(1, sizeof(struct pipeline));
+    pthread_mutex_init(&(p->lock), NULL);
+    pthread_cond_init(&(p->slot_done), NULL);
+    p->refs = 1;
+    p->conn = conn;
+    p->specs = specs;
+    p->pool = pool;
+    return p;
+}
+
+/*
+ * pipeline_release()
+ * Drops a reference, the last one frees the queue and any responses that were never sent
+ */
+void pipeline_release(struct pipeline *p) {
+    pthread_mutex_lock(&(p->lock));
+    int refs = --p->refs;
+    pthread_mutex_unlock(&(p->lock));
+    if (refs > 0) {
+        return;
+    }
+
+    for (int i = 0; i < p->count; i++) {
+        struct pipeline_slot *slot = &(p->slots[(p->head + i) % PIPELINE_DEPTH]);
+        free(slot->request);
+        if (slot->message != NULL) {
+            close_request_file(slot->message);
+            request_context_put(slot->message);
+        }
+    }
+    for (int i = 0; i < p->spare_count; i++) {
+        request_context_put(p->spare[i]);
+    }
+    pthread_cond_destroy(&(p->slot_done));
+    pthread_mutex_destroy(&(p->lock));
+    free(p);
+}
+
+/*
+ * pipelined_request_length()
+ * Returns the length of the complete GET or HEAD request at the start of buff,
+ * or 0 if there is none (incomplete, another method, or it has a body)
+ */
+ssize_t pipelined_request_length(uint8_t *buff, ssize_t length, int *keep_alive) {
+    struct http_request request;
+
+    http_request_init(&request);
+    if (http_parse_request(&request, (char *) buff, length) != HTTP_PARSE_DONE || request.content_length > 0 ||
+        !(http_span_equals((char *) buff, request.method, "GET") || http_span_equals((char *) buff, request.method, "HEAD"))) {
+        return 0;
+    }
+    *keep_alive = !request.connection_close;
+    return request.header_length;
+}
+
+/*
+ * pipeline_claim()
+ * Takes the oldest slot nobody has started on, called with the lock held
+ */
+struct pipeline_slot *pipeline_claim(struct pipeline *p) {
+    for (int i = 0; i < p->count; i++) {
+        struct pipeline_slot *slot = &(p->slots[(p->head + i) % PIPELINE_DEPTH]);
+        if (slot->state == SLOT_QUEUED) {
+            slot->state = SLOT_RUNNING;
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * pipeline_run_slot()
+ * Processes a claimed slot the same way handle_connection() processes a request,
+ * then wakes whoever waits for it
+ */
+void pipeline_run_slot(struct pipeline *p, struct pipeline_slot *slot) {
+    struct httpObject *message = NULL;
+
+    // reuse a context this connection has sent already, before going to the thread's cache
+    pthread_mutex_lock(&(p->lock));
+    if (p->spare_count > 0) {
+        message = p->spare[--p->spare_count];
+    }
+    pthread_mutex_unlock(&(p->lock));
+    if (message == NULL) {
+        message = request_context_get();
+    }
+    else {
+        clear_httpObject(message);
+    }
+    memcpy(message->buffer, slot->request, slot->request_length);
+    message->buffer[slot->request_length] = '\0';
+    message->received_length = slot->request_length;
+    free(slot->request);
+    slot->request = NULL;
+
+    parse_http_headers(message);
+    message->keep_alive = slot->keep_alive;
+    process_request(-1, message, p->specs);
+    check_keep_alive(message);
+    construct_http_response(message);
+    atomic_fetch_add(&stats.pipelined, 1);
+
+    pthread_mutex_lock(&(p->lock));
+    slot->message = message;
+    slot->state = SLOT_DONE;
+    pthread_cond_broadcast(&(p->slot_done));
+    if (p->waiting == 1 && slot == &(p->slots[p->head]) && p->conn != NULL) {
+        p->waiting = 0;
+        connection_complete(p->conn);
+    }
+    pthread_mutex_unlock(&(p->lock));
+}
+
+/*
+ * pipeline_task()
+ * Pool task: runs the oldest slot still waiting, if the connection has not run it already
+ */
+void pipeline_task(void *arg) {
+    struct pipeline *p = (struct pipeline *) arg;
+
+    pthread_mutex_lock(&(p->lock));
+    struct pipeline_slot *slot = pipeline_claim(p);
+    pthread_mutex_unlock(&(p->lock));
+
+    if (slot != NULL) {
+        pipeline_run_slot(p, slot);
+    }
+    pipeline_release(p);
+}
+
+/*
+ * pipeline_help()
+ * Runs the slots no worker has picked up yet on the calling thread
+ */
+void pipeline_help(struct pipeline *p) {
+    while (1) {
+        pthread_mutex_lock(&(p->lock));
+        struct pipeline_slot *slot = pipeline_claim(p);
+        pthread_mutex_unlock(&(p->lock));
+        if (slot == NULL) {
+            return;
+        }
+        pipeline_run_slot(p, slot);
+    }
+}
+
+/*
+ * pipeline_fill()
+ * Queues the complete GET and HEAD requests at the start of buff and offers each to the pool
+ * Counts them as requests on the connection, the slot that has to close it is the last one
+ * Returns the number of bytes taken from buff
+ */
+ssize_t pipeline_fill(struct pipeline *p, uint8_t *buff, ssize_t length, int *requests) {
+    struct parameters *specs = p->specs;
+    ssize_t taken = 0;
+    int keep_alive = 1;
+
+    pthread_mutex_lock(&(p->lock));
+    while (keep_alive == 1 && p->count < PIPELINE_DEPTH) {
+        ssize_t request_length = pipelined_request_length(buff + taken, length - taken, &keep_alive);
+        if (request_length == 0) {
+            break;
+        }
+
+        *requests += 1;
+        atomic_fetch_add(&stats.requests, 1);
+        atomic_fetch_add(&stats.reused, 1);
+        if (specs->idle_timeout == 0) {
+            keep_alive = 0;
+        }
+        else if (*requests >= specs->max_requests && keep_alive == 1) {
+            atomic_fetch_add(&stats.max_closed, 1);
+            keep_alive = 0;
+        }
+
+        struct pipeline_slot *slot = &(p->slots[(p->head + p->count) % PIPELINE_DEPTH]);
+        slot->request = malloc(request_length + 1);
+        memcpy(slot->request, buff + taken, request_length);
+        slot->request_length = request_length;
+        slot->keep_alive = keep_alive;
+        slot->state = SLOT_QUEUED;
+        slot->message = NULL;
+        p->count += 1;
+        taken += request_length;
+
+        // a full queue is fine, the connection runs the slot itself when it gets to it
+        p->refs += 1;
+        if (threadpool_try_add(p->pool, pipeline_task, p) != 0) {
+            p->refs -= 1;
+        }
+    }
+    pthread_mutex_unlock(&(p->lock));
+    return taken;
+}
+
+/*
+ * pipeline_take_head()
+ * Returns the response of the oldest slot and removes it from the queue.
+ * With wait == 1 the caller runs the slot itself if nobody has started on it, and waits otherwise.
+ * With wait == 0 it returns NULL when the head is not done yet, and hands the connection
+ * back to its reactor once it is.
+ */
+struct httpObject *pipeline_take_head(struct pipeline *p, int wait) {
+    struct httpObject *message = NULL;
+
+    pthread_mutex_lock(&(p->lock));
+    while (p->count > 0) {
+        struct pipeline_slot *slot = &(p->slots[p->head]);
+        if (slot->state == SLOT_DONE) {
+            message = slot->message;
+            slot->message = NULL;
+            p->head = (p->head + 1) % PIPELINE_DEPTH;
+            p->count -= 1;
+            break;
+        }
+        if (wait == 0) {
+            p->waiting = 1;
+            break;
+        }
+        if (slot->state == SLOT_QUEUED) {
+            slot->state = SLOT_RUNNING;
+            pthread_mutex_unlock(&(p->lock));
+            pipeline_run_slot(p, slot);
+            pthread_mutex_lock(&(p->lock));
+        }
+        else {
+            pthread_cond_wait(&(p->slot_done), &(p->lock));
+        }
+    }
+    pthread_mutex_unlock(&(p->lock));
+    return message;
+}
+
+/*
+ * pipeline_recycle()
+ * Takes back a response from pipeline_take_head() once it is sent
+ */
+void pipeline_recycle(struct pipeline *p, struct httpObject *message) {
+    pthread_mutex_lock(&(p->lock));
+    if (p->spare_count < PIPELINE_DEPTH) {
+        p->spare[p->spare_count++] = message;
+        message = NULL;
+    }
+    pthread_mutex_unlock(&(p->lock));
+    request_context_put(message);
+}
+
+/*
+ * pipeline_drop()
+ * Frees the responses that will never be sent because the connection is closing
+ */
+void pipeline_drop(struct pipeline *p) {
+    struct httpObject *message;
+    while ((message = pipeline_take_head(p, 1)) != NULL) {
+        close_request_file(message);
+        pipeline_recycle(p, message);
+    }
+}
+
+/*
+ * finish_request()
+ * Logs a request whose response is sent and gives back its file
+ */
+void finish_request(struct httpObject* message, struct parameters* specs) {
+    if (specs->lflag == 1 && message->hflag != 1) {
+        log_request(message, specs);
+    }
+    close_request_file(message);
+}
+
+/*
+ * respond()
+ * Sends the response, logs the request and closes its file
+ */
+void respond(int connfd, struct httpObject* message, struct parameters* specs) {
+    send_http_response(connfd, message, specs);
+    finish_request(message, specs);
+}
+
+
+
+/*
+* serve_connection()
+* To perform the full task in series, once per request while the connection is kept alive:
+* Read Message -> Process Request -> Create Response -> Send Response
+* Requests pipelined behind the current one are processed in parallel through a pipeline
+* A -P listener passes its listenfd, an idle connection goes to the control lane when a client waits there,
+* and the worker that takes it up from there passes the requests served on it already
+*/
+void serve_connection(struct parameters *specs, struct threadpool_t *pool, int connfd, int listenfd, int requests) {
+
+    struct httpObject *message = request_context_get();
+    uint8_t *pending = NULL;            // start of the next request, read along with the current one
+    ssize_t pending_length = 0;
+    struct pipeline *pipeline = NULL;
+    int keep_alive = 0;
+    int held = 0;                       // the control lane or another task has the connection now
+    int first = requests;               // requests served on it before this call
+    // -J: a pool worker sorts every later request like the first one was sorted
+    int reclassify = pool->large_share > 0 && current_worker != NULL && current_worker->pool == pool;
+
+    do {
+        clear_httpObject(message);
+
+        if (pending_length > 0) {
+            memcpy(message->buffer, pending, pending_length);
+            message->buffer[pending_length] = '\0';
+            message->received_length = pending_length;
+            pending_length = 0;
+        }
+        else if (reclassify && requests > first && current_worker->large && reclassify_connection(specs, pool, connfd, requests)) {
+            held = 1;
+            break;
+        }
+        else if (specs->idle_timeout > 0) {
+            int waited = wait_for_request(connfd, listenfd, specs->idle_timeout);
+            if (waited == 0) {
+                atomic_fetch_add(&stats.idle_closed, 1);
+                break;
+            }
+            if (waited < 0) {
+                // it waits for its next request without a thread, the pool serves it once that is in
+                control_hold(connfd, requests);
+                held = 1;
+                break;
+            }
+            if (reclassify && requests > first && !current_worker->large && reclassify_connection(specs, pool, connfd, requests)) {
+                held = 1;
+                break;
+            }
+        }
+
+        read_http_response(connfd, message);
+        if (message->received_length == 0) {
+            // client closed the connection
+            break;
+        }
+
+        requests += 1;
+        atomic_fetch_add(&stats.requests, 1);
+        if (requests > 1) {
+            atomic_fetch_add(&stats.reused, 1);
+        }
+        if (specs->idle_timeout == 0) {
+            message->keep_alive = 0;
+        }
+        else if (requests >= specs->max_requests && message->keep_alive == 1) {
+            atomic_fetch_add(&stats.max_closed, 1);
+            message->keep_alive = 0;
+        }
+
+        if (message->received_length > message->request_length) {
+            if (pending == NULL) {
+                pending = malloc(BUFFER_SIZE + 1);
+            }
+            pending_length = take_pending_bytes(message, pending);
+        }
+
+        // complete GET and HEAD requests right behind a GET or HEAD go to the other workers meanwhile
+        if (pending_length > 0 && message->keep_alive == 1 && message->status_code == 0 &&
+            (strcmp(message->method, "GET") == 0 || strcmp(message->method, "HEAD") == 0)) {
+            if (pipeline == NULL) {
+                pipeline = pipeline_create(specs, pool, NULL);
+            }
+            ssize_t taken = pipeline_fill(pipeline, pending, pending_length, &requests);
+            pending_length -= taken;
+            memmove(pending, pending + taken, pending_length);
+        }
+
+        process_request(connfd, message, specs);
+
+        check_keep_alive(message);
+
+        construct_http_response(message);
+
+        respond(connfd, message, specs);
+        keep_alive = message->keep_alive;
+
+        // then the pipelined responses, in order
+        struct httpObject *next;
+        while (pipeline != NULL && keep_alive == 1 && (next = pipeline_take_head(pipeline, 1)) != NULL) {
+            respond(connfd, next, specs);
+            keep_alive = next->keep_alive;
+            pipeline_recycle(pipeline, next);
+        }
+    } while (keep_alive == 1);
+
+    if (pipeline != NULL) {
+        pipeline_drop(pipeline);
+        pipeline_release(pipeline);
+    }
+    free(pending);
+    request_context_put(message);
+    if (held == 0) {
+        close(connfd);
+    }
+    
+}
+
+/*
+ * connection_task()
+ * The args of a connection's pool task: its socket in the low 32 bits, above them
+ * the requests served on it already (0 for a new one)
+ */
+void *connection_task(int connfd, int requests) {
+    return (void *) (((intptr_t) requests << 32) | (uint32_t) connfd);
+}
+
+/*
+ * handle_connection()
+ * Pool task for a connection queued by connection_task()
+ */
+void handle_connection(void * pargs) {
+    struct threadpool_t *pool = current_worker->pool;
+    intptr_t args = (intptr_t) pargs;
+    serve_connection(pool->specs, pool, (int) (args & 0xffffffff), -1, (int) (args >> 32));
+}
+
+/*
+    Control lane
+    /healthcheck and /metrics are answered by a thread of their own, so a probe never waits
+    behind the connections in the pool queue or for a worker to be free. The accepting thread
+    peeks at the request line of a new connection: a probe goes to the control lane, and while
+    no worker is free a connection whose request hasn't arrived yet goes there too, to be sorted
+    once it has. In -E mode the reactors answer probes themselves, they read the headers anyway.
+*/
+enum control_kind {
+    CONTROL_NONE,       // another request, or the connection is closed
+    CONTROL_PROBE,      // GET or HEAD of /healthcheck or /metrics
+    CONTROL_UNKNOWN     // nothing has arrived yet
+};
+
+struct control_conn {
+    int connfd;
+    time_t since;                       // when it was admitted, or for a probe when it was found to be one
+    int requests;                       // example: 3, served on it before it went idle (-P), 0 for a new one
+    struct httpObject *message;         // a probe's headers as they arrive, NULL until it is found to be one
+    struct control_conn *prev;
+    struct control_conn *next;
+};
+
+struct control_lane {
+    int epollfd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct control_conn *head;          // connections waiting for their request line, oldest first
+    struct control_conn *tail;
+    struct control_conn *probe_head;    // probes waiting for the rest of their headers, oldest first
+    struct control_conn *probe_tail;
+    struct threadpool_t *pool;
+    struct parameters *specs;
+};
+
+static struct control_lane control_lane = { .epollfd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * is_control_request()
+ * Whether the parsed request line is a probe the control lane answers
+ */
+int is_control_request(const char *buff, const struct http_request *request) {
+    return (http_span_equals(buff, request->method, "GET") || http_span_equals(buff, request->method, "HEAD")) &&
+           (http_span_equals(buff, request->target, "/healthcheck") || http_span_equals(buff, request->target, "/metrics"));
+}
+
+/*
+ * control_request()
+ * Looks at what has arrived on a new connection without taking it off the socket
+ */
+enum control_kind control_request(int connfd) {
+    char line[CONTROL_PEEK];
+    ssize_t length = recv(connfd, line, sizeof line, MSG_PEEK | MSG_DONTWAIT);
+    if (length < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? CONTROL_UNKNOWN : CONTROL_NONE;
+    }
+
+    struct http_request request;
+    http_request_init(&request);
+    http_parse_request(&request, line, length);
+    // a probe's request line comes in one piece, so part of one isn't waited for: peeking
+    // doesn't take it off the socket, and the socket would stay readable
+    if (request.lines == 0) {
+        return CONTROL_NONE;
+    }
+    return request.state != HTTP_PARSE_ERROR && is_control_request(line, &request) ? CONTROL_PROBE : CONTROL_NONE;
+}
+
+/*
+ * control_read()
+ * Takes what has arrived of a probe's headers off its socket, without waiting for more
+ * Returns 1 once they are all in (or can't be, the answer is a 400), 0 to wait for more,
+ * -1 when the client closed the connection first
+ */
+int control_read(struct control_conn *cc) {
+    struct httpObject *message = cc->message;
+
+    while (message->received_length < BUFFER_SIZE - 1) {
+        ssize_t length = recv(cc->connfd, message->buffer + message->received_length,
+                              BUFFER_SIZE - 1 - message->received_length, MSG_DONTWAIT);
+        if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (length <= 0) {
+            return -1;
+        }
+        message->received_length += length;
+        message->buffer[message->received_length] = '\0';
+        if (http_parse_request(&(message->request), (char *) message->buffer, message->received_length) != HTTP_PARSE_AGAIN) {
+            return 1;
+        }
+    }
+    return 1;
+}
+
+/*
+ * control_serve()
+ * Answers a probe whose headers control_read() has, and closes the connection
+ */
+void control_serve(struct parameters *specs, struct control_conn *cc) {
+    struct httpObject *message = cc->message;
+    struct timeval timeout = { CONTROL_TIMEOUT, 0 };
+
+    // a client that doesn't read its answer costs the lane CONTROL_TIMEOUT at most
+    setsockopt(cc->connfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+    atomic_fetch_add(&stats.requests, 1);
+    atomic_fetch_add(&stats.control, 1);
+
+    parse_http_headers(message);
+    process_request(cc->connfd, message, specs);
+    message->keep_alive = 0;
+    construct_http_response(message);
+    respond(cc->connfd, message, specs);
+}
+
+/*
+ * control_drop()
+ * Closes a connection the lane is done with, and frees what it had for it
+ */
+void control_drop(struct control_conn *cc) {
+    close(cc->connfd);
+    request_context_put(cc->message);
+    free(cc);
+}
+
+/*
+ * request_is_large()
+ * -J: whether the request already on a new connection moves more than large_bytes,
+ * a PUT by its Content-Length or a GET by the size of the cached file. A request
+ * not in yet, or a GET of a file the cache doesn't hold, counts as small.
+ */
+int request_is_large(struct parameters *specs, int connfd) {
+    char buff[REQUEST_HEADER_SIZE];
+    ssize_t length = recv(connfd, buff, sizeof buff, MSG_PEEK | MSG_DONTWAIT);
+    if (length <= 0) {
+        return 0;
+    }
+
+    struct http_request request;
+    http_request_init(&request);
+    if (http_parse_request(&request, buff, length) == HTTP_PARSE_ERROR || request.lines == 0) {
+        return 0;
+    }
+    if (http_span_equals(buff, request.method, "PUT")) {
+        return request.content_length > specs->large_bytes;
+    }
+    char name[FILENAME_SIZE];
+    if (!http_span_equals(buff, request.method, "GET") || http_span_copy(name + 1, FILENAME_SIZE - 1, buff, request.target) < 0) {
+        return 0;
+    }
+    name[0] = '.';
+    return file_cache_size(name) > specs->large_bytes;
+}
+
+/*
+ * queue_connection()
+ * Queues a connection for the pool, with -J as a large task if its request is,
+ * requests is how many were served on it already (0 for a new one)
+ * Returns what threadpool_push() does, 1 as well when the large tasks' queue is full
+ */
+int queue_connection(struct threadpool_t *pool, int connfd, int requests, int wait) {
+    set_nodelay(connfd);
+    if (pool->large_share > 0 && request_is_large(pool->specs, connfd)) {
+        return threadpool_add_large(pool, handle_connection, connection_task(connfd, requests));
+    }
+    return threadpool_push(pool, handle_connection, connection_task(connfd, requests), wait);
+}
+
+/*
+ * reclassify_connection()
+ * -J: sorts the next request of a kept-alive connection a pool worker serves, the way
+ * queue_connection() sorted its first one. On a large task the connection keeps its worker
+ * only for a large request that is in already, otherwise it gives the large slot up and is
+ * queued as a small task, or waits in the control lane while its request hasn't arrived.
+ * On a small task it is queued as a large one once a large request arrives.
+ * Returns 1 when the connection was handed on
+ */
+int reclassify_connection(struct parameters *specs, struct threadpool_t *pool, int connfd, int requests) {
+    if (current_worker->large == 1) {
+        char byte;
+        if (recv(connfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) <= 0) {
+            control_hold(connfd, requests);
+            return 1;
+        }
+        return !request_is_large(specs, connfd) && queue_connection(pool, connfd, requests, 0) == 0;
+    }
+    return request_is_large(specs, connfd) && queue_connection(pool, connfd, requests, 0) == 0;
+}
+
+/*
+ * control_release()
+ * Queues a connection the control lane sorted out for the pool, like the acceptor would have
+ */
+void control_release(struct control_lane *lane, struct control_conn *cc) {
+    if (pool_overloaded(lane->pool) || queue_connection(lane->pool, cc->connfd, cc->requests, 0) != 0) {
+        shed_connection(cc->connfd);
+    }
+}
+
+/*
+ * control_unlink()
+ * Takes a connection out of the lane's list it is in, the probes' once it has a message,
+ * under the lane's lock
+ */
+void control_unlink(struct control_lane *lane, struct control_conn *cc) {
+    struct control_conn **head = cc->message != NULL ? &(lane->probe_head) : &(lane->head);
+    struct control_conn **tail = cc->message != NULL ? &(lane->probe_tail) : &(lane->tail);
+
+    if (cc->prev != NULL) {
+        cc->prev->next = cc->next;
+    }
+    else {
+        *head = cc->next;
+    }
+    if (cc->next != NULL) {
+        cc->next->prev = cc->prev;
+    }
+    else {
+        *tail = cc->prev;
+    }
+    cc->prev = NULL;
+    cc->next = NULL;
+}
+
+/*
+ * control_link()
+ * Adds a connection to the end of the lane's list it belongs in, under the lane's lock
+ */
+void control_link(struct control_lane *lane, struct control_conn *cc) {
+    struct control_conn **head = cc->message != NULL ? &(lane->probe_head) : &(lane->head);
+    struct control_conn **tail = cc->message != NULL ? &(lane->probe_tail) : &(lane->tail);
+
+    cc->prev = *tail;
+    cc->next = NULL;
+    if (*tail != NULL) {
+        (*tail)->next = cc;
+    }
+    else {
+        *head = cc;
+    }
+    *tail = cc;
+}
+
+/*
+ * control_thread()
+ * Answers the probes and sorts the connections it was given, closes the ones that stay silent.
+ * A probe stays in the lane's epoll until its headers are in, or CONTROL_TIMEOUT has passed.
+ */
+void *control_thread(void *arg) {
+    struct control_lane *lane = (struct control_lane *) arg;
+    struct epoll_event events[EPOLL_EVENTS];
+    int idle_timeout = lane->specs->idle_timeout > 0 ? lane->specs->idle_timeout : IDLE_TIMEOUT;
+
+    while (1) {
+        int ready = epoll_wait(lane->epollfd, events, EPOLL_EVENTS, 1000);
+        for (int i = 0; i < ready; i++) {
+            struct control_conn *cc = (struct control_conn *) events[i].data.ptr;
+            enum control_kind kind = cc->message != NULL ? CONTROL_PROBE : control_request(cc->connfd);
+            // a probe on a connection that was served already is its next request, the pool keeps it alive
+            if (kind == CONTROL_PROBE && cc->message == NULL && cc->requests > 0) {
+                kind = CONTROL_NONE;
+            }
+            if (kind == CONTROL_PROBE && cc->message == NULL) {
+                // from now on it has CONTROL_TIMEOUT to send the rest of its headers
+                pthread_mutex_lock(&(lane->lock));
+                control_unlink(lane, cc);
+                cc->message = request_context_get();
+                cc->since = monotonic_seconds();
+                control_link(lane, cc);
+                pthread_mutex_unlock(&(lane->lock));
+            }
+            int complete = kind == CONTROL_PROBE ? control_read(cc) : 1;
+            if (kind == CONTROL_UNKNOWN || complete == 0) {
+                struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = cc };
+                epoll_ctl(lane->epollfd, EPOLL_CTL_MOD, cc->connfd, &ev);
+                continue;
+            }
+            pthread_mutex_lock(&(lane->lock));
+            control_unlink(lane, cc);
+            pthread_mutex_unlock(&(lane->lock));
+            epoll_ctl(lane->epollfd, EPOLL_CTL_DEL, cc->connfd, NULL);
+            if (kind == CONTROL_NONE) {
+                control_release(lane, cc);
+                free(cc);
+                continue;
+            }
+            // a probe whose client closed before its headers were in isn't answered
+            if (complete == 1) {
+                control_serve(lane->specs, cc);
+            }
+            control_drop(cc);
+        }
+
+        // the lists are oldest first, so only their heads can have timed out
+        time_t now = monotonic_seconds();
+        pthread_mutex_lock(&(lane->lock));
+        while (lane->head != NULL && now - lane->head->since >= idle_timeout) {
+            struct control_conn *cc = lane->head;
+            control_unlink(lane, cc);
+            atomic_fetch_add(&stats.idle_closed, 1);
+            control_drop(cc);
+        }
+        while (lane->probe_head != NULL && now - lane->probe_head->since >= CONTROL_TIMEOUT) {
+            struct control_conn *cc = lane->probe_head;
+            control_unlink(lane, cc);
+            control_drop(cc);
+        }
+        pthread_mutex_unlock(&(lane->lock));
+        shed_linger_expire();
+    }
+    return NULL;
+}
+
+/*
+ * control_lane_start()
+ * Starts the control lane's thread, main() does so unless the reactors answer probes (-E)
+ */
+void control_lane_start(struct parameters *specs, struct threadpool_t *pool) {
+    control_lane.epollfd = epoll_create1(0);
+    if (control_lane.epollfd < 0) {
+        err(EXIT_FAILURE, "epoll error");
+    }
+    control_lane.pool = pool;
+    control_lane.specs = specs;
+    pthread_create(&(control_lane.thread), NULL, control_thread, (void *) &control_lane);
+    pthread_detach(control_lane.thread);
+}
+
+/*
+ * control_hold()
+ * Gives the control lane a connection to answer if it is a probe, or else to queue for the pool
+ * once its request is in, and to close if that doesn't come within the idle timeout
+ */
+void control_hold(int connfd, int requests) {
+    struct control_conn *cc = calloc(1, sizeof(struct control_conn));
+    cc->connfd = connfd;
+    cc->requests = requests;
+    cc->since = monotonic_seconds();
+    pthread_mutex_lock(&(control_lane.lock));
+    control_link(&control_lane, cc);
+    pthread_mutex_unlock(&(control_lane.lock));
+
+    // a probe is readable already, the lane answers it on its next epoll_wait()
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.ptr = cc };
+    epoll_ctl(control_lane.epollfd, EPOLL_CTL_ADD, connfd, &ev);
+}
+
+/*
+ * control_admit()
+ * Called by the accepting thread with every new connection, in threads mode.
+ * Returns 1 if the control lane took it: a probe, or a connection that would have
+ * waited for a worker before its request line was in (sort, with -P never)
+ */
+int control_admit(int connfd, int sort) {
+    enum control_kind kind = control_request(connfd);
+    if (kind == CONTROL_NONE || (kind == CONTROL_UNKNOWN && (sort == 0 || pool_has_idle(control_lane.pool)))) {
+        return 0;
+    }
+    control_hold(connfd, 0);
+    return 1;
+}
+
+/*
+ * serve_listener()
+ * -P: accepts on one of the SO_REUSEPORT sockets and serves each connection on this
+ * thread, the kernel spreads new connections over the sockets. A connection that goes
+ * idle while a new one waits is handed to the control lane, and from there to the pool.
+ * Never returns.
+ * With -C the thread is pinned and its socket gets the connections that arrive on its CPU.
+ */
+void serve_listener(struct parameters *specs, struct threadpool_t *pool, int listenfd, int index) {
+    int cpu = pin_thread(specs, index);
+    if (cpu >= 0) {
+        setsockopt(listenfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof cpu);
+    }
+    while (1) {
+        int connfd = accept(listenfd, NULL, NULL);
+        if (connfd < 0) {
+            warn("accept error");
+            continue;
+        }
+        atomic_fetch_add(&stats.connections, 1);
+        // a probe doesn't wait for this thread to be done with the connection it serves
+        if (control_admit(connfd, 0)) {
+            continue;
+        }
+        set_nodelay(connfd);
+        serve_connection(specs, pool, connfd, listenfd, 0);
+    }
+}
+
+struct listener_args {
+    struct threadpool_t *pool;
+    int index;                          // example: 1, main() serves listener 0
+};
+
+/*
+ * listener_thread()
+ * -P: opens a listening socket of its own on the server's port and serves it
+ */
+void *listener_thread(void *arg) {
+    struct listener_args *l_args = (struct listener_args *) arg;
+    struct parameters *specs = l_args->pool->specs;
+    serve_listener(specs, l_args->pool, create_listen_socket(specs->port, 1), l_args->index);
+    return NULL;
+}
+
+
+
+int is_awake(pthread_t t) {
+    int kill = pthread_kill(t, 0);
+    if (kill == ESRCH) {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * monotonic_ns()
+ * Clock for how long tasks wait in the shared queue
+ */
+long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * pool_futex_wait()
+ * Sleeps while the futex word still holds seen, at most seconds when they are not 0
+ * Returns 1 when the time ran out
+ */
+int pool_futex_wait(atomic_uint *word, unsigned int seen, int seconds) {
+    struct timespec timeout = { seconds, 0 };
+    if (syscall(__NR_futex, word, FUTEX_WAIT_PRIVATE, seen, seconds > 0 ? &timeout : NULL, NULL, 0) == -1) {
+        return errno == ETIMEDOUT;
+    }
+    return 0;
+}
+
+/*
+ * pool_futex_wake()
+ * Wakes up to count threads sleeping on a futex word the caller has just changed
+ */
+void pool_futex_wake(atomic_uint *word, int count) {
+    syscall(__NR_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/*
+ * pool_queue_put()
+ * Adds a task to the shared queue
+ * Returns 1 when it is full
+ */
+int pool_queue_put(struct threadpool_t *pool, threadpool_task_t task) {
+    unsigned long pos = atomic_load_explicit(&pool->tail, memory_order_relaxed);
+    while (1) {
+        struct pool_cell *cell = &(pool->queue[pos % pool->queue_size]);
+        long diff = (long) (atomic_load_explicit(&cell->sequence, memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&pool->tail, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                cell->task = task;
+                atomic_store_explicit(&cell->queued, monotonic_ns(), memory_order_relaxed);
+                atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+                return 0;
+            }
+        }
+        else if (diff < 0) {
+            // the cell still holds the task from a lap ago
+            return 1;
+        }
+        else {
+            pos = atomic_load_explicit(&pool->tail, memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * pool_queue_take()
+ * Takes the oldest task of the shared queue
+ * Returns 0 when it is empty
+ */
+int pool_queue_take(struct threadpool_t *pool, threadpool_task_t *task) {
+    unsigned long pos = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    while (1) {
+        struct pool_cell *cell = &(pool->queue[pos % pool->queue_size]);
+        long diff = (long) (atomic_load_explicit(&cell->sequence, memory_order_acquire) - (pos + 1));
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&pool->head, &pos, pos + 1, memory_order_seq_cst, memory_order_relaxed)) {
+                *task = cell->task;
+                atomic_store_explicit(&cell->sequence, pos + pool->queue_size, memory_order_release);
+                break;
+            }
+        }
+        else if (diff < 0) {
+            return 0;
+        }
+        else {
+            pos = atomic_load_explicit(&pool->head, memory_order_relaxed);
+        }
+    }
+    // those waiting for room are woken once half the queue is free, not for every cell
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&pool->waiting) > 0 && (long) (atomic_load(&pool->tail) - (pos + 1)) <= pool->queue_size / 2) {
+        atomic_fetch_add(&pool->not_full, 1);
+        pool_futex_wake(&pool->not_full, INT_MAX);
+    }
+    return 1;
+}
+
+/*
+ * deque_push()
+ * The owner queues a task at the bottom of its deque
+ * Returns 1 when the deque is full
+ */
+int deque_push(struct pool_worker *w, threadpool_task_t task) {
+    long bottom = atomic_load_explicit(&w->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&w->top, memory_order_acquire);
+    if (bottom - top >= WORKER_DEQUE_SIZE) {
         return 1;
-    } else {
+    }
+    struct pool_slot *slot = &(w->tasks[bottom % WORKER_DEQUE_SIZE]);
+    atomic_store_explicit(&slot->function, task.function, memory_order_relaxed);
+    atomic_store_explicit(&slot->args, task.args, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&w->bottom, bottom + 1, memory_order_relaxed);
+    return 0;
+}
+
+/*
+ * deque_pop()
+ * The owner takes the newest task of its deque, racing thieves for the last one
+ * Returns 0 when the deque is empty
+ */
+int deque_pop(struct pool_worker *w, threadpool_task_t *task) {
+    long bottom = atomic_load_explicit(&w->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&w->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&w->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&w->bottom, bottom + 1, memory_order_relaxed);
+        return 0;
+    }
+    struct pool_slot *slot = &(w->tasks[bottom % WORKER_DEQUE_SIZE]);
+    task->function = atomic_load_explicit(&slot->function, memory_order_relaxed);
+    task->args = atomic_load_explicit(&slot->args, memory_order_relaxed);
+    if (top == bottom) {
+        int won = atomic_compare_exchange_strong_explicit(&w->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&w->bottom, bottom + 1, memory_order_relaxed);
+        return won;
+    }
+    return 1;
+}
+
+/*
+ * deque_steal()
+ * Another worker takes the oldest task of a deque
+ * Returns 0 when it is empty or another thread got the task first
+ */
+int deque_steal(struct pool_worker *w, threadpool_task_t *task) {
+    long top = atomic_load_explicit(&w->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long bottom = atomic_load_explicit(&w->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return 0;
+    }
+    struct pool_slot *slot = &(w->tasks[top % WORKER_DEQUE_SIZE]);
+    task->function = atomic_load_explicit(&slot->function, memory_order_relaxed);
+    task->args = atomic_load_explicit(&slot->args, memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(&w->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+/*
+ * pool_large_put()
+ * -J: queues a large task behind the other large ones
+ * Returns 1 when queue_size of them are waiting already
+ */
+int pool_large_put(struct threadpool_t *pool, threadpool_task_t task) {
+    pthread_mutex_lock(&(pool->large_lock));
+    long waiting = atomic_load(&pool->large_waiting);
+    if (waiting >= pool->queue_size) {
+        pthread_mutex_unlock(&(pool->large_lock));
+        return 1;
+    }
+    struct pool_cell *cell = &(pool->large[(pool->large_head + waiting) % pool->queue_size]);
+    cell->task = task;
+    atomic_store_explicit(&cell->queued, monotonic_ns(), memory_order_relaxed);
+    atomic_store(&pool->large_waiting, waiting + 1);
+    pthread_mutex_unlock(&(pool->large_lock));
+    return 0;
+}
+
+/*
+ * pool_large_limit()
+ * -J: how many workers may run large tasks at once, one of every POOL_LARGE_SHARE of the
+ * workers running now (not of the most the pool may grow to), and at least one
+ */
+int pool_large_limit(void) {
+    long limit = atomic_load(&stats.pool_threads) / POOL_LARGE_SHARE;
+    return limit < 1 ? 1 : (int) limit;
+}
+
+/*
+ * pool_large_take()
+ * -J: takes the oldest large task, if fewer than pool_large_limit() workers run one and it
+ * has waited at least min_wait_ns. The caller calls pool_large_done() after running it.
+ * Returns 0 when there was none it may take
+ */
+int pool_large_take(struct threadpool_t *pool, threadpool_task_t *task, long long min_wait_ns) {
+    // checked without the lock first, most of the time there is nothing to take
+    if (atomic_load(&pool->large_waiting) == 0 || atomic_load(&pool->large_running) >= pool_large_limit()) {
+        return 0;
+    }
+    int taken = 0;
+    pthread_mutex_lock(&(pool->large_lock));
+    struct pool_cell *cell = &(pool->large[pool->large_head % pool->queue_size]);
+    if (atomic_load(&pool->large_waiting) > 0 && atomic_load(&pool->large_running) < pool_large_limit() &&
+        (min_wait_ns == 0 || monotonic_ns() - atomic_load_explicit(&cell->queued, memory_order_relaxed) >= min_wait_ns)) {
+        *task = cell->task;
+        pool->large_head += 1;
+        atomic_fetch_sub(&pool->large_waiting, 1);
+        atomic_fetch_add(&pool->large_running, 1);
+        taken = 1;
+    }
+    pthread_mutex_unlock(&(pool->large_lock));
+    return taken;
+}
+
+/*
+ * pool_large_done()
+ * -J: gives back the share a large task ran in, the worker looks for the next task itself
+ */
+void pool_large_done(struct threadpool_t *pool) {
+    atomic_fetch_sub(&pool->large_running, 1);
+}
+
+/*
+ * pool_queue_depth()
+ * Tasks waiting in the shared queue
+ */
+long pool_queue_depth(struct threadpool_t *pool) {
+    long depth = (long) (atomic_load(&pool->tail) - atomic_load(&pool->head));
+    return depth > 0 ? depth : 0;
+}
+
+/*
+ * pool_queue_wait_ns()
+ * How long the oldest task of the shared queue has waited, 0 when it is empty
+ */
+long long pool_queue_wait_ns(struct threadpool_t *pool) {
+    unsigned long head = atomic_load(&pool->head);
+    struct pool_cell *cell = &(pool->queue[head % pool->queue_size]);
+    if (atomic_load(&cell->sequence) != head + 1) {
+        return 0;
+    }
+    long long wait = monotonic_ns() - atomic_load_explicit(&cell->queued, memory_order_relaxed);
+    return wait > 0 ? wait : 0;
+}
+
+/*
+ * pool_overloaded()
+ * Admission control: whether a new connection should be turned away, because the shared
+ * queue is full or its oldest task has waited longer than shed_wait_ms
+ */
+int pool_overloaded(struct threadpool_t *pool) {
+    if (pool_queue_depth(pool) + atomic_load(&pool->large_waiting) >= pool->queue_size) {
+        return 1;
+    }
+    return pool->shed_wait_ms > 0 && pool_queue_wait_ns(pool) > pool->shed_wait_ms * 1000000LL;
+}
+
+/*
+ * pool_has_idle()
+ * Whether a task queued now would be taken at once, by a worker sleeping for the lack of one
+ */
+int pool_has_idle(struct threadpool_t *pool) {
+    return atomic_load(&pool->sleeping) > pool_queue_depth(pool);
+}
+
+/*
+ * pool_metrics()
+ * Writes the shared queue's state and the shedding thresholds for /metrics
+ * Returns the length written
+ */
+int pool_metrics(struct threadpool_t *pool, char *dest) {
+    return sprintf(dest, "queue_depth %ld\nqueue_size %d\nqueue_wait_ms %lld\nshed_wait_ms %d\nshed_connections %ld\n"
+                   "large_waiting %ld\nlarge_running %d\nlarge_share %d\nlarge_tasks %ld\n",
+                   pool_queue_depth(pool), pool->queue_size, pool_queue_wait_ns(pool) / 1000000, pool->shed_wait_ms,
+                   atomic_load(&stats.shed), atomic_load(&pool->large_waiting), atomic_load(&pool->large_running),
+                   pool->large_share > 0 ? pool_large_limit() : 0, atomic_load(&stats.large));
+}
+
+/*
+ * pool_has_work()
+ * Whether any task is queued anywhere in the pool, large ones only if a worker may take them
+ */
+int pool_has_work(struct threadpool_t *pool) {
+    unsigned long head = atomic_load(&pool->head);
+    if (atomic_load(&(pool->queue[head % pool->queue_size].sequence)) == head + 1) {
+        return 1;
+    }
+    if (atomic_load(&pool->large_waiting) > 0 && atomic_load(&pool->large_running) < pool_large_limit()) {
+        return 1;
+    }
+    for (int i = 0; i < pool->thread_max_size; i++) {
+        if (atomic_load(&(pool->deques[i].bottom)) > atomic_load(&(pool->deques[i].top))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * pool_signal()
+ * Wakes one sleeping worker, if there is one and no other is already being woken:
+ * the low bit of not_empty is set until a worker leaving its sleep clears it
+ */
+void pool_signal(struct threadpool_t *pool) {
+    if (atomic_load(&pool->sleeping) > 0 && (atomic_fetch_or(&pool->not_empty, 1) & 1) == 0) {
+        pool_futex_wake(&pool->not_empty, 1);
+    }
+}
+
+/*
+ * pool_wake()
+ * Makes sure a worker will look for a task just queued: one already searching will,
+ * otherwise a sleeping one is woken
+ */
+void pool_wake(struct threadpool_t *pool) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&pool->searching) == 0) {
+        pool_signal(pool);
+    }
+}
+
+/*
+ * pool_find_task()
+ * The next task for worker w: its own newest, the shared queue's oldest, or one stolen,
+ * and with -J the oldest large one when none of those is left or it waited too long
+ * Returns 0 when there was none, 2 when the task is a large one
+ */
+int pool_find_task(struct threadpool_t *pool, struct pool_worker *w, threadpool_task_t *task) {
+    if (deque_pop(w, task)) {
+        return 1;
+    }
+    atomic_fetch_add(&pool->searching, 1);
+    int found = 0;
+    if (pool_large_take(pool, task, POOL_LARGE_WAIT_MS * 1000000LL)) {
+        // starvation: small tasks keep coming, but this one has waited long enough
+        found = 2;
+    }
+    else {
+        found = pool_queue_take(pool, task);
+    }
+    for (int round = 0; !found && round < STEAL_TRIES; round++) {
+        // xorshift, each worker its own sequence of victims
+        w->seed ^= w->seed << 13;
+        w->seed ^= w->seed >> 17;
+        w->seed ^= w->seed << 5;
+        // a few random victims, then all of them from the last one on
+        int first = w->seed % pool->thread_max_size;
+        int count = round < STEAL_TRIES - 1 ? 1 : pool->thread_max_size;
+        for (int i = 0; !found && i < count; i++) {
+            struct pool_worker *victim = &(pool->deques[(first + i) % pool->thread_max_size]);
+            found = victim != w && deque_steal(victim, task);
+        }
+    }
+    if (!found && pool_large_take(pool, task, 0)) {
+        found = 2;
+    }
+    // tasks queued while we searched weren't handed to anyone else, the last searcher passes them on
+    if (atomic_fetch_sub(&pool->searching, 1) == 1 && found && pool_has_work(pool)) {
+        pool_signal(pool);
+    }
+    return found;
+}
+
+/*
+ * pool_retire()
+ * Lets an idle worker exit if the pool stays at or above its minimum without it
+ * Returns 1 when it may
+ */
+int pool_retire(struct threadpool_t *pool, struct pool_worker *w) {
+    int retire = 0;
+    pthread_mutex_lock(&(pool->thread_lock));
+    if (pool->thread_count > pool->thread_min_size) {
+        pool->thread_count -= 1;
+        w->active = 0;
+        retire = 1;
+    }
+    pthread_mutex_unlock(&(pool->thread_lock));
+    if (retire) {
+        atomic_fetch_sub(&stats.pool_threads, 1);
+        atomic_fetch_add(&stats.pool_retired, 1);
+    }
+    return retire;
+}
+
+void *threadpool_thread (void * arg) {
+    
+    struct pool_worker *w = (struct pool_worker *) arg;
+    struct threadpool_t *pool = w->pool;
+    threadpool_task_t task;
+    int found;
+
+    pthread_detach(pthread_self());
+    pin_thread(pool->specs, w - pool->deques);
+    current_worker = w;
+    while(1) {
+        if (!(found = pool_find_task(pool, w, &task))) {
+            int retire = 0;
+
+            atomic_fetch_add(&pool->sleeping, 1);
+            while (pool->poolflag == 0 && retire == 0) {
+                unsigned int seen = atomic_load(&pool->not_empty);
+                if (seen & 1) {
+                    // one worker takes the wake and goes looking, the next signal may wake another
+                    if (atomic_compare_exchange_strong(&pool->not_empty, &seen, seen + 1)) {
+                        break;
+                    }
+                    continue;
+                }
+                // a task queued before sleeping was counted is seen here, one after it sets the low bit
+                if (pool_has_work(pool)) {
+                    break;
+                }
+                if (pool_futex_wait(&pool->not_empty, seen, POOL_IDLE_SECONDS)) {
+                    retire = pool_retire(pool, w);
+                }
+            }
+            atomic_fetch_sub(&pool->sleeping, 1);
+        
+            if (pool->poolflag || retire) {
+                // the deque is empty, a later worker takes it over
+                pthread_exit(NULL);
+            }
+            continue;
+        }
+
+        w->large = found == 2;
+        (*(task.function))(task.args);
+        if (found == 2) {
+            pool_large_done(pool);
+        }
+    }
+
+    pthread_exit(NULL);
+    return NULL;
+}
+
+/*
+ * pool_grow()
+ * Starts up to count more workers, as long as the pool stays within its maximum
+ * Returns how many it started
+ */
+int pool_grow(struct threadpool_t *pool, long count) {
+    int started = 0;
+    pthread_mutex_lock(&(pool->thread_lock));
+    for (int i = 0; i < pool->thread_max_size && count > 0; i++) {
+        struct pool_worker *w = &(pool->deques[i]);
+        if (w->active) {
+            continue;
+        }
+        if (pthread_create(&(pool->workers[i]), NULL, threadpool_thread, (void *) w) != 0) {
+            break;
+        }
+        w->active = 1;
+        pool->thread_count += 1;
+        count -= 1;
+        started += 1;
+    }
+    pthread_mutex_unlock(&(pool->thread_lock));
+    atomic_fetch_add(&stats.pool_threads, started);
+    return started;
+}
+
+int threadpool_free (struct threadpool_t * pool) {
+    if (pool == NULL) {
+        return -1;
+    }
+    if (pool->queue != 0) {
+        free(pool->queue);
+    }
+    free(pool->large);
+    free(pool->deques);
+    if (pool->workers != 0) {
+        free(pool->workers);
+        pthread_mutex_lock(&(pool->thread_lock));
+        pthread_mutex_destroy(&(pool->thread_lock));
+    }
+    free(pool);
+    pool = NULL;
+    
+    return 0;
+}
+
+
+/*
+ * threadpool_push()
+ * Queues a task, on the calling worker's own deque or else on the shared queue,
+ * waiting for room when wait is 1, returning 1 right away on a full queue otherwise
+ */
+int threadpool_push(struct threadpool_t *pool, void (*function)(void *), void *args, int wait) {
+#if DEBUG == 1
+    printf("Beginning add()\n");
+#endif
+    threadpool_task_t task = { function, args };
+
+    if (pool->poolflag) {
+        return -1;
+    }
+    if (current_worker != NULL && current_worker->pool == pool && deque_push(current_worker, task) == 0) {
+        pool_wake(pool);
         return 0;
     }
-}
-
-/*
-* is_valid_content_length()
-* checks for valid content length
-*/
-int is_valid_content_length (char * start, char * end) {
-    ssize_t lengthstrlen = end - start;
-    for (int i = 0; i < (int)lengthstrlen; i++) {
-        if ( !(start[i] >= '0' && start[i] <= '9') ) {
-            return 0;
+    while (pool_queue_put(pool, task) != 0) {
+        if (wait == 0) {
+            return 1;
+        }
+        atomic_fetch_add(&pool->waiting, 1);
+        // a take that frees half the queue after waiting was counted moves not_full on
+        unsigned int seen = atomic_load(&pool->not_full);
+        long depth = (long) (atomic_load(&pool->tail) - atomic_load(&pool->head));
+        if (depth > pool->queue_size / 2 && pool->poolflag == 0) {
+            pool_futex_wait(&pool->not_full, seen, 0);
+        }
+        atomic_fetch_sub(&pool->waiting, 1);
+        if (pool->poolflag) {
+            return -1;
         }
     }
-    return 1;
+    pool_wake(pool);
+#if DEBUG == 1
+    printf("Ending add()\n");
+#endif
+    return 0;
+}
+
+int threadpool_add(struct threadpool_t *pool, void (*function)(void *), void *args) {
+    return threadpool_push(pool, function, args, 1);
+}
+
+int threadpool_try_add(struct threadpool_t *pool, void (*function)(void *), void *args) {
+    return threadpool_push(pool, function, args, 0);
 }
 
- 
 /*
-* read_http_response()
-* Reads request from client and stores information into httpObject message
-*/
-void read_http_response(int connfd, struct httpObject* message) {
-    memset(message->buffer, 0, BUFFER_SIZE);
-    int readcheck = recv(connfd, message->buffer, BUFFER_SIZE, 0);
-    char* cont = NULL;
-    cont = strstr((char *) message->buffer, "100-continue\r\n");
-    
-    char* lengthEnd = NULL;
-    char* lengthRead = NULL;
-    lengthRead = strstr((char *)message->buffer, "Content-Length: ");
+ * threadpool_add_large()
+ * -J: queues a task known to take long behind the other large ones, never waiting
+ * Returns 1 when their queue is full
+ */
+int threadpool_add_large(struct threadpool_t *pool, void (*function)(void *), void *args) {
+    threadpool_task_t task = { function, args };
 
-    if (lengthRead != NULL) {
-        lengthEnd = strstr(lengthRead+16, "\n");
+    if (pool->poolflag) {
+        return -1;
     }
-    int finalLength;
-    
-    char * method = NULL;
-    //make a copy of message buffer that we can tokenize
-    char * buffercopy;
-    buffercopy = calloc(strlen((char *)message->buffer)+1, sizeof(char));
-    strcpy(buffercopy, (char *)message->buffer);
-    method = strtok(buffercopy, " ");
-    
-    if (lengthRead != NULL && lengthEnd != NULL) {
-        //check for valid content length value, ignore lengthEnd - 1 since that's the null char
-        if (is_valid_content_length(lengthRead+16, lengthEnd-1)) {
-          sscanf(lengthRead, "Content-Length: %d", &finalLength);
-#if DEBUG == 1
-          printf("Final length: %d\n", finalLength);
-#endif
-          int total = 0;
-          int offset = readcheck;
-          while (cont && total < finalLength) {
-            readcheck = recv(connfd, message->buffer+offset+total, BUFFER_SIZE, 0);
-            total += readcheck;
-            cont = strstr((char *) message->buffer+readcheck, "100-continue\r\n");
-          }
-        } else if (strcmp(method, "PUT") == 0) {
-            //if it's a PUT, it needs to have a content length or its invalid
+    if (pool_large_put(pool, task) != 0) {
+        return 1;
+    }
+    atomic_fetch_add(&stats.large, 1);
+    // at its share the pool takes it once a large task is done, without being woken
+    if (atomic_load(&pool->large_running) < pool_large_limit()) {
+        pool_wake(pool);
+    }
+    return 0;
+}
+
+
+/*
+ * dispatcher_function()
+ * The pool controller: every POOL_TICK_MS, starts workers when tasks wait in the shared
+ * queue and no worker is idle to take them, as many as are waiting when there are
+ * POOL_GROW_DEPTH or more, one when the oldest has waited a whole tick
+ */
+void * dispatcher_function (void *pool_and_specs) {
 #if DEBUG == 1
-            printf("The request was a bad one due to invalid content length\n");
+    printf("Running dispatcher()\n");
 #endif
-            message->status_code = 400;
-        }
-    }
+    struct dispatcher_args *d_args = (struct dispatcher_args *) pool_and_specs;
+    struct threadpool_t *pool = d_args->pool;
+    struct timespec tick = { 0, POOL_TICK_MS * 1000000L };
+    unsigned long last_head = 0;
 
-    free(buffercopy);
-    
-    if (readcheck == -1) {
-      message->status_code = 500;
+    while (pool->poolflag == 0) {
+        nanosleep(&tick, NULL);
+        unsigned long head = atomic_load(&pool->head);
+        long depth = (long) (atomic_load(&pool->tail) - head);
+        if (depth > 0 && atomic_load(&pool->sleeping) == 0) {
+            if (depth >= POOL_GROW_DEPTH) {
+                atomic_fetch_add(&stats.pool_started, pool_grow(pool, depth));
+            }
+            else if (head == last_head) {
+                atomic_fetch_add(&stats.pool_started, pool_grow(pool, 1));
+            }
+        }
+        last_head = head;
     }
 
-    return;
+    return NULL;
 }
 
-/*
-* process_request()
-* Validating request, assigns status code, then performs corresponding task
-*/
-void process_request(struct httpObject* message, struct parameters* specs) {
- 
-    char methodRead[6];
-    char filenameRead[FILENAME_SIZE];
-    char httpversionRead[9];
-    char hostRead[FILENAME_SIZE];
-    struct stat st;
-       
-    int contentLengthRead = 0;
-    char * clp = NULL;
- 
-    memset(hostRead, 0, FILENAME_SIZE);
-    memset(methodRead, 0, 5);
-    memset(filenameRead, 0, FILENAME_SIZE);
-    memset(httpversionRead, 0, 9);
-       
-    /*
-    hostRead = strstr((char *) message->buffer, "Host: ");
-    
-    if (hostRead != NULL) {
-     sscanf( (char *)message->buffer, "Host: %s\n", message->host);
-     }
-     */
 
-#if DEBUG == 1
-     //printf("Message->buffer = %s\n", message->buffer);
-#endif
+struct threadpool_t * threadpool_create(int tMin, int tMax, int qMax, struct parameters* specs) {    //struct threadpool_t *pool = NULL;
 
-    sscanf((char *)message->buffer, "%s %s %s\nHost: %s", methodRead, filenameRead, httpversionRead, hostRead);
-    strcpy(message->httpversion, httpversionRead);
-    strcpy(message->host, hostRead);
-    strcpy(message->method, methodRead);
-    strcpy(message->filename, ".");
-    strcat(message->filename, filenameRead);
-
-    clp = strstr((char *) message->buffer, "Content-Length: ");
-    if (clp != NULL) {
-        sscanf(clp, "Content-Length: %d", &contentLengthRead);
-        message->content_length = contentLengthRead;
-#if DEBUG == 1
-        //printf("Content length: %d\n", contentLengthRead);
-#endif
-     }
+    struct dispatcher_args * pool_and_specs = (struct dispatcher_args *)malloc(sizeof(struct dispatcher_args));
+    pool_and_specs->specs = specs;
 
+    do {
+        pool_and_specs->pool = (struct threadpool_t *)malloc(sizeof(struct threadpool_t));
+        if (pool_and_specs->pool == NULL) {
 #if DEBUG == 1
-    //printf("message->host = %s\n", message->host);
-    //printf("message->filename = %s\n", message->filename);
+            printf("Pool failed to allocate\n");
 #endif
- 
+            break;
+        }
 
-    //if (strlen(methodRead) > 6 || strlen(filenameRead) > FILENAME_SIZE || strlen(httpversionRead) > 9 || strcmp(httpversionRead, "HTTP/1.1") != 0) {
-     if (is_bad_request(message->filename+2, message->httpversion, message->host)) {
-         //pass in message->filename+2 to ignore the first 2 chars "./"
-         message->status_code = 400;
-     }
-     else if (strcmp(methodRead, "GET") != 0 && strcmp(methodRead, "PUT") != 0 && strcmp(methodRead, "HEAD") != 0) {
-         message->status_code = 501;
-     }
-     else if (message->status_code == 400 || message->status_code == 500) {
-         return;
-     }
-     else if (strcmp("/healthcheck", filenameRead) == 0 && message->status_code != 400 && message->status_code != 501) {
+        pool_and_specs->pool->thread_count = 0;
+        pool_and_specs->pool->thread_min_size = tMin;
+        pool_and_specs->pool->thread_max_size = tMax;
+        atomic_init(&(pool_and_specs->pool->head), 0);
+        atomic_init(&(pool_and_specs->pool->tail), 0);
+        atomic_init(&(pool_and_specs->pool->sleeping), 0);
+        atomic_init(&(pool_and_specs->pool->searching), 0);
+        atomic_init(&(pool_and_specs->pool->waiting), 0);
+        atomic_init(&(pool_and_specs->pool->not_empty), 0);
+        atomic_init(&(pool_and_specs->pool->not_full), 0);
+        pool_and_specs->pool->specs = specs;
+        pool_and_specs->pool->queue_size = qMax;
+        pool_and_specs->pool->shed_wait_ms = specs->shed_wait_ms;
+        pool_and_specs->pool->poolflag = 0;
+        pool_and_specs->pool->deques = NULL;
+        pool_and_specs->pool->queue = NULL;
+        pool_and_specs->pool->large = NULL;
+        pool_and_specs->pool->large_head = 0;
+        atomic_init(&(pool_and_specs->pool->large_waiting), 0);
+        atomic_init(&(pool_and_specs->pool->large_running), 0);
+        // without -J every task is small and the large queue stays empty
+        pool_and_specs->pool->large_share = specs->large_bytes > 0;
+
+        pool_and_specs->pool->workers = (pthread_t *)malloc(sizeof(pthread_t) * tMax);
+        if (pool_and_specs->pool->workers == NULL) {
 #if DEBUG == 1
-        //printf("healthcheck() ran\n");
+            printf("Workers failed to allocate\n");
 #endif
-        //strcpy(message->filename, ".");
-        //strcat(message->filename, filenameRead);
-     
-        health_check(message, specs);
-        message->hflag = 1;
-    }
-    else if (strcmp(methodRead, "GET") == 0 || strcmp(methodRead, "HEAD") == 0) {
-      
-        strcpy(message->method, methodRead);
-        strcpy(message->filename, ".");
-        strcat(message->filename, filenameRead);
-        
-        int filedesc = open(message->filename, O_RDONLY);
-        int filespec = stat(message->filename, &st);
-        
-        if (filedesc == -1 || filespec == -1) {
-            if (errno == EACCES) {
-                message->status_code = 403;
-            }
-            else {
-            message->status_code = 404;
-            }
-        }
-        else {
-            message->content_length = st.st_size;
-            message->status_code = 200;
+            break;
         }
-    }
-    else if (strcmp(methodRead, "PUT") == 0) {
-        //int length = 0;
-        char* data;
-        //char* clp;
-        int filedesc;
-
-        strcpy(message->method, methodRead);
-        strcpy(message->filename, ".");
-        strcat(message->filename, filenameRead);
-        data = strstr((char *) message->buffer, "\r\n\r\n");
-        // if file already exists, truncate it
-        filedesc = open(message->filename, O_TRUNC | O_RDWR, 0600);
+        memset(pool_and_specs->pool->workers, 0, sizeof(pthread_t) * tMax);
+        
+        pool_and_specs->pool->queue = (struct pool_cell *)malloc(sizeof(struct pool_cell) * qMax);
+        pool_and_specs->pool->large = (struct pool_cell *)malloc(sizeof(struct pool_cell) * qMax);
+        pool_and_specs->pool->deques = aligned_alloc(64, sizeof(struct pool_worker) * tMax);
+        if (pool_and_specs->pool->queue == NULL || pool_and_specs->pool->large == NULL || pool_and_specs->pool->deques == NULL) {
 #if DEBUG == 1
-        //printf("Truncated an existing file\n");
+            printf("Queue failed to allocate\n");
 #endif
-        if (filedesc == -1) {
-            // otherwise if it doesn't exist, then create it
-            filedesc = open(message->filename, O_CREAT | O_RDWR , 0600);
+            break;
+        }
+        for (int i = 0; i < qMax; i++) {
+            atomic_init(&(pool_and_specs->pool->queue[i].sequence), i);
+        }
+        for (int i = 0; i < tMax; i++) {
+            struct pool_worker *w = &(pool_and_specs->pool->deques[i]);
+            atomic_init(&w->top, 0);
+            atomic_init(&w->bottom, 0);
+            w->pool = pool_and_specs->pool;
+            w->seed = 2463534242u + i * 2654435761u;
+            w->active = 0;
+        }
+        if (pthread_mutex_init(&(pool_and_specs->pool->thread_lock), NULL) != 0 ||
+            pthread_mutex_init(&(pool_and_specs->pool->large_lock), NULL) != 0) {
 #if DEBUG == 1
-            //printf("created new file\n");
+            printf("Thread lock failed to initiate\n");
 #endif
+            break;
         }
 
-        write(filedesc, data+4, message->content_length);
-        //close(filedesc);
-
-        message->status_code = 201;
-        
-        //log
-        pread(filedesc, message->log_body_buffer, message->content_length, 0);
+        // the server starts threadCount workers, within the pool's bounds, with -P in threads
+        // mode min_threads, the listeners serve the connections
+        int start = specs->threadCount < tMin ? tMin : (specs->threadCount > tMax ? tMax : specs->threadCount);
+        if (specs->pflag == 1 && specs->eflag == 0) {
+            start = tMin;
+        }
+        pool_grow(pool_and_specs->pool, start);
+        if (tMin < tMax) {
+            pthread_create(&(pool_and_specs->pool->dispatcher), NULL, dispatcher_function, (void*)pool_and_specs);
+            pthread_detach(pool_and_specs->pool->dispatcher);
+        }
+        return pool_and_specs->pool;
+    } while(0);
 
-        close(filedesc);
-    }
-    else {
-      message->status_code = 500;
-    }
-    return;
+    threadpool_free(pool_and_specs->pool);
+    return NULL;
 }
 
+
 /*
-* construct_http_response()
-* Creates message regarding task status
-*/
-void construct_http_response(struct httpObject* message) {
+ * Event loop mode (-E)
+ * A few reactor threads own every connection as a non-blocking socket in epoll
+ * and move it through the states below. Only the disk work (open, stat, write,
+ * log) is handed to the threadpool, so slow clients never hold a worker.
+ */
+enum connection_state {
+    READ_HEADERS,       // receiving until the end of the request headers
+    READ_BODY,          // receiving the next chunk of a PUT body
+    PROCESS,            // a pool worker owns the connection
+    WRITE_RESPONSE,     // sending the header and any body kept in message->buffer
+    WRITE_FILE,         // sending a GET body with sendfile()
+    FINISH,             // response sent, the request still has to be logged
+    KEEPALIVE,          // request done, the connection waits for the next one
+    PIPELINED,          // waiting for the next response in the connection's pipeline
+    CLOSE               // done, the reactor closes and frees it
+};
+
+struct reactor {
+    int epollfd;
+    int wakefd;                         // eventfd, written when a worker hands a connection back
+    int listenfd;                       // -P: the reactor's own SO_REUSEPORT socket, -1 without it
+    int index;                          // example: 0, which CPU of a -C list it runs on
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct connection *completed;       // connections handed back by pool workers
+    struct connection *backlog;         // connections waiting for room in the pool queue
+    struct connection *backlog_tail;
+    struct connection *idle_head;       // keep-alive connections waiting for a request, oldest first
+    struct connection *idle_tail;
+    struct threadpool_t *pool;
+    struct parameters *specs;
+};
 
-    char * lengthStr = (char*)malloc(128);
-    memset(lengthStr, 0, 128);
+struct connection {
+    int connfd;
+    int armed;                          // 0, 1 (added to the reactor's epollfd)
+    enum connection_state state;
+    struct reactor *reactor;
+    uint8_t *headers;                   // request headers while they arrive, REQUEST_HEADER_SIZE
+    ssize_t headers_length;
+    struct http_request request;        // parser state for the request at the start of headers
+    struct httpObject *message;         // only allocated once the headers are complete
+    ssize_t body_remaining;             // PUT body bytes still on the socket
+    ssize_t chunk_length;               // PUT body bytes in message->buffer waiting for a worker
+    ssize_t sent;                       // response bytes sent from header and buffer
+    off_t file_offset;                  // GET body bytes sent from message->filedesc
+    int body_failed;                    // 0, 1 (client went away in the middle of a PUT body)
+    int continue_sent;                  // 0, 1
+    void (*task)(void *);               // pool task to run while in PROCESS
+    int large;                          // 0, 1 (task goes to the pool as a large one, -J)
+    int requests;                       // requests read on this connection
+    struct pipeline *pipeline;          // pipelined requests queued behind the current one
+    int idle;                           // 0, 1 (in the reactor's idle list)
+    int sheddable;                      // 0, 1 (accepted under overload before its request was in, shed unless it is a probe)
+    time_t idle_since;
+    struct connection *idle_prev;
+    struct connection *idle_next;
+    struct connection *next;
+};
 
-    char * statusStart = NULL;
-    char * statusEnd = NULL;
-    strcat((char *)message->header, message->httpversion);
-    
-    if (message->status_code == 200) {
-      strcat((char *)message->header, " 200 OK\r\n");
-      sprintf(lengthStr, "Content-Length: %ld\r\n\r\n", message->content_length);
-      strcat((char *)message->header, lengthStr);
+/*
+ * monotonic_seconds()
+ * Clock for idle timeouts, unaffected by changes to the wall clock
+ */
+time_t monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/*
+ * connection_set_idle()
+ * Adds the connection to the end of its reactor's idle list, or takes it out
+ */
+void connection_set_idle(struct connection *conn, int idle) {
+    struct reactor *r = conn->reactor;
+
+    if (idle == conn->idle) {
+        return;
+    }
+    if (idle == 1) {
+        conn->idle_since = monotonic_seconds();
+        conn->idle_prev = r->idle_tail;
+        conn->idle_next = NULL;
+        if (r->idle_tail != NULL) {
+            r->idle_tail->idle_next = conn;
+        }
+        else {
+            r->idle_head = conn;
+        }
+        r->idle_tail = conn;
     }
     else {
-      memset(message->buffer, 0, BUFFER_SIZE);
-      switch(message->status_code) {
-        case 201:
-          strcat((char *)message->header, suc201);
-          break;
-        case 400:
-          strcat((char *)message->header, err400);
-          break;
-        case 403:
-          strcat((char *)message->header, err403);
-          break;
-        case 404:
-          strcat((char *)message->header, err404);
-          break;
-        case 501:
-          strcat((char *)message->header, err501);
-          break;
-        default:
-          strcat((char *)message->header, err500);
-          break;
-      }
-      
-      //take the status message part of the header and put that in response body
-      //status body = After first occurence of 2nd space through the first occurence of \r\n\r\n
-      // i.e: HTTP/1.1 200 Status\r\nContent-....
-      statusStart = strstr((char *) message->header, " ");
-      if (statusStart != NULL) {
-        statusStart +=1;
-        statusStart = strstr((char *) statusStart, " ");
-      }
-      statusEnd = strstr((char *) message->header, "\r");
-      if (statusStart != NULL && statusEnd != NULL) {
-          size_t responseLength = (statusEnd) - (statusStart+1);
-          char * responseStr = (char*)malloc(sizeof(char)*(responseLength+1));
-          strncpy(responseStr, statusStart+1, responseLength);
-          responseStr[responseLength] = '\0';
-          strcat((char*)message->buffer, responseStr);
-          strcat((char*)message->buffer, "\n");
-      }
-      message->content_length = strlen((char *)message->buffer);
-      sprintf(lengthStr, "Content-Length: %ld\r\n\r\n", message->content_length);
-      strcat((char *)message->header, lengthStr);
-        
-#if DEBUG == 1
-      //printf("My message buffer is currently %s\n", message->buffer);
-      //printf("I set message content length to: %zd\n", message->content_length);
-      //printf("New message header is: %s\n", (char *)message->header);
-#endif
+        if (conn->idle_prev != NULL) {
+            conn->idle_prev->idle_next = conn->idle_next;
+        }
+        else {
+            r->idle_head = conn->idle_next;
+        }
+        if (conn->idle_next != NULL) {
+            conn->idle_next->idle_prev = conn->idle_prev;
+        }
+        else {
+            r->idle_tail = conn->idle_prev;
+        }
     }
-    message->header_length = strlen((char *)message->header);
-    free(lengthStr);
-    return;
+    conn->idle = idle;
 }
 
 /*
-* send_http_response()
-* Delivers status message to client, follow up with content if available
-*/
-void send_http_response(int connfd, struct httpObject* message, struct parameters* specs) {
+ * connection_wait()
+ * Arms the connection in its reactor for one read or write event
+ * Returns -1 and sets the connection to CLOSE if it can't be, the caller goes on running it then
+ */
+int connection_wait(struct connection *conn, uint32_t events) {
+    struct epoll_event ev;
+    int op = conn->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    // set before epoll_ctl(), the reactor may run the connection before it returns
+    conn->armed = 1;
+    if (epoll_ctl(conn->reactor->epollfd, op, conn->connfd, &ev) < 0) {
+        warn("epoll_ctl error");
+        conn->state = CLOSE;
+        return -1;
+    }
+    return 0;
+}
 
-    send_full(connfd, message->header, message->header_length, -1);
+/*
+ * connection_complete()
+ * Called by a pool worker to hand the connection back to its reactor
+ */
+void connection_complete(struct connection *conn) {
+    struct reactor *r = conn->reactor;
+    uint64_t one = 1;
 
-    if (message->hflag == 1 && message->status_code == 200) {
-        write(connfd, message->buffer, message->content_length);
-    } else if (message->status_code != 200) {
-        // a response body for anything other than 200
-        send_full(connfd, message->buffer, message->content_length, -1);
-    } else if (message->content_length > 0 && strcmp("GET", message->method) == 0) {
-        // a successful get request
-        int filedesc = open(message->filename, O_RDONLY);
-        memset(message->buffer, 0, BUFFER_SIZE);
-        send_full(connfd, message->buffer, message->content_length, filedesc);
+    pthread_mutex_lock(&(r->lock));
+    conn->next = r->completed;
+    r->completed = conn;
+    pthread_mutex_unlock(&(r->lock));
+    write(r->wakefd, &one, sizeof one);
+}
 
-        if (specs->lflag == 1) {
-            pread(filedesc, message->log_body_buffer, message->content_length, 0);
-        }
+void event_process(void *arg);
+void event_store_body(void *arg);
 
-        close(filedesc);
+/*
+ * connection_queue()
+ * Queues the connection's task, a chunk of a PUT body over large_bytes as a large one (-J)
+ * Returns 1 when there is no room
+ */
+int connection_queue(struct connection *conn) {
+    struct threadpool_t *pool = conn->reactor->pool;
+    if (conn->large == 1) {
+        return threadpool_add_large(pool, conn->task, conn);
     }
+    return threadpool_try_add(pool, conn->task, conn);
 }
 
 /*
- * clear_httpObject()
- * reset all data in an httpObject
+ * connection_shed()
+ * Turns away a connection the acceptor let in under overload once its request is in
  */
-void clear_httpObject(struct httpObject* message) {
-    memset(message->host, 0, FILENAME_SIZE);
-    memset(message->method, 0, 6);
-    memset(message->filename, 0, FILENAME_SIZE);
-    memset(message->httpversion, 0, 9);
-    message->content_length = 0;
-    message->header_length = 0;
-    message->status_code = 0;
-    memset(message->header, 0, HEADER_SIZE);
-    memset(message->buffer, 0, BUFFER_SIZE);
-    memset(message->log_body_buffer, 0, BUFFER_SIZE);
-    message->hflag = 0;
+void connection_shed(struct connection *conn) {
+    if (conn->armed) {
+        epoll_ctl(conn->reactor->epollfd, EPOLL_CTL_DEL, conn->connfd, NULL);
+    }
+    connection_set_idle(conn, 0);
+    shed_connection(conn->connfd);
+    free(conn->headers);
+    free(conn);
 }
 
-typedef struct {
-    void (*function) (void *);
-    void *args;
-} threadpool_task_t;
-
-struct threadpool_t {
-    pthread_mutex_t lock;
-    pthread_mutex_t thread_lock;
-    pthread_cond_t task_queue_not_empty;
-    pthread_cond_t task_queue_not_full;
-    
-    //pthread_t dispatcher;
-    pthread_t *workers;
-    threadpool_task_t * queue;
-    
-    int idle_thread_count;
-    int busy_thread_count;
-    int exit_thread_count;
-    int thread_min_size;
-    int thread_max_size;
-    
-    int queue_size;
-    int head;
-    int tail;
-    int task_count;
-    
-    int poolflag;
-};
+/*
+ * connection_submit()
+ * Hands the connection to the pool. The reactor never blocks on a full queue,
+ * it keeps the connection in its backlog and keeps serving the others.
+ * A probe with nothing behind it is answered by the reactor itself instead, it needs no disk.
+ */
+void connection_submit(struct connection *conn, void (*task)(void *)) {
+    struct reactor *r = conn->reactor;
 
-struct dispatcher_args {
-    struct threadpool_t *pool;
-    struct parameters *specs;
-};
+    conn->state = PROCESS;
+    conn->task = task;
+    if (task == event_process && conn->request.state == HTTP_PARSE_DONE &&
+        conn->request.header_length == (size_t) conn->headers_length &&
+        is_control_request((char *) conn->headers, &(conn->request))) {
+        atomic_fetch_add(&stats.control, 1);
+        event_process(conn);
+        return;
+    }
+    if (conn->sheddable == 1) {
+        conn->sheddable = 0;
+        if (task == event_process && pool_overloaded(r->pool)) {
+            connection_shed(conn);
+            return;
+        }
+    }
+    // reading the body takes the reactor no time, writing it out is what holds a worker
+    conn->large = task == event_store_body && r->pool->large_share > 0 && conn->message->content_length > r->specs->large_bytes;
+    if (r->backlog == NULL && connection_queue(conn) == 0) {
+        return;
+    }
+    conn->next = NULL;
+    if (r->backlog == NULL) {
+        r->backlog = conn;
+    }
+    else {
+        r->backlog_tail->next = conn;
+    }
+    r->backlog_tail = conn;
+}
 
-struct task_args {
-    struct parameters *specs;
-    int connfd;
-};
+/*
+ * event_process()
+ * Pool task: validates the request and does its disk work, same as process_request()
+ */
+void event_process(void *arg) {
+    struct connection *conn = (struct connection *) arg;
+    struct parameters *specs = conn->reactor->specs;
+    // a request context is only needed once the headers are in
+    struct httpObject *message = request_context_get();
+    memcpy(message->buffer, conn->headers, conn->headers_length);
+    message->buffer[conn->headers_length] = '\0';
+    message->received_length = conn->headers_length;
+    conn->message = message;
 
+    // the reactor parsed the headers as they came in, the offsets hold in the copy
+    message->request = conn->request;
+    parse_http_headers(message);
 
+    conn->requests += 1;
+    atomic_fetch_add(&stats.requests, 1);
+    if (conn->requests > 1) {
+        atomic_fetch_add(&stats.reused, 1);
+    }
+    if (specs->idle_timeout == 0) {
+        message->keep_alive = 0;
+    }
+    else if (conn->requests >= specs->max_requests && message->keep_alive == 1) {
+        atomic_fetch_add(&stats.max_closed, 1);
+        message->keep_alive = 0;
+    }
 
-/*
-* handle_connection()
-* To perform the full task in series:
-* Read Message -> Process Request -> Create Response -> Send Response
-*/
-void handle_connection(void * pargs) {
+    // whatever came after this request stays in the header buffer for the next one
+    conn->headers_length = take_pending_bytes(message, conn->headers);
+    http_request_init(&(conn->request));
 
-    struct task_args * args = (struct task_args*) pargs;
-    struct parameters *specs = args->specs;
+    // complete GET and HEAD requests right behind a GET or HEAD go to the other workers meanwhile
+    int pipelined = 0;
+    if (conn->headers_length > 0 && message->keep_alive == 1 && message->status_code == 0 &&
+        (strcmp(message->method, "GET") == 0 || strcmp(message->method, "HEAD") == 0)) {
+        if (conn->pipeline == NULL) {
+            conn->pipeline = pipeline_create(specs, conn->reactor->pool, conn);
+        }
+        ssize_t taken = pipeline_fill(conn->pipeline, conn->headers, conn->headers_length, &(conn->requests));
+        conn->headers_length -= taken;
+        memmove(conn->headers, conn->headers + taken, conn->headers_length);
+        pipelined = taken > 0;
+    }
+    if (conn->headers_length == 0) {
+        free(conn->headers);
+        conn->headers = NULL;
+    }
 
-    int connfd = args->connfd;
-    struct httpObject *message = malloc(sizeof *message);
+    process_request(-1, message, specs);
 
-    clear_httpObject(message);
-    
-    read_http_response(connfd, message);
-    
-    process_request(message, specs);
+    if (strcmp(message->method, "PUT") == 0 && message->filedesc != -1) {
+        conn->body_remaining = store_received_body(message, message->filedesc, specs);
+        if (conn->body_remaining > 0) {
+            conn->state = READ_BODY;
+            connection_complete(conn);
+            return;
+        }
+        finish_put(message, message->filedesc, conn->body_remaining == 0, specs);
+        message->filedesc = -1;
+    }
 
+    check_keep_alive(message);
     construct_http_response(message);
-
-    send_http_response(connfd, message, specs);
-
-    if (specs->lflag == 1 && message->hflag != 1) {
-        log_request(message, specs);
+    conn->state = WRITE_RESPONSE;
+    if (pipelined == 0) {
+        connection_complete(conn);
+        return;
     }
 
-    free(message);
-    close(connfd);
-    
+    // the reactor sends this response while this worker helps with the pipelined ones
+    struct pipeline *pipeline = conn->pipeline;
+    pthread_mutex_lock(&(pipeline->lock));
+    pipeline->refs += 1;
+    pthread_mutex_unlock(&(pipeline->lock));
+    connection_complete(conn);
+    pipeline_help(pipeline);
+    pipeline_release(pipeline);
 }
 
+/*
+ * event_store_body()
+ * Pool task: writes the PUT body chunk the reactor received
+ */
+void event_store_body(void *arg) {
+    struct connection *conn = (struct connection *) arg;
+    struct httpObject *message = conn->message;
 
+    capture_log_body(message, conn->reactor->specs, message->buffer, conn->chunk_length,
+                     message->content_length - conn->body_remaining);
+    int stored = !conn->body_failed && write_full(message->filedesc, message->buffer, conn->chunk_length) >= 0;
+    conn->body_remaining -= conn->chunk_length;
+    conn->chunk_length = 0;
 
-int is_awake(pthread_t t) {
-    int kill = pthread_kill(t, 0);
-    if (kill == ESRCH) {
-        return 0;
+    if (stored && conn->body_remaining > 0) {
+        conn->state = READ_BODY;
     }
-    return 1;
+    else {
+        finish_put(message, message->filedesc, stored, conn->reactor->specs);
+        message->filedesc = -1;
+        check_keep_alive(message);
+        construct_http_response(message);
+        conn->state = WRITE_RESPONSE;
+    }
+    connection_complete(conn);
 }
 
-void *threadpool_thread (void * tPool) {
-    
-    struct threadpool_t *pool = (struct threadpool_t *) tPool;
-    threadpool_task_t task;
+/*
+ * event_finish()
+ * Pool task: logs the request once its response is sent
+ */
+void event_finish(void *arg) {
+    struct connection *conn = (struct connection *) arg;
+    struct httpObject *message = conn->message;
 
-    while(1) {
-        pthread_mutex_lock(&(pool->lock));
-        while((pool->task_count == 0) && pool->poolflag == 0) {
-            pthread_cond_wait(&(pool->task_queue_not_empty), &(pool->lock));
-            
-            if (pool->exit_thread_count > 0) {
-                pool->exit_thread_count -= 1;
-                
-                if (pool->idle_thread_count > pool->thread_min_size) {
-                    pool->idle_thread_count -= 1;
-                    pthread_mutex_unlock(&(pool->lock));
-                    pthread_exit(NULL);
+    if (message->status_code == 200 && strcmp("GET", message->method) == 0 && message->filedesc != -1) {
+        read_log_body(message, message->filedesc, conn->reactor->specs);
+    }
+    finish_request(message, conn->reactor->specs);
+
+    conn->state = message->keep_alive ? KEEPALIVE : CLOSE;
+    connection_complete(conn);
+}
+
+/*
+ * connection_run()
+ * Advances the connection until it has to wait for the socket or a pool worker
+ */
+void connection_run(struct connection *conn) {
+    struct httpObject *message = conn->message;
+    ssize_t ret;
+
+    while (1) {
+        switch (conn->state) {
+        case READ_HEADERS: {
+            // idle and slow clients only cost the small header buffer
+            if (conn->headers == NULL) {
+                conn->headers = malloc(REQUEST_HEADER_SIZE);
+                conn->headers_length = 0;
+                http_request_init(&(conn->request));
+            }
+            // a keep-alive connection may already hold the next request
+            if (http_parse_request(&(conn->request), (char *) conn->headers, conn->headers_length) != HTTP_PARSE_AGAIN) {
+                connection_submit(conn, event_process);
+                return;
+            }
+            ret = recv(conn->connfd, conn->headers + conn->headers_length, REQUEST_HEADER_SIZE - 1 - conn->headers_length, 0);
+            if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (conn->headers_length == 0 && conn->reactor->specs->idle_timeout > 0) {
+                    connection_set_idle(conn, 1);
+                }
+                if (connection_wait(conn, EPOLLIN) == 0) {
+                    return;
                 }
+                break;
+            }
+            connection_set_idle(conn, 0);
+            if (ret <= 0) {
+                conn->state = CLOSE;
+                break;
+            }
+            // the parser picks up at the line the previous recv() cut off
+            conn->headers_length += ret;
+            if (http_parse_request(&(conn->request), (char *) conn->headers, conn->headers_length) == HTTP_PARSE_AGAIN &&
+                conn->headers_length < REQUEST_HEADER_SIZE - 1) {
+                break;
             }
+            connection_submit(conn, event_process);
+            return;
         }
-        
-        if (pool->poolflag) {
-            pthread_mutex_unlock(&(pool->lock));
-            pthread_exit(NULL);
+
+        case READ_BODY:
+            if (message->cflag == 1 && conn->continue_sent == 0) {
+                send(conn->connfd, cont100, sizeof(cont100) - 1, MSG_NOSIGNAL);
+                conn->continue_sent = 1;
+            }
+            // gathers as much of the body as is ready, up to one buffer, before handing it to a worker
+            while (conn->chunk_length < conn->body_remaining && conn->chunk_length < BUFFER_SIZE) {
+                ssize_t want = conn->body_remaining - conn->chunk_length;
+                if (want > BUFFER_SIZE - conn->chunk_length) {
+                    want = BUFFER_SIZE - conn->chunk_length;
+                }
+                ret = recv(conn->connfd, message->buffer + conn->chunk_length, want, 0);
+                if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    break;
+                }
+                if (ret <= 0) {
+                    conn->body_failed = 1;
+                    break;
+                }
+                conn->chunk_length += ret;
+            }
+            if (conn->chunk_length == 0 && conn->body_failed == 0) {
+                if (connection_wait(conn, EPOLLIN) == 0) {
+                    return;
+                }
+                // the rest of the body can't be waited for, the worker finishes the PUT as failed
+                conn->body_failed = 1;
+            }
+            connection_submit(conn, event_store_body);
+            return;
+
+        case WRITE_RESPONSE: {
+            // same as send_http_response(): header and any in-memory body in one sendmsg()
+            struct iovec iov[2];
+            struct msghdr msg;
+            int flags = MSG_NOSIGNAL | (sends_file(message) ? MSG_MORE : 0);
+            memset(&msg, 0, sizeof msg);
+            msg.msg_iov = iov;
+            while ((msg.msg_iovlen = response_iov(message, conn->sent, iov)) > 0) {
+                ret = sendmsg(conn->connfd, &msg, flags);
+                if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    if (connection_wait(conn, EPOLLOUT) == 0) {
+                        return;
+                    }
+                    // the response can't be finished, the request is still logged before the close
+                    message->keep_alive = 0;
+                    break;
+                }
+                if (ret <= 0) {
+                    break;
+                }
+                conn->sent += ret;
+            }
+            if (sends_file(message) && conn->sent == message->header_length) {
+                conn->state = WRITE_FILE;
+                break;
+            }
+            conn->state = FINISH;
+            break;
         }
-        
-        task.function = pool->queue[pool->head].function;
-        task.args = pool->queue[pool->head].args;
-        
-        pool->head = (pool->head + 1) % pool->queue_size;
-        pool->task_count -= 1;
 
-        
-        pthread_cond_broadcast(&(pool->task_queue_not_full));
-        
-        pthread_mutex_unlock(&(pool->lock));
+        case WRITE_FILE:
+            while (conn->file_offset < message->content_length) {
+                ret = sendfile(conn->connfd, message->filedesc, &conn->file_offset, message->content_length - conn->file_offset);
+                if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                    if (connection_wait(conn, EPOLLOUT) == 0) {
+                        return;
+                    }
+                    // the response can't be finished, the request is still logged before the close
+                    message->keep_alive = 0;
+                    break;
+                }
+                if (ret <= 0) {
+                    break;
+                }
+            }
+            conn->state = FINISH;
+            break;
 
-        (*(task.function))(task.args);
+        case PROCESS:
+            // owned by a pool worker until it calls connection_complete()
+            return;
 
-        pthread_mutex_lock(&(pool->thread_lock));
-        pool->busy_thread_count -= 1;
-        pthread_mutex_unlock(&(pool->thread_lock));
-    }
+        case FINISH:
+            // the response is out, logging is disk work for the pool
+            if (conn->reactor->specs->lflag == 1 && message->hflag != 1) {
+                connection_submit(conn, event_finish);
+                return;
+            }
+            close_request_file(message);
+            conn->state = message->keep_alive ? KEEPALIVE : CLOSE;
+            break;
 
-    pthread_exit(NULL);
-    return NULL;
-}
+        case KEEPALIVE:
+            if (conn->pipeline != NULL) {
+                pipeline_recycle(conn->pipeline, message);
+            }
+            else {
+                request_context_put(message);
+            }
+            message = NULL;
+            conn->message = NULL;
+            conn->body_remaining = 0;
+            conn->chunk_length = 0;
+            conn->sent = 0;
+            conn->file_offset = 0;
+            conn->body_failed = 0;
+            conn->continue_sent = 0;
+            conn->state = READ_HEADERS;
+            // only this reactor takes from the pipeline, and no worker adds to it meanwhile
+            if (conn->pipeline != NULL && conn->pipeline->count > 0) {
+                conn->state = PIPELINED;
+            }
+            break;
 
-int threadpool_free (struct threadpool_t * pool) {
-    if (pool == NULL) {
-        return -1;
-    }
-    if (pool->queue != 0) {
-        free(pool->queue);
-    }
-    if (pool->workers != 0) {
-        free(pool->workers);
-        pthread_mutex_lock(&(pool->lock));
-        pthread_mutex_destroy(&(pool->lock));
-        pthread_mutex_lock(&(pool->thread_lock));
-        pthread_mutex_destroy(&(pool->thread_lock));
-        pthread_cond_destroy(&(pool->task_queue_not_full));
-        pthread_cond_destroy(&(pool->task_queue_not_empty));
+        case PIPELINED:
+            message = pipeline_take_head(conn->pipeline, 0);
+            if (message == NULL) {
+                // the worker that finishes it hands the connection back
+                return;
+            }
+            conn->message = message;
+            conn->state = WRITE_RESPONSE;
+            break;
+
+        case CLOSE:
+            if (conn->pipeline != NULL) {
+                pthread_mutex_lock(&(conn->pipeline->lock));
+                conn->pipeline->conn = NULL;
+                pthread_mutex_unlock(&(conn->pipeline->lock));
+                pipeline_release(conn->pipeline);
+            }
+            connection_set_idle(conn, 0);
+            if (conn->connfd >= 0) {
+                close(conn->connfd);
+            }
+            free(conn->headers);
+            if (message != NULL) {
+                // a GET cut short still holds its file
+                close_request_file(message);
+            }
+            request_context_put(message);
+            free(conn);
+            return;
+        }
     }
-    free(pool);
-    pool = NULL;
-    
-    return 0;
 }
 
+/*
+ * connection_create()
+ * A connection just accepted, for reactor r to start with a read in case the request is already in
+ */
+struct connection *connection_create(int connfd, struct reactor *r) {
+    set_nodelay(connfd);
+    atomic_fetch_add(&stats.connections, 1);
 
-int threadpool_add(struct threadpool_t *pool, void (*function)(void *), void *args) {
-#if DEBUG == 1
-    printf("Beginning add()\n");
-#endif
-    pthread_mutex_lock(&(pool->lock));
-        
-    while (pool->task_count == pool->queue_size && pool->poolflag == 0) {
-        pthread_cond_wait(&(pool->task_queue_not_full), &(pool->lock));
-    }
-    
-    if (pool->poolflag) {
-        pthread_mutex_unlock(&(pool->lock));
-        return -1;
+    struct connection *conn = calloc(1, sizeof(struct connection));
+    conn->connfd = connfd;
+    conn->state = READ_HEADERS;
+    conn->reactor = r;
+    return conn;
+}
+
+/*
+ * reactor_accept()
+ * -P: takes every connection waiting on the reactor's own socket, no other thread sees them
+ */
+void reactor_accept(struct reactor *r) {
+    int connfd;
+    while ((connfd = accept4(r->listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        int sheddable = 0;
+        if (pool_overloaded(r->pool)) {
+            // a probe is let in, and a connection whose request isn't in yet until it is
+            enum control_kind kind = control_request(connfd);
+            if (kind == CONTROL_NONE) {
+                shed_connection(connfd);
+                continue;
+            }
+            sheddable = kind == CONTROL_UNKNOWN;
+        }
+        struct connection *conn = connection_create(connfd, r);
+        conn->sheddable = sheddable;
+        connection_run(conn);
     }
-    
-    //printf("pool->tail]: %d \n", pool->tail);
-    if (pool->queue[pool->tail].args != NULL) {
-        //free(pool->queue[pool->tail].args);
-        pool->queue[pool->tail].args = NULL;
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        warn("accept error");
     }
-    
-    //printf("task.args connfd just before adding %d\n", ((struct task_args *)args)->connfd);
-    pool->queue[pool->tail].args = args;
-    pool->queue[pool->tail].function = function;
-    pool->tail = (pool->tail + 1) % pool->queue_size;
-    pool->task_count += 1;
-    //printf("task.args connfd %d\n", ((struct task_args *)(struct threadpool_task_t *)pool->queue[pool->head].args)->connfd);
-
-    pthread_cond_signal(&(pool->task_queue_not_empty));
-    pthread_mutex_unlock(&(pool->lock));
-#if DEBUG == 1
-    printf("Ending add()\n");
-#endif
-    return 0;
 }
 
+/*
+ * reactor_thread()
+ * Waits for socket events and for connections handed back by workers
+ */
+void *reactor_thread(void *arg) {
+    struct reactor *r = (struct reactor *) arg;
+    struct epoll_event events[EPOLL_EVENTS];
 
-//void * dispatcher_function (void *pool_and_specs) {
-void * dispatcher_function () {
-#if DEBUG == 1
-    printf("Running dispatcher()\n");
-#endif
-    //struct dispatcher_args *d_args = (struct dispatcher_args *) pool_and_specs;
-#if DEBUG == 1
-    printf("poolflag = %d\n", d_args->pool->poolflag);
-#endif
-	while(1) {
-	sleep(10);
-	}
+    int cpu = pin_thread(r->specs, r->index);
+    if (cpu >= 0 && r->listenfd >= 0) {
+        setsockopt(r->listenfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof cpu);
+    }
 
-    return NULL;
-}
+    while (1) {
+        // retry the backlog soon, the workers may free up queue room without waking this reactor;
+        // otherwise tick every second for idle connections and those turned away by any thread
+        int timeout = r->backlog != NULL ? 1 : 1000;
+        int ready = epoll_wait(r->epollfd, events, EPOLL_EVENTS, timeout);
+        for (int i = 0; i < ready; i++) {
+            if (events[i].data.ptr == r) {
+                reactor_accept(r);
+                continue;
+            }
+            if (events[i].data.ptr != NULL) {
+                connection_run((struct connection *) events[i].data.ptr);
+                continue;
+            }
 
+            uint64_t count;
+            read(r->wakefd, &count, sizeof count);
+            pthread_mutex_lock(&(r->lock));
+            struct connection *conn = r->completed;
+            r->completed = NULL;
+            pthread_mutex_unlock(&(r->lock));
 
-struct threadpool_t * threadpool_create(int tMin, int tMax, int qMax, struct parameters* specs) {    //struct threadpool_t *pool = NULL;
+            while (conn != NULL) {
+                struct connection *next = conn->next;
+                connection_run(conn);
+                conn = next;
+            }
+        }
 
-    struct dispatcher_args * pool_and_specs = (struct dispatcher_args *)malloc(sizeof(struct dispatcher_args));
-    pool_and_specs->specs = specs;
+        // the idle list is oldest first, so only its head can have timed out
+        time_t now = monotonic_seconds();
+        while (r->idle_head != NULL && now - r->idle_head->idle_since >= r->specs->idle_timeout) {
+            struct connection *conn = r->idle_head;
+            atomic_fetch_add(&stats.idle_closed, 1);
+            conn->state = CLOSE;
+            connection_run(conn);
+        }
+        shed_linger_expire();
 
-    do {
-        pool_and_specs->pool = (struct threadpool_t *)malloc(sizeof(struct threadpool_t));
-        if (pool_and_specs->pool == NULL) {
-#if DEBUG == 1
-            printf("Pool failed to allocate\n");
-#endif
-            break;
+        while (r->backlog != NULL) {
+            // a worker may hand the connection back (and reuse next) as soon as it is queued
+            struct connection *next = r->backlog->next;
+            if (connection_queue(r->backlog) != 0) {
+                break;
+            }
+            r->backlog = next;
         }
+    }
+    return NULL;
+}
 
-        pool_and_specs->pool->idle_thread_count = 0;
-        pool_and_specs->pool->busy_thread_count = 0;
-        pool_and_specs->pool->exit_thread_count = 0;
-        pool_and_specs->pool->thread_min_size = tMin;
-        pool_and_specs->pool->thread_max_size = tMax;
-        pool_and_specs->pool->task_count = 0;
-        pool_and_specs->pool->head = 0;
-        pool_and_specs->pool->tail = 0;
-        pool_and_specs->pool->queue_size = qMax;
-        pool_and_specs->pool->poolflag = 0;
+/*
+ * run_event_loop()
+ * Accepts connections and spreads them over the reactors, never returns.
+ * With -P every reactor accepts on its own socket instead, and this thread only waits.
+ */
+void run_event_loop(struct parameters *specs, struct threadpool_t *pool) {
+    struct rlimit rl;
+    struct epoll_event ev;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int reactorCount = (cpus < 1) ? 1 : (cpus > REACTOR_MAX ? REACTOR_MAX : cpus);
 
-        pool_and_specs->pool->workers = (pthread_t *)malloc(sizeof(pthread_t) * tMax);
-        if (pool_and_specs->pool->workers == NULL) {
-#if DEBUG == 1
-            printf("Workers failed to allocate\n");
-#endif
-            break;
-        }
-        memset(pool_and_specs->pool->workers, 0, sizeof(pthread_t) * tMax);
-        
-        pool_and_specs->pool->queue = (threadpool_task_t *)malloc(sizeof(threadpool_task_t) * qMax);
-        if (pool_and_specs->pool->queue == NULL) {
-#if DEBUG == 1
-            printf("Queue failed to allocate\n");
-#endif
-            break;
+    // every connection is a descriptor, allow as many as the hard limit does
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct reactor *reactors = calloc(reactorCount, sizeof(struct reactor));
+    for (int i = 0; i < reactorCount; i++) {
+        reactors[i].epollfd = epoll_create1(0);
+        reactors[i].wakefd = eventfd(0, EFD_NONBLOCK);
+        if (reactors[i].epollfd < 0 || reactors[i].wakefd < 0) {
+            err(EXIT_FAILURE, "epoll error");
         }
-        if (pthread_mutex_init(&(pool_and_specs->pool->lock), NULL) != 0 ||
-            pthread_mutex_init(&(pool_and_specs->pool->thread_lock), NULL) != 0 ||
-            pthread_cond_init(&(pool_and_specs->pool->task_queue_not_empty), NULL) != 0 ||
-            pthread_cond_init(&(pool_and_specs->pool->task_queue_not_full), NULL) != 0 )
-        {
-#if DEBUG == 1
-            printf("Locks and Conditions failed to initiate\n");
-#endif
-            break;
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(reactors[i].epollfd, EPOLL_CTL_ADD, reactors[i].wakefd, &ev);
+        reactors[i].listenfd = -1;
+        reactors[i].index = i;
+        if (specs->pflag == 1) {
+            // the first reactor takes the socket main() opened, the others open their own
+            reactors[i].listenfd = i == 0 ? specs->listenfd : create_listen_socket(specs->port, 1);
+            fcntl(reactors[i].listenfd, F_SETFL, O_NONBLOCK);
+            ev.events = EPOLLIN;
+            ev.data.ptr = &reactors[i];
+            epoll_ctl(reactors[i].epollfd, EPOLL_CTL_ADD, reactors[i].listenfd, &ev);
         }
+        pthread_mutex_init(&(reactors[i].lock), NULL);
+        reactors[i].completed = NULL;
+        reactors[i].backlog = NULL;
+        reactors[i].idle_head = NULL;
+        reactors[i].idle_tail = NULL;
+        reactors[i].pool = pool;
+        reactors[i].specs = specs;
+        pthread_create(&(reactors[i].thread), NULL, reactor_thread, (void *)&reactors[i]);
+    }
 
-        for (int i=0; i < tMax; i++) {
-            pthread_create(&(pool_and_specs->pool->workers[i]), NULL, threadpool_thread, (void*)pool_and_specs->pool);
-        }
-        //pthread_create(&(pool_and_specs->pool->dispatcher), NULL, dispatcher_function, (void*)pool_and_specs);
-        //pthread_create(&(pool_and_specs->pool->dispatcher), NULL, dispatcher_function, (void*)NULL);
-        return pool_and_specs->pool;
-    } while(0);
+    if (specs->pflag == 1) {
+        pthread_join(reactors[0].thread, NULL);
+    }
 
-    threadpool_free(pool_and_specs->pool);
-    return NULL;
+    int next = 0;
+    while (1) {
+        int connfd = accept4(specs->listenfd, NULL, NULL, SOCK_NONBLOCK);
+        if (connfd < 0) {
+            warn("accept error");
+            continue;
+        }
+        int sheddable = 0;
+        if (pool_overloaded(pool)) {
+            // a probe is let in, and a connection whose request isn't in yet until it is
+            enum control_kind kind = control_request(connfd);
+            if (kind == CONTROL_NONE) {
+                shed_connection(connfd);
+                continue;
+            }
+            sheddable = kind == CONTROL_UNKNOWN;
+        }
+        // the reactor takes it from here
+        struct connection *conn = connection_create(connfd, &reactors[next]);
+        conn->sheddable = sheddable;
+        connection_complete(conn);
+        next = (next + 1) % reactorCount;
+    }
 }
 
 
@@ -1029,7 +5121,7 @@ int main(int argc, char* argv[]) {
     uint16_t port = 0;
 
     if (argc < 2) {
-        errx(EXIT_FAILURE, "Usage: %s [-N threadCount] [-l log_file_name] port_num\n", argv[0]);
+        errx(EXIT_FAILURE, "Usage: %s [-N threadCount] [-n min_threads] [-x max_threads] [-l log_file_name] [-b] [-L log_body_bytes] [-F flush_ms] [-S fsync_ms] [-D] [-R segment_bytes] [-T segment_seconds] [-M max_segments] [-E] [-k idle_timeout] [-K max_requests] [-U] [-P] [-C cpu_list] [-Q queue_size] [-W shed_wait_ms] [-J large_bytes] port_num\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
@@ -1038,32 +5130,149 @@ int main(int argc, char* argv[]) {
     struct parameters * specs = (struct parameters *)malloc(sizeof(struct parameters));
     clear_parameters_strings(specs);
     specs->threadCount = 5;
+    specs->min_threads = 0;
+    specs->max_threads = 0;
     specs->tflag = 0;
     specs->lflag = 0;
+    specs->eflag = 0;
+    specs->idle_timeout = IDLE_TIMEOUT;
+    specs->max_requests = MAX_REQUESTS;
+    specs->uflag = 0;
+    specs->logfd = -1;
+    specs->log_flush_ms = 10;
+    specs->log_fsync_ms = -1;
+    specs->log_drop = 0;
+    specs->log_binary = 0;
+    specs->log_segment_bytes = 0;
+    specs->log_segment_seconds = 0;
+    specs->log_max_segments = 0;
+    specs->log_body_size = LOG_BODY_SIZE;
+    specs->log_writer = NULL;
     specs->listenfd = 0;
+    specs->pflag = 0;
+    specs->cpu_count = 0;
+    specs->queue_size = QUEUE_SIZE;
+    specs->shed_wait_ms = 0;
+    specs->large_bytes = 0;
     int opt;
     
 
 
     
-    while ((opt = getopt(argc, argv, "N:l:")) != -1) {
+    while ((opt = getopt(argc, argv, "N:n:x:l:bL:F:S:DR:T:M:Ek:K:UPC:Q:W:J:")) != -1) {
         switch (opt) {
             case 'N':
                 specs->tflag = 1;
                 specs->threadCount = atoi(optarg);
                 break;
+            case 'n':
+                specs->min_threads = atoi(optarg);
+                if (specs->min_threads <= 0) {
+                    errx(EXIT_FAILURE, "invalid minimum thread count: %s", optarg);
+                }
+                break;
+            case 'x':
+                specs->max_threads = atoi(optarg);
+                if (specs->max_threads <= 0) {
+                    errx(EXIT_FAILURE, "invalid maximum thread count: %s", optarg);
+                }
+                break;
             case 'l':
                 specs->lflag = 1;
                 strcpy(specs->log_file_name, optarg);
                 break;
+            case 'b':
+                specs->log_binary = 1;
+                break;
+            case 'L':
+                specs->log_body_size = atoi(optarg);
+                if (specs->log_body_size < 0 || specs->log_body_size > LOG_BODY_MAX) {
+                    errx(EXIT_FAILURE, "invalid log body size: %s", optarg);
+                }
+                break;
+            case 'F':
+                specs->log_flush_ms = atoi(optarg);
+                if (specs->log_flush_ms < 0) {
+                    errx(EXIT_FAILURE, "invalid log flush interval: %s", optarg);
+                }
+                break;
+            case 'S':
+                specs->log_fsync_ms = atoi(optarg);
+                if (specs->log_fsync_ms < 0) {
+                    errx(EXIT_FAILURE, "invalid log fsync interval: %s", optarg);
+                }
+                break;
+            case 'D':
+                specs->log_drop = 1;
+                break;
+            case 'R':
+                specs->log_segment_bytes = atoll(optarg);
+                if (specs->log_segment_bytes < 0) {
+                    errx(EXIT_FAILURE, "invalid log segment size: %s", optarg);
+                }
+                break;
+            case 'T':
+                specs->log_segment_seconds = atoi(optarg);
+                if (specs->log_segment_seconds < 0) {
+                    errx(EXIT_FAILURE, "invalid log segment age: %s", optarg);
+                }
+                break;
+            case 'M':
+                specs->log_max_segments = atoi(optarg);
+                if (specs->log_max_segments < 0) {
+                    errx(EXIT_FAILURE, "invalid number of log segments: %s", optarg);
+                }
+                break;
+            case 'E':
+                specs->eflag = 1;
+                break;
+            case 'k':
+                specs->idle_timeout = atoi(optarg);
+                break;
+            case 'K':
+                specs->max_requests = atoi(optarg);
+                if (specs->max_requests <= 0) {
+                    errx(EXIT_FAILURE, "invalid max requests per connection: %s", optarg);
+                }
+                break;
+            case 'U':
+                specs->uflag = 1;
+                break;
+            case 'P':
+                specs->pflag = 1;
+                break;
+            case 'C':
+                specs->cpu_count = parse_cpu_list(optarg, specs->cpus, CPU_LIST_MAX);
+                if (specs->cpu_count <= 0) {
+                    errx(EXIT_FAILURE, "invalid CPU list: %s", optarg);
+                }
+                break;
+            case 'Q':
+                specs->queue_size = atoi(optarg);
+                if (specs->queue_size <= 0) {
+                    errx(EXIT_FAILURE, "invalid queue size: %s", optarg);
+                }
+                break;
+            case 'W':
+                specs->shed_wait_ms = atoi(optarg);
+                if (specs->shed_wait_ms < 0) {
+                    errx(EXIT_FAILURE, "invalid queue wait: %s", optarg);
+                }
+                break;
+            case 'J':
+                specs->large_bytes = atoll(optarg);
+                if (specs->large_bytes <= 0) {
+                    errx(EXIT_FAILURE, "invalid large request size: %s", optarg);
+                }
+                break;
             default:
-                fprintf(stderr, "Usage: %s [-N threadCount] [-l log_file_name] port_num\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-N threadCount] [-n min_threads] [-x max_threads] [-l log_file_name] [-b] [-L log_body_bytes] [-F flush_ms] [-S fsync_ms] [-D] [-R segment_bytes] [-T segment_seconds] [-M max_segments] [-E] [-k idle_timeout] [-K max_requests] [-U] [-P] [-C cpu_list] [-Q queue_size] [-W shed_wait_ms] [-J large_bytes] port_num\n", argv[0]);
                 exit(EXIT_FAILURE);
             }
     }
     
     if (argv[optind] == NULL) {
-        errx(EXIT_FAILURE, "Usage: %s [-N threadCount] [-l log_file_name] port_num\n", argv[0]);
+        errx(EXIT_FAILURE, "Usage: %s [-N threadCount] [-n min_threads] [-x max_threads] [-l log_file_name] [-b] [-L log_body_bytes] [-F flush_ms] [-S fsync_ms] [-D] [-R segment_bytes] [-T segment_seconds] [-M max_segments] [-E] [-k idle_timeout] [-K max_requests] [-U] [-P] [-C cpu_list] [-Q queue_size] [-W shed_wait_ms] [-J large_bytes] port_num\n", argv[0]);
         exit(EXIT_FAILURE);
     }
     else {
@@ -1074,14 +5283,83 @@ int main(int argc, char* argv[]) {
         }
     }
     
-    specs->listenfd = create_listen_socket(port);
-    //initialize the log file if it doesn't exist yet
+    // without -n and -x the pool keeps the threadCount workers it starts with, with -P in threads
+    // mode the listeners serve the connections, the pool starts with one worker and grows for the
+    // pipelined requests and the connections they hand to the control lane
+    if (specs->min_threads == 0) {
+        int keep = specs->pflag == 1 && specs->eflag == 0 ? 1 : specs->threadCount;
+        specs->min_threads = specs->max_threads > 0 && specs->max_threads < keep ? specs->max_threads : keep;
+    }
+    if (specs->max_threads == 0) {
+        specs->max_threads = specs->threadCount > specs->min_threads ? specs->threadCount : specs->min_threads;
+    }
+    if (specs->min_threads > specs->max_threads) {
+        errx(EXIT_FAILURE, "minimum thread count %d is over the maximum %d", specs->min_threads, specs->max_threads);
+    }
+    
+    // every CPU of a -C list must be one this process may run on
+    cpu_set_t allowed;
+    if (specs->cpu_count > 0 && sched_getaffinity(0, sizeof allowed, &allowed) == 0) {
+        for (int i = 0; i < specs->cpu_count; i++) {
+            if (!CPU_ISSET(specs->cpus[i], &allowed)) {
+                errx(EXIT_FAILURE, "CPU %d is not available", specs->cpus[i]);
+            }
+        }
+    }
+    
+    specs->port = port;
+    specs->listenfd = create_listen_socket(port, specs->pflag);
+    // a client closing its socket early must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    //initialize the log file if it doesn't exist yet, the log writer keeps it open
     if (specs->lflag == 1) {
-        int logfiledesc = open(specs->log_file_name, O_CREAT | O_RDWR | O_APPEND, 0644);
-        close(logfiledesc);
+        specs->logfd = open(specs->log_file_name, O_CREAT | O_RDWR | O_APPEND, 0644);
+        if (specs->logfd == -1) {
+            err(EXIT_FAILURE, "%s", specs->log_file_name);
+        }
+        // text and binary entries never go in the same log
+        char magic[LOG_MAGIC_SIZE];
+        ssize_t magic_length = pread(specs->logfd, magic, LOG_MAGIC_SIZE, 0);
+        int binary = magic_length == LOG_MAGIC_SIZE && memcmp(magic, LOG_MAGIC, LOG_MAGIC_SIZE) == 0;
+        if (magic_length == 0 && specs->log_binary == 1) {
+            write_full(specs->logfd, (uint8_t *) LOG_MAGIC, LOG_MAGIC_SIZE);
+        }
+        else if (magic_length > 0 && binary != specs->log_binary) {
+            errx(EXIT_FAILURE, "%s is a %s log", specs->log_file_name, binary ? "binary" : "text");
+        }
+        specs->log_writer = log_writer_create(specs);
+    }
+    // the io_uring backend falls back to syscalls when the kernel doesn't have everything it needs
+    if (specs->uflag == 1) {
+        struct uring *ring = uring_create();
+        if (ring == NULL) {
+            warnx("io_uring is not available, using system calls");
+            specs->uflag = 0;
+        }
+        else {
+            uring_destroy(ring);
+        }
     }
 
-    struct threadpool_t *pool = threadpool_create(specs->threadCount, specs->threadCount, QUEUE_SIZE, specs);
+    struct threadpool_t *pool = threadpool_create(specs->min_threads, specs->max_threads, specs->queue_size, specs);
+    server_pool = pool;
+
+    if (specs->eflag == 1) {
+        run_event_loop(specs, pool);
+    }
+    control_lane_start(specs, pool);
+    if (specs->pflag == 1) {
+        // threadCount listeners, this thread is the first
+        struct listener_args *listeners = calloc(specs->threadCount, sizeof(struct listener_args));
+        for (int i = 1; i < specs->threadCount; i++) {
+            pthread_t listener;
+            listeners[i].pool = pool;
+            listeners[i].index = i;
+            pthread_create(&listener, NULL, listener_thread, (void *) &listeners[i]);
+            pthread_detach(listener);
+        }
+        serve_listener(specs, pool, specs->listenfd, 0);
+    }
 
     while (1) {
         int connfd;
@@ -1091,11 +5369,22 @@ int main(int argc, char* argv[]) {
                 warn("accept error");
                 continue;
             }
-            
-            struct task_args *t_args = (struct task_args *)malloc(sizeof(struct task_args));
-            t_args->specs = specs;
-            t_args->connfd = connfd;
-            if (threadpool_add(pool, handle_connection, (void *)t_args) != 0) {
+            atomic_fetch_add(&stats.connections, 1);
+            // probes, and connections that would wait before their request is in, go to the control lane
+            if (control_admit(connfd, 1)) {
+                continue;
+            }
+            // under overload the connection is answered here instead of waiting for room in the queue
+            if (pool_overloaded(pool)) {
+                shed_connection(connfd);
+                continue;
+            }
+            int queued = queue_connection(pool, connfd, 0, 1);
+            if (queued == 1) {
+                // -J: the large tasks' queue filled up since pool_overloaded()
+                shed_connection(connfd);
+            }
+            else if (queued != 0) {
                 return -1;
             }
         }
@@ -0,0 +1,125 @@
+/*
+ * logcat.c
+ * Prints a binary request log (httpserver -l log_file -b) in the text log format
+ *
+ * Usage: ./logcat [-F] [-m method] [-r resource] [-s status] [-c] [-t] log_file
+ *     -F              FAIL entries only
+ *     -m method       entries of one method, example: PUT
+ *     -r resource     entries of one resource, example: /file1.txt
+ *     -s status       entries with one status code, example: 404
+ *     -c              prints the number of errors and entries, as /healthcheck does, instead of the entries
+ *     -t              starts every line with the time it was logged, seconds since the epoch
+ *
+ * The log is mapped instead of read, and a record that doesn't match is skipped by its head alone.
+ */
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>         //memcmp()
+#include <stdio.h>          //fwrite()
+#include <unistd.h>         //getopt()
+#include <sys/stat.h>       //struct stat
+#include <sys/mman.h>       //mmap()
+#include <fcntl.h>          //open()
+
+#include "httplog.h"        //struct log_record
+
+#define LINE_SIZE (600 + 2 * LOG_BODY_MAX)     // longest text line: method, resource, host, length and the hex digits
+
+/*
+ * field_equals()
+ * Compares a field of a record with a NUL terminated string
+ */
+static int field_equals(const char *field, size_t length, const char *text) {
+    return text == NULL || (strlen(text) == length && memcmp(field, text, length) == 0);
+}
+
+int main(int argc, char *argv[]) {
+    const char *method = NULL;
+    const char *resource = NULL;
+    int status = 0;
+    int fail = 0;
+    int count = 0;
+    int timestamps = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "Fm:r:s:ct")) != -1) {
+        switch (opt) {
+            case 'F':
+                fail = 1;
+                break;
+            case 'm':
+                method = optarg;
+                break;
+            case 'r':
+                resource = optarg;
+                break;
+            case 's':
+                status = atoi(optarg);
+                break;
+            case 'c':
+                count = 1;
+                break;
+            case 't':
+                timestamps = 1;
+                break;
+            default:
+                errx(EXIT_FAILURE, "Usage: %s [-F] [-m method] [-r resource] [-s status] [-c] [-t] log_file", argv[0]);
+        }
+    }
+    if (argv[optind] == NULL) {
+        errx(EXIT_FAILURE, "Usage: %s [-F] [-m method] [-r resource] [-s status] [-c] [-t] log_file", argv[0]);
+    }
+
+    struct stat st;
+    int logfiledesc = open(argv[optind], O_RDONLY);
+    if (logfiledesc == -1 || fstat(logfiledesc, &st) == -1) {
+        err(EXIT_FAILURE, "%s", argv[optind]);
+    }
+    if (st.st_size < LOG_MAGIC_SIZE) {
+        errx(EXIT_FAILURE, "%s is not a binary log", argv[optind]);
+    }
+    char *start = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, logfiledesc, 0);
+    if (start == MAP_FAILED) {
+        err(EXIT_FAILURE, "mmap");
+    }
+    if (memcmp(start, LOG_MAGIC, LOG_MAGIC_SIZE) != 0) {
+        errx(EXIT_FAILURE, "%s is not a binary log", argv[optind]);
+    }
+    madvise(start, st.st_size, MADV_SEQUENTIAL);
+
+    const char *end = start + st.st_size;
+    const char *src = start + LOG_MAGIC_SIZE;
+    struct log_record record;
+    static char line[LINE_SIZE];
+    long entries = 0, errors = 0;
+
+    for (; log_record_read(src, end - src, &record); src += record.length) {
+        const char *method_field = src + sizeof record;
+        const char *resource_field = method_field + record.method_length;
+        if ((fail && !log_is_error(record.status)) || (status != 0 && record.status != status) ||
+            !field_equals(method_field, record.method_length, method) ||
+            !field_equals(resource_field, record.resource_length, resource)) {
+            continue;
+        }
+
+        entries += 1;
+        errors += log_is_error(record.status);
+        if (count) {
+            continue;
+        }
+        if (timestamps) {
+            printf("%lld.%09lld\t", (long long) record.timestamp / 1000000000, (long long) record.timestamp % 1000000000);
+        }
+        fwrite(line, 1, log_record_text(line, &record, src), stdout);
+    }
+    if (src != end) {
+        warnx("%s: %zd bytes after the last whole record", argv[optind], end - src);
+    }
+    if (count) {
+        printf("%ld\n%ld\n", errors, entries);
+    }
+
+    munmap(start, st.st_size);
+    close(logfiledesc);
+    return EXIT_SUCCESS;
+}
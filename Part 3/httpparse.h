@@ -0,0 +1,303 @@
+/*
+ * httpparse.h
+ * Single pass HTTP/1.1 request parser, shared by httpserver (Part 1, Part 2) and httpproxy (Part 3).
+ * The copy in every part is the same file.
+ *
+ * The parser never copies and never allocates. It records where the request line and the
+ * headers the programs use are in the receive buffer, as offsets, so the buffer may keep
+ * growing between calls. Each call resumes at the first line it has not finished, so a
+ * request split over any number of recv() calls is still looked at once.
+ * Headers may come in any order.
+ *
+ * Usage:
+ *     struct http_request request;
+ *     http_request_init(&request);
+ *     while (http_parse_request(&request, buffer, received) == HTTP_PARSE_AGAIN) {
+ *         received += recv(...);
+ *     }
+ */
+#ifndef HTTPPARSE_H
+#define HTTPPARSE_H
+
+#include <stddef.h>         //size_t
+#include <string.h>         //memchr()
+
+#define HTTP_PARSE_AGAIN 0      // the headers are not complete, call again once more bytes are in
+#define HTTP_PARSE_DONE 1       // the request line and headers are the first header_length bytes
+#define HTTP_PARSE_ERROR 2      // malformed request
+
+#define HTTP_MAX_CONTENT_LENGTH 1000000000000000LL
+
+/*
+    Struct http_span
+    Where a field is in the receive buffer
+*/
+struct http_span {
+    size_t offset;
+    size_t length;
+};
+
+/*
+    Struct http_request
+    Everything the parser found so far, see http_parse_request()
+*/
+struct http_request {
+    int state;                          // HTTP_PARSE_AGAIN, HTTP_PARSE_DONE, HTTP_PARSE_ERROR
+    size_t scanned;                     // start of the first line not parsed yet
+    int lines;                          // lines parsed, the request line is line 1
+    struct http_span method;            // example: GET
+    struct http_span target;            // example: /file1.txt
+    struct http_span version;           // example: HTTP/1.1
+    struct http_span host;              // example: localhost:8080
+    int has_host;                       // 0, 1
+    long long content_length;           // example: 13, -1 without a Content-Length header
+    int expect_continue;                // 0, 1 (Expect: 100-continue)
+    int connection_close;               // 0, 1 (Connection: close)
+    int connection_keep_alive;          // 0, 1 (Connection: keep-alive)
+    size_t header_length;               // request line and headers with the empty line, the body starts here
+};
+
+/*
+ * http_request_init()
+ * Prepares a request for the first http_parse_request() call
+ */
+static inline void http_request_init(struct http_request *request) {
+    memset(request, 0, sizeof *request);
+    request->content_length = -1;
+}
+
+/*
+ * http_lower()
+ * ASCII lower case, headers names and some values compare without case
+ */
+static inline char http_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/*
+ * http_is_token()
+ * Characters allowed in a method or a header name
+ */
+static inline int http_is_token(char c) {
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+        return 1;
+    }
+    switch (c) {
+        case '!': case '#': case '$': case '%': case '&': case '\'': case '*': case '+':
+        case '-': case '.': case '^': case '_': case '`': case '|': case '~':
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * http_equals_nocase()
+ * Compares length bytes at start with a lower case NUL terminated string
+ */
+static inline int http_equals_nocase(const char *start, size_t length, const char *lower) {
+    size_t i = 0;
+    for (; i < length && lower[i] != '\0'; i++) {
+        if (http_lower(start[i]) != lower[i]) {
+            return 0;
+        }
+    }
+    return i == length && lower[i] == '\0';
+}
+
+/*
+ * http_has_token()
+ * Checks a comma separated header value such as "keep-alive, Upgrade" for a token
+ */
+static inline int http_has_token(const char *value, size_t length, const char *lower) {
+    size_t start = 0;
+    while (start < length) {
+        size_t end = start;
+        while (end < length && value[end] != ',') {
+            end += 1;
+        }
+        size_t first = start, last = end;
+        while (first < last && (value[first] == ' ' || value[first] == '\t')) {
+            first += 1;
+        }
+        while (last > first && (value[last - 1] == ' ' || value[last - 1] == '\t')) {
+            last -= 1;
+        }
+        if (http_equals_nocase(value + first, last - first, lower)) {
+            return 1;
+        }
+        start = end + 1;
+    }
+    return 0;
+}
+
+/*
+ * http_parse_request_line()
+ * "METHOD target HTTP/x.y", exactly one space between the three
+ * Returns 0 if it is malformed
+ */
+static inline int http_parse_request_line(struct http_request *request, const char *buff, size_t start, size_t end) {
+    size_t i = start;
+
+    while (i < end && http_is_token(buff[i])) {
+        i += 1;
+    }
+    if (i == start || i == end || buff[i] != ' ') {
+        return 0;
+    }
+    request->method.offset = start;
+    request->method.length = i - start;
+
+    size_t target = ++i;
+    while (i < end && buff[i] != ' ' && (unsigned char) buff[i] > ' ' && buff[i] != 0x7f) {
+        i += 1;
+    }
+    if (i == target || i == end || buff[i] != ' ') {
+        return 0;
+    }
+    request->target.offset = target;
+    request->target.length = i - target;
+
+    size_t version = ++i;
+    if (end - version != 8 || memcmp(buff + version, "HTTP/", 5) != 0 ||
+        buff[version + 5] < '0' || buff[version + 5] > '9' || buff[version + 6] != '.' ||
+        buff[version + 7] < '0' || buff[version + 7] > '9') {
+        return 0;
+    }
+    request->version.offset = version;
+    request->version.length = 8;
+    return 1;
+}
+
+/*
+ * http_parse_header()
+ * "Name: value", remembers the headers the programs use
+ * Returns 0 if it is malformed
+ */
+static inline int http_parse_header(struct http_request *request, const char *buff, size_t start, size_t end) {
+    size_t colon = start;
+
+    while (colon < end && http_is_token(buff[colon])) {
+        colon += 1;
+    }
+    // no empty names, no space before the colon, no folded lines
+    if (colon == start || colon == end || buff[colon] != ':') {
+        return 0;
+    }
+
+    size_t value = colon + 1, value_end = end;
+    while (value < value_end && (buff[value] == ' ' || buff[value] == '\t')) {
+        value += 1;
+    }
+    while (value_end > value && (buff[value_end - 1] == ' ' || buff[value_end - 1] == '\t')) {
+        value_end -= 1;
+    }
+    const char *name = buff + start;
+    size_t name_length = colon - start;
+    size_t length = value_end - value;
+
+    // most headers are none of these, their length alone tells
+    if (name_length != 4 && name_length != 6 && name_length != 10 && name_length != 14) {
+        return 1;
+    }
+    if (http_equals_nocase(name, name_length, "host")) {
+        if (request->has_host) {
+            return 0;
+        }
+        request->has_host = 1;
+        request->host.offset = value;
+        request->host.length = length;
+    }
+    else if (http_equals_nocase(name, name_length, "content-length")) {
+        long long content_length = 0;
+        if (length == 0) {
+            return 0;
+        }
+        for (size_t i = value; i < value_end; i++) {
+            if (buff[i] < '0' || buff[i] > '9' || content_length > HTTP_MAX_CONTENT_LENGTH) {
+                return 0;
+            }
+            content_length = content_length * 10 + (buff[i] - '0');
+        }
+        if (request->content_length != -1 && request->content_length != content_length) {
+            return 0;
+        }
+        request->content_length = content_length;
+    }
+    else if (http_equals_nocase(name, name_length, "expect")) {
+        request->expect_continue = http_equals_nocase(buff + value, length, "100-continue");
+    }
+    else if (http_equals_nocase(name, name_length, "connection")) {
+        request->connection_close |= http_has_token(buff + value, length, "close");
+        request->connection_keep_alive |= http_has_token(buff + value, length, "keep-alive");
+    }
+    return 1;
+}
+
+/*
+ * http_parse_request()
+ * Parses the complete lines among the first length bytes of buff that the previous calls have not
+ * Returns HTTP_PARSE_AGAIN until the empty line ending the headers is in, then HTTP_PARSE_DONE,
+ * or HTTP_PARSE_ERROR as soon as anything is malformed
+ */
+static inline int http_parse_request(struct http_request *request, const char *buff, size_t length) {
+    while (request->state == HTTP_PARSE_AGAIN && request->scanned < length) {
+        const char *newline = memchr(buff + request->scanned, '\n', length - request->scanned);
+        if (newline == NULL) {
+            break;
+        }
+        size_t start = request->scanned;
+        size_t end = newline - buff;
+        request->scanned = end + 1;
+        // lines end with CRLF, a bare LF is accepted
+        if (end > start && buff[end - 1] == '\r') {
+            end -= 1;
+        }
+
+        if (request->lines == 0) {
+            // empty lines before a request, left over from a previous one, are skipped
+            if (end == start) {
+                continue;
+            }
+            request->lines = 1;
+            if (!http_parse_request_line(request, buff, start, end)) {
+                request->state = HTTP_PARSE_ERROR;
+            }
+        }
+        else if (end == start) {
+            request->header_length = request->scanned;
+            request->state = HTTP_PARSE_DONE;
+        }
+        else {
+            request->lines += 1;
+            if (!http_parse_header(request, buff, start, end)) {
+                request->state = HTTP_PARSE_ERROR;
+            }
+        }
+    }
+    return request->state;
+}
+
+/*
+ * http_span_equals()
+ * Compares a parsed field with a NUL terminated string
+ */
+static inline int http_span_equals(const char *buff, struct http_span span, const char *text) {
+    return strlen(text) == span.length && memcmp(buff + span.offset, text, span.length) == 0;
+}
+
+/*
+ * http_span_copy()
+ * Copies a parsed field into dest as a NUL terminated string
+ * Returns -1 and copies nothing if it doesn't fit in size bytes
+ */
+static inline int http_span_copy(char *dest, size_t size, const char *buff, struct http_span span) {
+    if (span.length >= size) {
+        return -1;
+    }
+    memcpy(dest, buff + span.offset, span.length);
+    dest[span.length] = '\0';
+    return 0;
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 
 #include <string.h>         //memset()
@@ -15,10 +16,16 @@
 #include <pthread.h>        //pthread
 #include <signal.h>         //pthread_kill
 #include <time.h>           //difftime
+#include <poll.h>           //poll()
+
+#include "httpparse.h"      //http_parse_request()
 
 #define BUFFER_SIZE 1024000
 #define HEADER_SIZE 1000
 #define FILENAME_SIZE 260
+#define METHOD_SIZE 16
+#define IDLE_TIMEOUT 5      // seconds a kept-alive client connection may wait for its next request
+#define MAX_REQUESTS 100    // requests served on one client connection before it is closed
 
 #define DEBUG 0
 
@@ -30,6 +37,18 @@ static const char err404[] = " 404 File Not Found\r\n";
 static const char err500[] = " 500 Internal Server Error\r\n";
 static const char err501[] = " 501 Not Implemented\r\n";
 
+// Connection reuse counters, reported by GET /metrics
+struct proxy_stats {
+    long connections;           // client connections accepted
+    long requests;              // requests read from clients
+    long reused;                // requests that came in on an already used client connection
+    long idle_closed;           // client connections closed by the idle timeout
+    long max_closed;            // client connections closed by the max requests limit
+    long upstream_connections;  // connections opened to the servers
+    long upstream_reused;       // requests sent over an already open server connection
+};
+static struct proxy_stats stats;
+
 /**
    Converts a string to an 16 bits unsigned integer.
    Returns 0 if the string is malformed or out of the range.
@@ -211,32 +230,21 @@ int is_bad_request(char * resource, char * httpversion, char * host) {
     }
 }
 
-/*
-* is_valid_content_length()
-* checks for valid content length
-*/
-int is_valid_content_length (char * start, char * end) {
-    ssize_t lengthstrlen = end - start;
-    for (int i = 0; i < (int)lengthstrlen; i++) {
-        if ( !(start[i] >= '0' && start[i] <= '9') ) {
-            return 0;
-        }
-    }
-    return 1;
-}
-
-
 struct httpObject {
     
     char host[FILENAME_SIZE];                     // example: 127.0.0.1:1234
-    char method[6];                     // PUT, HEAD, GET
+    char method[METHOD_SIZE];           // PUT, HEAD, GET
     char filename[FILENAME_SIZE];       // example: file1.txt
     char httpversion[9];                // HTTP/1.1
     ssize_t content_length;             // example: 13
     ssize_t header_length;              // example: 10
+    ssize_t received_length;            // bytes in buffer, may run into the next request
+    ssize_t request_length;             // header plus body length of this request
     int status_code;                    // example: 404
+    int keep_alive;                     // 0, 1
     uint8_t header[HEADER_SIZE];
     uint8_t buffer[BUFFER_SIZE];
+    struct http_request request;        // parser state, offsets into buffer
 };
 
 /*
@@ -245,14 +253,18 @@ struct httpObject {
  */
 void clear_httpObject(struct httpObject* message) {
     memset(message->host, 0, FILENAME_SIZE);
-    memset(message->method, 0, 6);
+    memset(message->method, 0, METHOD_SIZE);
     memset(message->filename, 0, FILENAME_SIZE);
     memset(message->httpversion, 0, 9);
     message->content_length = 0;
     message->header_length = 0;
+    message->received_length = 0;
+    message->request_length = 0;
     message->status_code = 0;
+    message->keep_alive = 0;
     memset(message->header, 0, HEADER_SIZE);
     memset(message->buffer, 0, BUFFER_SIZE);
+    http_request_init(&(message->request));
 }
 
 struct cache_item {
@@ -297,9 +309,16 @@ void clear_cache_item(int i, struct cache * c) {
 
 struct parameters {
     int serverfd;
+    int listenfd;
     int optN;
     int optR;
     int client_port;
+    int upstreamfd;             // kept-alive connection to client_port, -1 when there is none
+    int idle_timeout;           // seconds, 0 turns keep-alive off
+    int max_requests;
+    int request_count;
+    int * client_port_array;
+    int clients_count;
     struct cache *c;
 };
 
@@ -337,91 +356,78 @@ int create_client_socket(uint16_t port) {
   addr.sin_addr.s_addr = htonl(INADDR_ANY);
   addr.sin_port = htons(port);
   if (connect(clientfd, (struct sockaddr*) &addr, sizeof addr)) {
+    close(clientfd);
     return -1;
   }
   return clientfd;
 }
 
-void read_http_response(int connfd, struct httpObject* message) {
-    memset(message->buffer, 0, BUFFER_SIZE);
-    int readcheck = recv(connfd, message->buffer, BUFFER_SIZE, 0);
-    char* cont = NULL;
-    cont = strstr((char *) message->buffer, "100-continue\r\n");
-    
-    char* lengthEnd = NULL;
-    char* lengthRead = NULL;
-    lengthRead = strstr((char *)message->buffer, "Content-Length: ");
+/*
+* has_connection_close()
+* checks the headers for "Connection: close"
+*/
+int has_connection_close(char * headers) {
+    char* connectionRead = strstr(headers, "\r\nConnection: ");
+    return connectionRead != NULL && strncmp(connectionRead + 14, "close", 5) == 0;
+}
 
-    if (lengthRead != NULL) {
-        lengthEnd = strstr(lengthRead+16, "\n");
-    }
-    int finalLength;
-    
-    char * method = NULL;
-    //make a copy of message buffer that we can tokenize
-    char * buffercopy;
-    buffercopy = calloc(strlen((char *)message->buffer)+1, sizeof(char));
-    strcpy(buffercopy, (char *)message->buffer);
-    method = strtok(buffercopy, " ");
-    
-    if (lengthRead != NULL && lengthEnd != NULL) {
-        //check for valid content length value, ignore lengthEnd - 1 since that's the null char
-        if (is_valid_content_length(lengthRead+16, lengthEnd-1)) {
-          sscanf(lengthRead, "Content-Length: %d", &finalLength);
+/*
+* read_http_response()
+* Reads one request from the client, the buffer may already hold its start (see take_pending_bytes())
+*/
+void read_http_response(int connfd, struct httpObject* message) {
+    int readcheck = 0;
+    struct http_request *request = &(message->request);
+    char *buff = (char *) message->buffer;
+    int state = http_parse_request(request, buff, message->received_length);
 
-          int total = 0;
-          int offset = readcheck;
-          while (cont && total < finalLength) {
-            readcheck = recv(connfd, message->buffer+offset+total, BUFFER_SIZE, 0);
-            total += readcheck;
-            cont = strstr((char *) message->buffer+readcheck, "100-continue\r\n");
-          }
-        } else if (strcmp(method, "PUT") == 0) {
-            message->status_code = 501;
+    while (state == HTTP_PARSE_AGAIN && message->received_length < BUFFER_SIZE - 1) {
+        readcheck = recv(connfd, message->buffer + message->received_length, BUFFER_SIZE - 1 - message->received_length, 0);
+        if (readcheck <= 0) {
+            break;
         }
+        message->received_length += readcheck;
+        state = http_parse_request(request, buff, message->received_length);
+    }
+    if (message->received_length == 0) {
+        return;
     }
 
-    free(buffercopy);
-    
-    if (readcheck == -1) {
-      message->status_code = 500;
+    if (state != HTTP_PARSE_DONE) {
+        // malformed, or the headers never ended, the rest of this connection can't be trusted
+        strcpy(message->httpversion, "HTTP/1.1");
+        message->request_length = message->received_length;
+        message->keep_alive = 0;
+        message->status_code = readcheck == -1 ? 500 : 400;
+        return;
     }
-    
-    char methodRead[6];
-    char filenameRead[FILENAME_SIZE];
-    char httpversionRead[9];
-    char hostRead[FILENAME_SIZE];
-    int contentLengthRead = 0;
-    
-    memset(hostRead, 0, FILENAME_SIZE);
-    memset(methodRead, 0, 5);
-    memset(filenameRead, 0, FILENAME_SIZE);
-    memset(httpversionRead, 0, 9);
-    
-    sscanf((char *)message->buffer, "%s %s %s\nHost: %s", methodRead, filenameRead, httpversionRead, hostRead);
-    strcpy(message->httpversion, httpversionRead);
-    strcpy(message->host, hostRead);
-    strcpy(message->method, methodRead);
-    strcpy(message->filename, ".");
-    strcat(message->filename, filenameRead);
-    char * clp = NULL;
-
-    clp = strstr((char *) message->buffer, "Content-Length: ");
-    if (clp != NULL) {
-        sscanf(clp, "Content-Length: %d", &contentLengthRead);
-        message->content_length = contentLengthRead;
+
+    // the body and any request after it are never looked at, the buffer is forwarded as it is
+    message->request_length = request->header_length + (request->content_length > 0 ? request->content_length : 0);
+    message->content_length = request->content_length > 0 ? request->content_length : 0;
+    message->keep_alive = !request->connection_close;
+
+    if (http_span_copy(message->method, METHOD_SIZE, buff, request->method) < 0 ||
+        http_span_copy(message->httpversion, sizeof message->httpversion, buff, request->version) < 0 ||
+        http_span_copy(message->host, FILENAME_SIZE, buff, request->host) < 0 ||
+        http_span_copy(message->filename + 1, FILENAME_SIZE - 1, buff, request->target) < 0) {
+        strcpy(message->httpversion, "HTTP/1.1");
+        message->status_code = 400;
+        return;
     }
+    message->filename[0] = '.';
+
     if (is_bad_request(message->filename+2, message->httpversion, message->host)) {
              //pass in message->filename+2 to ignore the first 2 chars "./"
              message->status_code = 400;
     }
-    else if (strcmp(methodRead, "GET") != 0) {
+    else if (strcmp(message->method, "GET") != 0) {
         message->status_code = 501;
     }
-    else if (message->status_code == 400 || message->status_code == 500) {
-        return;
+
+    if (readcheck == -1) {
+      message->status_code = 500;
     }
-    
     return;
 }
 
@@ -440,7 +446,7 @@ void construct_http_response(struct httpObject* message) {
     
     if (message->status_code == 200) {
       strcat((char *)message->header, " 200 OK\r\n");
-      sprintf(lengthStr, "Content-Length: %ld\r\n\r\n", message->content_length);
+      sprintf(lengthStr, "Content-Length: %ld\r\n", message->content_length);
       strcat((char *)message->header, lengthStr);
     }
     else {
@@ -484,7 +490,7 @@ void construct_http_response(struct httpObject* message) {
           strcat((char*)message->buffer, "\n");
       }
       message->content_length = strlen((char *)message->buffer);
-      sprintf(lengthStr, "Content-Length: %ld\r\n\r\n", message->content_length);
+      sprintf(lengthStr, "Content-Length: %ld\r\n", message->content_length);
       strcat((char *)message->header, lengthStr);
         
 #if DEBUG == 1
@@ -493,6 +499,14 @@ void construct_http_response(struct httpObject* message) {
       //printf("New message header is: %s\n", (char *)message->header);
 #endif
     }
+    // a request that went wrong leaves the rest of the connection unreadable
+    if (message->status_code == 400 || message->status_code == 500) {
+        message->keep_alive = 0;
+    }
+    if (message->keep_alive == 0) {
+        strcat((char *)message->header, "Connection: close\r\n");
+    }
+    strcat((char *)message->header, "\r\n");
     message->header_length = strlen((char *)message->header);
     free(lengthStr);
     return;
@@ -512,6 +526,9 @@ void send_http_response(int connfd, struct httpObject* message) {
 
 void set_time(char* buffer, struct tm time) {
     char* parse_ptr = strstr(buffer, "Last-Modified: ");
+    if (parse_ptr == NULL) {
+        return;
+    }
     strptime(parse_ptr+15, "%a, %d %b %Y %H:%M:%S %z", &time);
 }
 
@@ -527,6 +544,11 @@ int is_updated(char* fname, int port, struct tm cache_time) {
 	struct tm fetched_time;
     memset(&fetched_time, 0, sizeof(struct tm));
 	char* parse_ptr = strstr((char*)buff, "Last-Modified: ");
+    close(connfd);
+    if (parse_ptr == NULL) {
+        // no way to tell, so fetch it again
+        return 0;
+    }
 //printf("crashh\n");
 //printf("buff=%s\n",buff);
 //printf("parse_ptr=%s\n",parse_ptr);
@@ -594,55 +616,336 @@ void write_cache(struct httpObject* message, struct cache * c) {
 }
 
 
-void connect_server(int clientfd, int serverfd, char *buffer) {
-	send(clientfd, buffer, strlen(buffer), 0);
+/*
+* send_proxied_response()
+* Sends a response from a server (or the cache) to the client
+* The server's Connection header only applies between the proxy and the server, so it is replaced by our own
+*/
+void send_proxied_response(int serverfd, char *buffer, ssize_t length, int keep_alive) {
+    static const char close_header[] = "\r\nConnection: close";
+    char* headerEnd = strstr(buffer, "\r\n\r\n");
+    if (headerEnd == NULL) {
+        send_full(serverfd, buffer, length, -1);
+        return;
+    }
+
+    char* connectionRead = strstr(buffer, "\r\nConnection: ");
+    if (connectionRead != NULL && connectionRead < headerEnd) {
+        char* connectionEnd = strstr(connectionRead + 2, "\r\n");
+        send_full(serverfd, buffer, connectionRead - buffer, -1);
+        send_full(serverfd, connectionEnd, headerEnd - connectionEnd, -1);
+    }
+    else {
+        send_full(serverfd, buffer, headerEnd - buffer, -1);
+    }
+    if (keep_alive == 0) {
+        send_full(serverfd, (char *)close_header, strlen(close_header), -1);
+    }
+    send_full(serverfd, headerEnd, length - (headerEnd - buffer), -1);
+}
+
+/*
+* connect_server()
+* Sends the request to the server on clientfd and relays exactly one response back to the client
+* Returns 1 when the whole response is in message->buffer (and can be cached),
+* 0 when it was too big and got streamed through, -1 when the server sent nothing
+*/
+int connect_server(int clientfd, int serverfd, struct httpObject* message, int *upstream_keep_alive) {
+    char * buffer = (char *)message->buffer;
+    ssize_t request_length = message->request_length;
+    ssize_t received = 0;
+    ssize_t ret = 0;
+    char* headerEnd = NULL;
+
+    *upstream_keep_alive = 0;
+    if (send_full(clientfd, buffer, request_length, -1) < request_length) {
+        return -1;
+    }
     memset(buffer, 0, BUFFER_SIZE);
-//printf("starting receive\n");
-	recv(clientfd, buffer, BUFFER_SIZE, 0);
-    //printf("Buffer:\n---\n%s\n---\n", buffer);
-	send_full(serverfd, buffer, BUFFER_SIZE, -1);
+
+    while (headerEnd == NULL && received < BUFFER_SIZE - 1) {
+        ret = recv(clientfd, buffer + received, BUFFER_SIZE - 1 - received, 0);
+        if (ret <= 0) {
+            if (received == 0) {
+                return -1;
+            }
+            break;
+        }
+        received += ret;
+        headerEnd = strstr(buffer, "\r\n\r\n");
+    }
+    if (headerEnd == NULL) {
+        message->keep_alive = 0;
+        send_full(serverfd, buffer, received, -1);
+        return 0;
+    }
+
+    // without a length the response only ends when the server closes, and so must ours
+    ssize_t response_length = -1;
+    headerEnd[2] = '\0';
+    char* lengthRead = strstr(buffer, "\r\nContent-Length: ");
+    if (lengthRead != NULL) {
+        response_length = headerEnd + 4 - buffer + atol(lengthRead + 18);
+    }
+    *upstream_keep_alive = response_length != -1 && !has_connection_close(buffer);
+    headerEnd[2] = '\r';
+    if (response_length == -1) {
+        message->keep_alive = 0;
+    }
+
+    while ((response_length == -1 || received < response_length) && received < BUFFER_SIZE - 1) {
+        ssize_t want = BUFFER_SIZE - 1 - received;
+        if (response_length != -1 && response_length - received < want) {
+            want = response_length - received;
+        }
+        ret = recv(clientfd, buffer + received, want, 0);
+        if (ret <= 0) {
+            break;
+        }
+        received += ret;
+    }
+    if (response_length != -1 && received < response_length && ret <= 0) {
+        // the server went away mid-response, the client can't be told how much is missing
+        *upstream_keep_alive = 0;
+        message->keep_alive = 0;
+    }
+
+    send_proxied_response(serverfd, buffer, received, message->keep_alive);
+    if (received == BUFFER_SIZE - 1 && (response_length == -1 || received < response_length)) {
+        // bigger than the buffer, pass the rest through without keeping it
+        while (response_length == -1 || received < response_length) {
+            ssize_t want = BUFFER_SIZE - 1;
+            if (response_length != -1 && response_length - received < want) {
+                want = response_length - received;
+            }
+            ret = recv(clientfd, buffer, want, 0);
+            if (ret <= 0) {
+                *upstream_keep_alive = 0;
+                message->keep_alive = 0;
+                break;
+            }
+            send_full(serverfd, buffer, ret, -1);
+            received += ret;
+        }
+        return 0;
+    }
+    return 1;
 }
 
+/*
+* upstream_is_open()
+* checks that the server has not closed a kept-alive connection while it sat unused
+*/
+int upstream_is_open(int upstreamfd) {
+    struct pollfd pfd;
+    pfd.fd = upstreamfd;
+    pfd.events = POLLIN;
+    // an idle server connection only becomes readable when the server closes it
+    return poll(&pfd, 1, 0) == 0;
+}
 
-void handle_connection(void * pargs) {
+/*
+* forward_request()
+* Sends the request to the chosen server, over the kept-alive connection to it when there is one
+* Returns what connect_server() returns
+*/
+int forward_request(struct parameters * args, struct httpObject* message) {
+    if (args->upstreamfd != -1 && !upstream_is_open(args->upstreamfd)) {
+        close(args->upstreamfd);
+        args->upstreamfd = -1;
+    }
+    if (args->upstreamfd == -1) {
+        args->upstreamfd = create_client_socket(args->client_port);
+        if (args->upstreamfd == -1) {
+            return -1;
+        }
+        stats.upstream_connections += 1;
+    }
+    else {
+        stats.upstream_reused += 1;
+    }
 
-    struct parameters * args = (struct parameters *) pargs;
+    int upstream_keep_alive = 0;
+    int ret = connect_server(args->upstreamfd, args->serverfd, message, &upstream_keep_alive);
+    if (upstream_keep_alive == 0) {
+        close(args->upstreamfd);
+        args->upstreamfd = -1;
+    }
+    return ret;
+}
+
+/*
+ * metrics()
+ * Reports the proxy counters, one "name value" per line
+ */
+void metrics(struct httpObject* message) {
+    memset(message->buffer, 0, BUFFER_SIZE);
+    sprintf((char*)message->buffer,
+            "connections %ld\nrequests %ld\nreused_requests %ld\nidle_closed %ld\nmax_requests_closed %ld\n"
+            "upstream_connections %ld\nupstream_reused_requests %ld\n",
+            stats.connections, stats.requests, stats.reused, stats.idle_closed, stats.max_closed,
+            stats.upstream_connections, stats.upstream_reused);
+    message->content_length = strlen((char*)message->buffer);
+    message->status_code = 200;
+}
+
+/*
+* take_pending_bytes()
+* Moves the bytes received after the end of this request (the start of the next one) into pending
+* Returns their length
+*/
+ssize_t take_pending_bytes(struct httpObject* message, uint8_t *pending) {
+    ssize_t length = message->received_length - message->request_length;
+    if (length <= 0) {
+        return 0;
+    }
+    memcpy(pending, message->buffer + message->request_length, length);
+    memset(message->buffer + message->request_length, 0, length);
+    message->received_length = message->request_length;
+    return length;
+}
+
+/*
+* wait_for_request()
+* Waits up to timeout seconds for the next request on a keep-alive connection
+* The proxy serves one connection at a time, so an idle one also gives way to a new client on listenfd
+* Returns 0 when the connection should be closed instead
+*/
+int wait_for_request(int connfd, int listenfd, int timeout) {
+    struct pollfd pfd[2];
+    pfd[0].fd = connfd;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd = listenfd;
+    pfd[1].events = POLLIN;
+
+    int ret;
+    do {
+        ret = poll(pfd, listenfd == -1 ? 1 : 2, timeout > 0 ? timeout * 1000 : -1);
+    } while (ret < 0 && errno == EINTR);
+    return ret > 0 && (pfd[0].revents & (POLLIN | POLLHUP)) != 0;
+}
+
+int run_healthcheck(int * array, int size);
+
+/*
+* proxy_request()
+* Answers one request, from the proxy itself, the cache or the chosen server
+*/
+void proxy_request(struct parameters * args, struct httpObject* message) {
     int serverfd = args->serverfd;
     struct cache * c = args->c;
-    
-    struct httpObject message;
-    clear_httpObject(&message);
-    
-    read_http_response(serverfd, &message);
-    if (message.status_code == 400 || message.status_code == 500 || message.status_code == 501) {
-        construct_http_response(&message);
-        send_http_response(serverfd, &message);
+
+    if (message->status_code == 400 || message->status_code == 500 || message->status_code == 501) {
+        construct_http_response(message);
+        send_http_response(serverfd, message);
+    }
+    else if (strcmp(message->filename, "./metrics") == 0) {
+        metrics(message);
+        construct_http_response(message);
+        send_http_response(serverfd, message);
+        send_full(serverfd, (char*)message->buffer, message->content_length, -1);
     }
-    else if (read_cache(&message, c, args->client_port) == 1) {
+    else if (read_cache(message, c, args->client_port) == 1) {
 	//printf("Getting from cache\n");
-        send_full(serverfd, (char*)message.buffer, strlen((char*)message.buffer), -1);
+        send_proxied_response(serverfd, (char*)message->buffer, strlen((char*)message->buffer), message->keep_alive);
     }
     else {
-        int clientfd = create_client_socket(args->client_port);
-        if (clientfd == -1) {
-            message.status_code = 500;
-            construct_http_response(&message);
-            send_http_response(serverfd, &message);
+        //printf("Connecting to server\n");
+        int cacheable = forward_request(args, message);
+        if (cacheable == -1) {
+            message->status_code = 500;
+            construct_http_response(message);
+            send_http_response(serverfd, message);
         }
-        else {
-		//printf("Connecting to server\n");            
-		connect_server(clientfd, serverfd, (char *)message.buffer);
-        	char status[3];
-		sscanf((char*)message.buffer,"HTTP/1.1 %s", status);
+        else if (cacheable == 1) {
+        	char status[4];
+		sscanf((char*)message->buffer,"HTTP/1.1 %3s", status);
 		//printf("Server completed with status code %s\n", status);
 		if (strcmp(status, "200") == 0 && c->max_size != 0 && c->capacity != 0) {    
 			//printf("Writing to cache\n");			
-			write_cache(&message, c);
+			write_cache(message, c);
 		}
         }
-        close(clientfd);
     }
+}
+
+/*
+* handle_connection()
+* Answers requests on a client connection until it closes, idles out or reaches max_requests
+*/
+void handle_connection(void * pargs) {
+
+    struct parameters * args = (struct parameters *) pargs;
+    int serverfd = args->serverfd;
     
+    struct httpObject message;
+    uint8_t *pending = NULL;            // start of the next request, read along with the current one
+    ssize_t pending_length = 0;
+    int requests = 0;
+
+    stats.connections += 1;
+
+    do {
+        clear_httpObject(&message);
+
+        if (pending_length > 0) {
+            memcpy(message.buffer, pending, pending_length);
+            message.received_length = pending_length;
+            pending_length = 0;
+        }
+        else if (args->idle_timeout > 0 && !wait_for_request(serverfd, requests > 0 ? args->listenfd : -1, args->idle_timeout)) {
+            stats.idle_closed += 1;
+            break;
+        }
+
+        read_http_response(serverfd, &message);
+        if (message.received_length == 0) {
+            // client closed the connection
+            break;
+        }
+
+        requests += 1;
+        stats.requests += 1;
+        if (requests > 1) {
+            stats.reused += 1;
+        }
+        if (args->idle_timeout == 0) {
+            message.keep_alive = 0;
+        }
+        else if (requests >= args->max_requests && message.keep_alive == 1) {
+            stats.max_closed += 1;
+            message.keep_alive = 0;
+        }
+
+        if (message.received_length > message.request_length) {
+            if (pending == NULL) {
+                pending = malloc(BUFFER_SIZE);
+            }
+            pending_length = take_pending_bytes(&message, pending);
+        }
+        else if (message.received_length < message.request_length) {
+            // only GET is proxied, a body that is still on its way is never read
+            message.keep_alive = 0;
+            message.request_length = message.received_length;
+        }
+
+        // pick the server again every optR requests
+        if (args->request_count % args->optR == 0) {
+            int best_port = run_healthcheck(args->client_port_array, args->clients_count);
+            if (best_port != args->client_port && args->upstreamfd != -1) {
+                close(args->upstreamfd);
+                args->upstreamfd = -1;
+            }
+            args->client_port = best_port;
+            //printf("Port of choice = %d\n", args->client_port);
+        }
+        args->request_count++;
+
+        proxy_request(args, &message);
+    } while (message.keep_alive == 1);
+
+    free(pending);
   	close(serverfd);
 	//printf("Ending handle()...\n");
 }
@@ -668,6 +971,11 @@ int run_healthcheck(int * array, int size) {
             recv(connfd, request_message, HEADER_SIZE, 0);
 		//printf("request_message: %s\n", request_message);
 		parse_ptr = strstr((char*) request_message, "\r\n\r\n");           
+            if (parse_ptr == NULL) {
+                // the server went away before answering
+                close(connfd);
+                continue;
+            }
 		sscanf(parse_ptr+4, "%d\n%d\n", &error_read, &entry_read);
 		//printf("Error/Entry: %d / %d \n", error_read, entry_read);
             if (entry_read < entry) {
@@ -698,12 +1006,16 @@ int main(int argc, char *argv[]) {
     args.optN = 5;
     args.optR = 5;
     args.client_port = 0;
+    args.upstreamfd = -1;
+    args.idle_timeout = IDLE_TIMEOUT;
+    args.max_requests = MAX_REQUESTS;
+    args.request_count = 0;
     int opts = 3;
     int optm = 1024;
     int clients_count = argc - 2;
 
     int opt;
-    while ((opt = getopt(argc, argv, "N:R:s:m:")) != -1) {
+    while ((opt = getopt(argc, argv, "N:R:s:m:k:K:")) != -1) {
         switch (opt) {
             case 'N':
                 if (is_positive(optarg) != 1 ) {
@@ -745,8 +1057,28 @@ int main(int argc, char *argv[]) {
                     clients_count = clients_count - 2;
                 }
                 break;
+            case 'k':
+                if (is_nonnegative(optarg) != 1 ) {
+                    errx(EXIT_FAILURE, "invalid idle timeout: -k (%s)", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                else {
+                    args.idle_timeout = atoi(optarg);
+                    clients_count = clients_count - 2;
+                }
+                break;
+            case 'K':
+                if (is_positive(optarg) != 1 ) {
+                    errx(EXIT_FAILURE, "invalid max requests per connection: -K (%s)", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                else {
+                    args.max_requests = atoi(optarg);
+                    clients_count = clients_count - 2;
+                }
+                break;
             default:
-                fprintf(stderr, "Usage: %s port [-N connections] [-R rate_of_healthcheck] [-s cache_capacity] [-m max_cache_size] servers...\n", argv[0]);
+                fprintf(stderr, "Usage: %s port [-N connections] [-R rate_of_healthcheck] [-s cache_capacity] [-m max_cache_size] [-k idle_timeout] [-K max_requests] servers...\n", argv[0]);
                 exit(EXIT_FAILURE);
             }
     }
@@ -756,7 +1088,7 @@ int main(int argc, char *argv[]) {
     }
     //else if (argv[1] == NULL) {
     else if (clients_count < 0) {
-        errx(EXIT_FAILURE, "Usage: %s port [-N connections] [-R rate_of_healthcheck] [-s cache_capacity] [-m max_cache_size] servers...\n", argv[0]);
+        errx(EXIT_FAILURE, "Usage: %s port [-N connections] [-R rate_of_healthcheck] [-s cache_capacity] [-m max_cache_size] [-k idle_timeout] [-K max_requests] servers...\n", argv[0]);
         exit(EXIT_FAILURE);
     }
     else {
@@ -789,16 +1121,16 @@ int main(int argc, char *argv[]) {
     }
     
     listenfd = create_listen_socket(port);
-    int request_count = 0;
+    // a client closing its socket early must not kill the proxy
+    signal(SIGPIPE, SIG_IGN);
     struct cache * c = (struct cache *)malloc(sizeof(struct cache));
     initialize_cache(opts, optm, c);
     args.c = c;
+    args.listenfd = listenfd;
+    args.client_port_array = client_port_array;
+    args.clients_count = clients_count;
 
     while(1) {
-        if (request_count % args.optR == 0) {
-            args.client_port = run_healthcheck(client_port_array, clients_count);
-            //printf("Port of choice = %d\n", args.client_port);
-        }
         args.serverfd = accept(listenfd, NULL, NULL);
         //printf("serverfd = %d\n", args.serverfd);
         if (args.serverfd < 0) {
@@ -806,8 +1138,10 @@ int main(int argc, char *argv[]) {
             warn("accept error");
             continue;
         }
+        // responses go out in pieces, don't let the rest wait for the first one's ACK
+        int nodelay = 1;
+        setsockopt(args.serverfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay);
         handle_connection((void*)&args);
-        request_count++;
     }
     //printf("This ended the connection\n");
     return EXIT_SUCCESS;